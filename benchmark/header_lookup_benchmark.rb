@@ -0,0 +1,55 @@
+#!/usr/bin/env ruby
+# Measures the per-header cost of Pitchfork::HttpParser on a header-heavy
+# request, most of which are memoized common fields.
+#
+#   $ bundle exec rake compile && ruby -Ilib benchmark/header_lookup_benchmark.rb
+require "pitchfork"
+
+HEADERS = {
+  "Host" => "example.com",
+  "User-Agent" => "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0",
+  "Accept" => "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8",
+  "Accept-Language" => "en-US,en;q=0.5",
+  "Accept-Encoding" => "gzip, deflate, br",
+  "Referer" => "https://example.com/",
+  "Connection" => "keep-alive",
+  "Cookie" => "session=0123456789abcdef",
+  "Upgrade-Insecure-Requests" => "1",
+  "Cache-Control" => "max-age=0",
+  "If-None-Match" => "\"abcdef\"",
+  "If-Modified-Since" => "Thu, 01 Jan 1970 00:00:00 GMT",
+  "X-Forwarded-For" => "10.0.0.1",
+  "X-Forwarded-Proto" => "https",
+  "X-Real-Ip" => "10.0.0.1",
+  "Via" => "1.1 proxy",
+  "Pragma" => "no-cache",
+  "Te" => "trailers",
+  "X-Request-Id" => "4bf92f3577b34da6a3ce929d0e0e4736",
+  "Dnt" => "1",
+}.freeze
+
+REQUEST = "GET /search?q=pitchfork HTTP/1.1\r\n" \
+  "#{HEADERS.map { |k, v| "#{k}: #{v}\r\n" }.join}\r\n".freeze
+ITERATIONS = Integer(ENV.fetch("ITERATIONS", 200_000))
+Pitchfork::HttpParser.scanner = ENV["SCANNER"].to_sym if ENV["SCANNER"]
+
+parser = Pitchfork::HttpParser.new
+run = lambda do |n|
+  n.times do
+    parser.clear
+    parser.buf << REQUEST
+    parser.parse or raise "incomplete parse"
+  end
+end
+
+run.call(ITERATIONS / 10) # warmup
+GC.start
+start = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+run.call(ITERATIONS)
+elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond) - start
+
+per_request = elapsed / ITERATIONS.to_f
+puts "scanner:         #{Pitchfork::HttpParser.scanner}"
+puts "headers/request: #{HEADERS.size}"
+puts format("ns/request:      %.1f", per_request)
+puts format("ns/header:       %.1f", per_request / HEADERS.size)
@@ -0,0 +1,98 @@
+#!/usr/bin/env ruby
+# Feeds a corpus of request heads (and bodies) through
+# Pitchfork::HttpParser and reports the time and allocations per request.
+#
+#   $ bundle exec rake compile && ruby -Ilib benchmark/parser_benchmark.rb [FILE...]
+#
+# Each corpus file holds one raw request, with LF line endings which are
+# converted to CRLF when loaded.  Every request is parsed twice: once from
+# a complete buffer with #parse, and once split in SEGMENT byte reads fed
+# to #add_parse.  Bodies are then run through #filter_body, and chunked
+# trailers through #parse.  The "trusted" mode repeats the #parse run with
+# HttpParser#trusted_upstream set, as for listeners behind a trusted proxy.
+require "objspace"
+require "pitchfork"
+
+corpus_dir = ENV.fetch("CORPUS", File.expand_path("corpus", __dir__))
+files = ARGV.empty? ? Dir[File.join(corpus_dir, "*.http")].sort : ARGV
+abort "no corpus files in #{corpus_dir}" if files.empty?
+
+ITERATIONS = Integer(ENV.fetch("ITERATIONS", 20_000))
+SEGMENT = Integer(ENV.fetch("SEGMENT", 256))
+
+def read_body(parser, env)
+  dst = +""
+  buf = parser.buf
+  until parser.body_eof?
+    parser.filter_body(dst, buf)
+    dst.clear
+    raise "truncated body" if buf.empty? && !parser.body_eof?
+  end
+  parser.parse or raise "truncated trailers" if parser.content_length.nil?
+  env
+end
+
+def run_parse(parser, request, n)
+  n.times do
+    parser.clear
+    parser.buf << request
+    env = parser.parse or raise "incomplete request"
+    read_body(parser, env)
+  end
+end
+
+def run_add_parse(parser, segments, n)
+  n.times do
+    parser.clear
+    env = nil
+    segments.each do |segment|
+      if env
+        parser.buf << segment
+      else
+        env = parser.add_parse(segment)
+      end
+    end
+    env or raise "incomplete request"
+    read_body(parser, env)
+  end
+end
+
+def measure(n)
+  yield n / 10 # warmup
+  GC.start
+
+  start = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+  yield n
+  elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond) - start
+
+  sample = [n / 10, 1].max
+  GC.start
+  GC.disable
+  objects = GC.stat(:total_allocated_objects)
+  bytes = ObjectSpace.memsize_of_all
+  yield sample
+  bytes = ObjectSpace.memsize_of_all - bytes
+  objects = GC.stat(:total_allocated_objects) - objects
+  GC.enable
+
+  [elapsed / n.to_f, objects / sample.to_f, bytes / sample.to_f]
+end
+
+puts format("%-24s %-10s %10s %10s %10s", "request", "mode", "ns/req", "objs/req", "bytes/req")
+files.each do |file|
+  request = File.binread(file).gsub(/\r?\n/, "\r\n").freeze
+  segments = request.scan(/.{1,#{SEGMENT}}/m).map(&:freeze)
+  parser = Pitchfork::HttpParser.new
+  trusted = Pitchfork::HttpParser.new
+  trusted.trusted_upstream = true
+  name = File.basename(file, ".http")
+
+  {
+    "parse" => ->(n) { run_parse(parser, request, n) },
+    "add_parse" => ->(n) { run_add_parse(parser, segments, n) },
+    "trusted" => ->(n) { run_parse(trusted, request, n) },
+  }.each do |mode, run|
+    ns, objects, bytes = measure(ITERATIONS, &run)
+    puts format("%-24s %-10s %10.1f %10.1f %10.0f", name, mode, ns, objects, bytes)
+  end
+end
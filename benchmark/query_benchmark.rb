@@ -0,0 +1,40 @@
+#!/usr/bin/env ruby
+# Compares Pitchfork::HttpParser.parse_query with Rack's
+# Rack::Utils.parse_nested_query on a few typical query strings and
+# application/x-www-form-urlencoded bodies.
+#
+#   $ bundle exec rake compile && ruby -Ilib benchmark/query_benchmark.rb
+require "pitchfork"
+require "rack/utils"
+
+QUERIES = {
+  "search" => "q=pitchfork+web+server&page=2&per_page=50&sort=relevance",
+  "utm" => "utm_source=newsletter&utm_medium=email&utm_campaign=spring%20sale" \
+           "&utm_content=hero&utm_term=shoes&ref=abc123",
+  "filters" => "filter[brand][]=acme&filter[brand][]=globex&filter[price][min]=10" \
+               "&filter[price][max]=250&filter[in_stock]=1&sort=-price",
+  "form" => "user[name]=Jane+Doe&user[email]=jane%40example.com" \
+            "&user[address][street]=1+Main+St&user[address][city]=Springfield" \
+            "&items[][sku]=A1&items[][qty]=2&items[][sku]=B2&items[][qty]=1" \
+            "&authenticity_token=#{"x" * 86}&commit=Save",
+}.freeze
+ITERATIONS = Integer(ENV.fetch("ITERATIONS", 100_000))
+
+def measure(n)
+  yield n / 10 # warmup
+  GC.start
+  start = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+  yield n
+  (Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond) - start) / n.to_f
+end
+
+puts format("%-10s %12s %12s %8s", "query", "rack ns", "pitchfork ns", "speedup")
+QUERIES.each do |name, query|
+  expect = Rack::Utils.parse_nested_query(query)
+  got = Pitchfork::HttpParser.parse_query(query)
+  got == expect or abort "#{name}: #{got.inspect} != #{expect.inspect}"
+
+  rack = measure(ITERATIONS) { |n| n.times { Rack::Utils.parse_nested_query(query) } }
+  ours = measure(ITERATIONS) { |n| n.times { Pitchfork::HttpParser.parse_query(query) } }
+  puts format("%-10s %12.1f %12.1f %7.1fx", name, rack, ours, rack / ours)
+end
@@ -0,0 +1,101 @@
+#!/usr/bin/env ruby
+# Compares writing Rack responses with one write per body chunk, as
+# Pitchfork used to, with the gathered writev(2) and sendfile(2) calls of
+# Pitchfork::HttpParser#write_response, over a local TCP connection.
+# Write syscalls are counted from /proc/self/io, so only on Linux.
+# Large String bodies are then sent with and without MSG_ZEROCOPY.
+#
+#   $ bundle exec rake compile && ruby -Ilib benchmark/response_benchmark.rb
+require "pitchfork"
+require "socket"
+require "tempfile"
+
+ITERATIONS = Integer(ENV.fetch("ITERATIONS", 20_000))
+PARTS = Integer(ENV.fetch("PARTS", 40))
+CHUNKS = Array.new(PARTS) { |i| "<li class=\"item\">item #{i}</li>\n" * 3 }.freeze
+LENGTH = CHUNKS.sum(&:bytesize).to_s
+HEADERS = { "content-type" => "text/html; charset=utf-8", "content-length" => LENGTH,
+            "cache-control" => "private, no-store", "x-request-id" => "0" * 36 }.freeze
+LARGE_SIZE = Integer(ENV.fetch("LARGE_SIZE", 8 * 1024 * 1024))
+LARGE = ["x" * LARGE_SIZE].freeze
+FILE_SIZE = Integer(ENV.fetch("FILE_SIZE", 1024 * 1024))
+FILE = Tempfile.new("response_benchmark").tap { |f| f.write("x" * FILE_SIZE); f.flush }
+
+# like Rack::Files::Iterator, responds to to_path and reads 8KiB chunks
+FileBody = Struct.new(:to_path) do
+  def each
+    File.open(to_path, "rb") do |f|
+      buf = String.new(capacity: 8192)
+      yield buf while f.read(8192, buf)
+    end
+  end
+end
+
+BODIES = {
+  "array" => [HEADERS, -> { CHUNKS }, 1],
+  "enumerable" => [HEADERS, -> { CHUNKS.each }, 1],
+  "chunked" => [HEADERS.reject { |k, _| k == "content-length" }.merge("transfer-encoding" => "chunked"),
+                -> { Pitchfork::Chunked::Body.new(CHUNKS.each) }, 1],
+  "file" => [HEADERS.merge("content-length" => FILE_SIZE.to_s),
+             -> { FileBody.new(FILE.path) }, 50],
+}.freeze
+
+def syscw
+  File.read("/proc/self/io")[/^syscw: (\d+)/, 1].to_i
+end
+
+def cpu_ns
+  Process.clock_gettime(Process::CLOCK_PROCESS_CPUTIME_ID, :nanosecond)
+end
+
+# returns the wall and CPU time and the write syscalls per iteration
+def measure(n)
+  yield n / 10 # warmup
+  GC.start
+  calls = syscw
+  cpu = cpu_ns
+  start = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+  yield n
+  ns = (Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond) - start) / n.to_f
+  [ns, (syscw - calls) / n.to_f, (cpu_ns - cpu) / n.to_f]
+end
+
+server = TCPServer.new("127.0.0.1", 0)
+client = TCPSocket.new("127.0.0.1", server.addr[1])
+sock = server.accept
+drain = fork do
+  sock.close
+  buf = String.new(capacity: 65536)
+  nil while client.read(65536, buf)
+end
+client.close
+
+req = Pitchfork::HttpParser.new
+puts format("%-11s %-9s %10s %12s", "body", "writes", "ns/resp", "syscalls/resp")
+BODIES.each do |name, (headers, body, slower)|
+  each = measure(ITERATIONS / slower) do |n|
+    n.times do
+      req.write_response(sock, 200, headers, [], true)
+      body.call.each { |chunk| sock.write(chunk) }
+    end
+  end
+  gathered = measure(ITERATIONS / slower) do |n|
+    n.times { req.write_response(sock, 200, headers, body.call, true) }
+  end
+  puts format("%-11s %-9s %10.1f %12.1f", name, "each", *each.first(2))
+  puts format("%-11s %-9s %10.1f %12.1f", name, "gathered", *gathered.first(2))
+end
+
+headers = HEADERS.merge("content-length" => LARGE_SIZE.to_s)
+puts
+puts format("%-11s %-9s %10s %12s", "body", "sends", "us/resp", "cpu us/resp")
+[["copy", 0], ["zerocopy", 1]].each do |mode, threshold|
+  Pitchfork::HttpParser.zerocopy_threshold = threshold
+  ns, _, cpu = measure(ITERATIONS / 200) do |n|
+    n.times { req.write_response(sock, 200, headers, LARGE, true) }
+  end
+  puts format("%-11s %-9s %10.1f %12.1f", "#{LARGE_SIZE >> 20}MiB", mode,
+              ns / 1000, cpu / 1000)
+end
+sock.close
+Process.waitpid(drain)
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <assert.h>
 #include <limits.h>
+#include <ctype.h>
 
 #define MIN(a,b) (a < b ? a : b)
 #define ARRAY_SIZE(x) (sizeof(x)/sizeof(x[0]))
@@ -110,6 +111,32 @@ static off_t parse_length(const char *value, size_t length)
   return rv;
 }
 
+/*
+ * decodes +len+ bytes of application/x-www-form-urlencoded data at +src+
+ * into +dst+ (which may be +src+), returns the decoded length or -1 if a
+ * '%' isn't followed by two hex digits.  Locale-agnostic.
+ */
+static long www_form_decode(char *dst, const char *src, long len)
+{
+  const char *pe = src + len;
+  char *start = dst;
+
+  for (; src < pe; src++) {
+    if (*src == '+') {
+      *dst++ = ' ';
+    } else if (*src != '%') {
+      *dst++ = *src;
+    } else if (pe - src >= 3 && isxdigit((unsigned char)src[1]) &&
+               isxdigit((unsigned char)src[2])) {
+      *dst++ = (char)(hexchar2int(src[1]) << 4 | hexchar2int(src[2]));
+      src += 2;
+    } else {
+      return -1;
+    }
+  }
+  return dst - start;
+}
+
 #define CONST_MEM_EQ(const_p, buf, len) \
   ((sizeof(const_p) - 1) == len && !memcmp(const_p, buf, sizeof(const_p) - 1))
 
@@ -3,57 +3,73 @@
 #include "ruby.h"
 #include "ruby/encoding.h"
 #include "c_util.h"
+#include "ext_help.h"
 
 struct common_field {
   const signed long len;
   const char *name;
   VALUE value;
+  VALUE *values; /* header value cache, see cached_field_value() */
+  const int cache; /* whether values may be cached */
 };
 
 /*
  * A list of common HTTP headers we expect to receive.
  * This allows us to avoid repeatedly creating identical string
- * objects to be used with rb_hash_aset().
+ * objects to be used with rb_hash_aset().  The second column tells
+ * whether values of the field may be cached, which they can't for
+ * credentials (they'd outlive their requests) nor values unlikely to
+ * repeat.
  */
+#define COMMON_HTTP_FIELDS(f) \
+  f(ACCEPT, 1) \
+  f(ACCEPT_CHARSET, 1) \
+  f(ACCEPT_ENCODING, 1) \
+  f(ACCEPT_LANGUAGE, 1) \
+  f(ALLOW, 1) \
+  f(AUTHORIZATION, 0) \
+  f(CACHE_CONTROL, 1) \
+  f(CONNECTION, 1) \
+  f(CONTENT_ENCODING, 1) \
+  f(CONTENT_LENGTH, 0) \
+  f(CONTENT_TYPE, 1) \
+  f(COOKIE, 0) \
+  f(DATE, 0) \
+  f(EXPECT, 1) \
+  f(FROM, 0) \
+  f(HOST, 0) \
+  f(IF_MATCH, 0) \
+  f(IF_MODIFIED_SINCE, 0) \
+  f(IF_NONE_MATCH, 0) \
+  f(IF_RANGE, 0) \
+  f(IF_UNMODIFIED_SINCE, 0) \
+  f(KEEP_ALIVE, 1) /* Firefox sends this */ \
+  f(MAX_FORWARDS, 1) \
+  f(PRAGMA, 1) \
+  f(PROXY_AUTHORIZATION, 0) \
+  f(RANGE, 0) \
+  f(REFERER, 0) \
+  f(TE, 1) \
+  f(TRAILER, 1) \
+  f(TRANSFER_ENCODING, 1) \
+  f(UPGRADE, 1) \
+  f(USER_AGENT, 1) \
+  f(VIA, 1) \
+  f(X_FORWARDED_FOR, 0) /* common for proxies */ \
+  f(X_FORWARDED_PROTO, 1) /* common for proxies */ \
+  f(X_REAL_IP, 0) /* common for proxies */ \
+  f(WARNING, 1)
+
+enum common_field_index {
+# define f(N, CACHE) CF_##N,
+  COMMON_HTTP_FIELDS(f)
+# undef f
+  CF_NONE = -1
+};
+
 static struct common_field common_http_fields[] = {
-# define f(N) { (sizeof(N) - 1), N, Qnil }
-  f("ACCEPT"),
-  f("ACCEPT_CHARSET"),
-  f("ACCEPT_ENCODING"),
-  f("ACCEPT_LANGUAGE"),
-  f("ALLOW"),
-  f("AUTHORIZATION"),
-  f("CACHE_CONTROL"),
-  f("CONNECTION"),
-  f("CONTENT_ENCODING"),
-  f("CONTENT_LENGTH"),
-  f("CONTENT_TYPE"),
-  f("COOKIE"),
-  f("DATE"),
-  f("EXPECT"),
-  f("FROM"),
-  f("HOST"),
-  f("IF_MATCH"),
-  f("IF_MODIFIED_SINCE"),
-  f("IF_NONE_MATCH"),
-  f("IF_RANGE"),
-  f("IF_UNMODIFIED_SINCE"),
-  f("KEEP_ALIVE"), /* Firefox sends this */
-  f("MAX_FORWARDS"),
-  f("PRAGMA"),
-  f("PROXY_AUTHORIZATION"),
-  f("RANGE"),
-  f("REFERER"),
-  f("TE"),
-  f("TRAILER"),
-  f("TRANSFER_ENCODING"),
-  f("UPGRADE"),
-  f("USER_AGENT"),
-  f("VIA"),
-  f("X_FORWARDED_FOR"), /* common for proxies */
-  f("X_FORWARDED_PROTO"), /* common for proxies */
-  f("X_REAL_IP"), /* common for proxies */
-  f("WARNING")
+# define f(N, CACHE) { (sizeof(#N) - 1), #N, Qnil, NULL, CACHE },
+  COMMON_HTTP_FIELDS(f)
 # undef f
 };
 
@@ -78,6 +94,233 @@ static VALUE str_new_dd_freeze(const char *ptr, long len)
 }
 #endif
 
+/*
+ * Maps an upcased field name to its index in common_http_fields.
+ * This is called for every header set, so rather than scanning the
+ * whole table we dispatch on the length and first byte of the name,
+ * leaving at most two candidates to memcmp() against.
+ */
+static enum common_field_index common_field_index(const char *field,
+                                                  size_t flen)
+{
+#define CF_MATCH(N) do { \
+  if (!memcmp(field, #N, sizeof(#N) - 1)) return CF_##N; \
+} while (0)
+
+  switch (flen) {
+  case 2:
+    CF_MATCH(TE);
+    break;
+  case 3:
+    CF_MATCH(VIA);
+    break;
+  case 4:
+    switch (*field) {
+    case 'D': CF_MATCH(DATE); break;
+    case 'F': CF_MATCH(FROM); break;
+    case 'H': CF_MATCH(HOST); break;
+    }
+    break;
+  case 5:
+    switch (*field) {
+    case 'A': CF_MATCH(ALLOW); break;
+    case 'R': CF_MATCH(RANGE); break;
+    }
+    break;
+  case 6:
+    switch (*field) {
+    case 'A': CF_MATCH(ACCEPT); break;
+    case 'C': CF_MATCH(COOKIE); break;
+    case 'E': CF_MATCH(EXPECT); break;
+    case 'P': CF_MATCH(PRAGMA); break;
+    }
+    break;
+  case 7:
+    switch (*field) {
+    case 'R': CF_MATCH(REFERER); break;
+    case 'T': CF_MATCH(TRAILER); break;
+    case 'U': CF_MATCH(UPGRADE); break;
+    case 'W': CF_MATCH(WARNING); break;
+    }
+    break;
+  case 8:
+    if (*field == 'I') {
+      CF_MATCH(IF_MATCH);
+      CF_MATCH(IF_RANGE);
+    }
+    break;
+  case 9:
+    CF_MATCH(X_REAL_IP);
+    break;
+  case 10:
+    switch (*field) {
+    case 'C': CF_MATCH(CONNECTION); break;
+    case 'K': CF_MATCH(KEEP_ALIVE); break;
+    case 'U': CF_MATCH(USER_AGENT); break;
+    }
+    break;
+  case 12:
+    switch (*field) {
+    case 'C': CF_MATCH(CONTENT_TYPE); break;
+    case 'M': CF_MATCH(MAX_FORWARDS); break;
+    }
+    break;
+  case 13:
+    switch (*field) {
+    case 'A': CF_MATCH(AUTHORIZATION); break;
+    case 'C': CF_MATCH(CACHE_CONTROL); break;
+    case 'I': CF_MATCH(IF_NONE_MATCH); break;
+    }
+    break;
+  case 14:
+    switch (*field) {
+    case 'A': CF_MATCH(ACCEPT_CHARSET); break;
+    case 'C': CF_MATCH(CONTENT_LENGTH); break;
+    }
+    break;
+  case 15:
+    switch (*field) {
+    case 'A':
+      CF_MATCH(ACCEPT_ENCODING);
+      CF_MATCH(ACCEPT_LANGUAGE);
+      break;
+    case 'X': CF_MATCH(X_FORWARDED_FOR); break;
+    }
+    break;
+  case 16:
+    CF_MATCH(CONTENT_ENCODING);
+    break;
+  case 17:
+    switch (*field) {
+    case 'I': CF_MATCH(IF_MODIFIED_SINCE); break;
+    case 'T': CF_MATCH(TRANSFER_ENCODING); break;
+    case 'X': CF_MATCH(X_FORWARDED_PROTO); break;
+    }
+    break;
+  case 19:
+    switch (*field) {
+    case 'I': CF_MATCH(IF_UNMODIFIED_SINCE); break;
+    case 'P': CF_MATCH(PROXY_AUTHORIZATION); break;
+    }
+    break;
+  }
+#undef CF_MATCH
+  return CF_NONE;
+}
+
+/*
+ * Deployment-specific header names registered at boot time with
+ * Pitchfork::HttpParser.intern_headers.  This is a small open-addressing
+ * table which is only consulted for names missing from
+ * common_http_fields, and is never modified once workers are forked,
+ * so its keys are shared copy-on-write by every worker.
+ */
+struct interned_field {
+  long len;
+  char *name;
+  VALUE value;
+  VALUE *values; /* header value cache, see cached_field_value() */
+};
+
+static struct interned_field *interned_fields;
+static unsigned long interned_capa; /* always zero or a power of two */
+static unsigned long interned_count;
+
+/* FNV-1a, field names are short and already upcased */
+static unsigned long field_hash(const char *field, size_t flen)
+{
+  unsigned long h = 2166136261UL;
+
+  while (flen--) {
+    h ^= (unsigned char)*field++;
+    h *= 16777619UL;
+  }
+  return h;
+}
+
+static struct interned_field *
+interned_field_slot(struct interned_field *tbl, unsigned long capa,
+                    const char *field, size_t flen)
+{
+  unsigned long mask = capa - 1;
+  unsigned long i = field_hash(field, flen) & mask;
+
+  for (;; i = (i + 1) & mask) {
+    struct interned_field *f = &tbl[i];
+
+    if (!f->name ||
+        (f->len == (long)flen && !memcmp(f->name, field, flen)))
+      return f;
+  }
+}
+
+/* this function is called for every header missing from the common fields */
+static struct interned_field *find_interned_field(const char *field,
+                                                  size_t flen)
+{
+  struct interned_field *f;
+
+  if (interned_count == 0)
+    return NULL;
+
+  f = interned_field_slot(interned_fields, interned_capa, field, flen);
+  return f->name ? f : NULL;
+}
+
+/*
+ * this function is called for every header set, +values+ is set to
+ * the value cache of the field if it is memoized
+ */
+static VALUE find_field(const char *field, size_t flen, VALUE ***values)
+{
+  enum common_field_index i = common_field_index(field, flen);
+  struct interned_field *f;
+
+  if (i != CF_NONE) {
+    *values = common_http_fields[i].cache ?
+              &common_http_fields[i].values : NULL;
+    return common_http_fields[i].value;
+  }
+  f = find_interned_field(field, flen);
+  if (f) {
+    *values = &f->values;
+    return f->value;
+  }
+  *values = NULL;
+  return Qnil;
+}
+
+static VALUE find_common_field(const char *field, size_t flen)
+{
+  VALUE **values;
+
+  return find_field(field, flen, &values);
+}
+
+static void interned_fields_grow(void)
+{
+  unsigned long i, capa = interned_capa ? interned_capa * 2 : 16;
+  struct interned_field *tbl = ALLOC_N(struct interned_field, capa);
+
+  MEMZERO(tbl, struct interned_field, capa);
+  for (i = 0; i < interned_capa; i++) {
+    struct interned_field *f = &interned_fields[i];
+
+    if (f->name)
+      *interned_field_slot(tbl, capa, f->name, f->len) = *f;
+  }
+  xfree(interned_fields);
+  interned_fields = tbl;
+  interned_capa = capa;
+}
+
+static int is_token_char(char c)
+{
+  if (c <= 0x20 || c >= 0x7f)
+    return 0;
+  return !strchr("()<>@,;:\\\"/[]?={}", c);
+}
+
 /* this function is not performance-critical, called only at load time */
 static void init_common_fields(void)
 {
@@ -97,22 +340,170 @@ static void init_common_fields(void)
       cf->value = str_new_dd_freeze(tmp, HTTP_PREFIX_LEN + cf->len);
     }
     rb_gc_register_mark_object(cf->value);
+    assert(common_field_index(cf->name, cf->len) == cf - common_http_fields &&
+           "common field missing from common_field_index()");
   }
 }
 
-/* this function is called for every header set */
-static VALUE find_common_field(const char *field, size_t flen)
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.intern_headers(names) => Array
+ *
+ * Registers additional request header names (e.g. "X-Request-Id")
+ * whose Rack env keys ("HTTP_X_REQUEST_ID") will be frozen, deduplicated
+ * and reused for every request rather than allocated for each of them.
+ *
+ * This should be called before workers are forked, either from the
+ * configuration file or from the +after_mold_fork+ callback, so
+ * every worker shares the same keys.  Returns the Array of env keys.
+ */
+static VALUE intern_headers(VALUE self, VALUE names)
 {
-  int i;
-  struct common_field *cf = common_http_fields;
+  long i;
+  VALUE keys = rb_ary_new();
+  char tmp[HTTP_PREFIX_LEN + 256];
 
-  for(i = ARRAY_SIZE(common_http_fields); --i >= 0; cf++) {
-    if (cf->len == (long)flen && !memcmp(cf->name, field, flen))
-      return cf->value;
+  Check_Type(names, T_ARRAY);
+  memcpy(tmp, HTTP_PREFIX, HTTP_PREFIX_LEN);
+
+  for (i = 0; i < RARRAY_LEN(names); i++) {
+    VALUE name = rb_ary_entry(names, i);
+    char *field = tmp + HTTP_PREFIX_LEN;
+    struct interned_field *f;
+    long j, flen;
+    VALUE key;
+
+    StringValue(name);
+    flen = RSTRING_LEN(name);
+    if (flen == 0 || flen > (long)(sizeof(tmp) - HTTP_PREFIX_LEN))
+      rb_raise(rb_eArgError, "invalid header name: %"PRIsVALUE, name);
+
+    for (j = 0; j < flen; j++) {
+      field[j] = RSTRING_PTR(name)[j];
+      if (!is_token_char(field[j]))
+        rb_raise(rb_eArgError, "invalid header name: %"PRIsVALUE, name);
+      snake_upcase_char(&field[j]);
+    }
+
+    /* "Version" is ignored by the parser, see write_value() */
+    if (CONST_MEM_EQ("VERSION", field, flen))
+      rb_raise(rb_eArgError, "header name can't be interned: %"PRIsVALUE,
+               name);
+
+    key = find_common_field(field, flen);
+    if (NIL_P(key)) {
+      if ((interned_count + 1) * 2 > interned_capa)
+        interned_fields_grow();
+
+      f = interned_field_slot(interned_fields, interned_capa, field, flen);
+      f->len = flen;
+      f->name = ALLOC_N(char, flen);
+      memcpy(f->name, field, flen);
+      f->value = key = str_new_dd_freeze(tmp, HTTP_PREFIX_LEN + flen);
+      f->values = NULL;
+      rb_gc_register_mark_object(key);
+      interned_count++;
+    }
+    rb_ary_push(keys, key);
+  }
+
+  return keys;
+}
+
+/*
+ * Optional cache of frozen, deduplicated values for memoized fields, so
+ * values repeated across requests (e.g. "Accept-Encoding: gzip, deflate")
+ * don't need a new String each time.  Each field remembers up to
+ * header_value_cache_size distinct values; once its slots are taken,
+ * other values are allocated as usual.  Fields carrying credentials or
+ * values unlikely to repeat are never cached, see COMMON_HTTP_FIELDS.
+ */
+#define HEADER_VALUE_CACHE_MAX 16
+#define HEADER_VALUE_CACHE_MAX_LEN 256
+static long header_value_cache_size; /* disabled by default */
+static unsigned long header_value_cache_hits;
+static unsigned long header_value_cache_misses;
+
+/*
+ * Returns a frozen String for the given header value, or Qnil if it
+ * isn't cacheable and needs to be allocated by the caller.
+ */
+static VALUE cached_field_value(VALUE **values, const char *ptr, long len)
+{
+  long i;
+  VALUE v;
+
+  if (!header_value_cache_size || !values ||
+      len == 0 || len > HEADER_VALUE_CACHE_MAX_LEN)
+    return Qnil;
+
+  if (!*values) {
+    *values = ALLOC_N(VALUE, HEADER_VALUE_CACHE_MAX);
+    MEMZERO(*values, VALUE, HEADER_VALUE_CACHE_MAX);
   }
+
+  for (i = 0; i < header_value_cache_size; i++) {
+    v = (*values)[i];
+    if (!v) {
+      header_value_cache_misses++;
+      v = str_new_dd_freeze(ptr, len);
+      rb_gc_register_mark_object(v);
+      (*values)[i] = v;
+      return v;
+    }
+    if (str_cstr_eq(v, ptr, len)) {
+      header_value_cache_hits++;
+      return v;
+    }
+  }
+  header_value_cache_misses++;
+
   return Qnil;
 }
 
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.header_value_cache_size = Integer
+ *
+ * Sets the number of distinct values remembered for each memoized
+ * header field (up to 16).  Zero (the default) disables the cache.
+ * Cached values are frozen, applications must not modify them in place.
+ */
+static VALUE set_header_value_cache_size(VALUE self, VALUE size)
+{
+  long n = NUM2LONG(size);
+
+  if (n < 0 || n > HEADER_VALUE_CACHE_MAX)
+    rb_raise(rb_eArgError, "header_value_cache_size must be within 0..%d",
+             HEADER_VALUE_CACHE_MAX);
+  header_value_cache_size = n;
+
+  return size;
+}
+
+static VALUE get_header_value_cache_size(VALUE self)
+{
+  return LONG2NUM(header_value_cache_size);
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.header_value_cache_stats => Hash
+ *
+ * Returns the number of header value cache hits and misses in the
+ * current process.
+ */
+static VALUE header_value_cache_stats(VALUE self)
+{
+  VALUE stats = rb_hash_new();
+
+  rb_hash_aset(stats, ID2SYM(rb_intern("hits")),
+               ULONG2NUM(header_value_cache_hits));
+  rb_hash_aset(stats, ID2SYM(rb_intern("misses")),
+               ULONG2NUM(header_value_cache_misses));
+  return stats;
+}
+
 /*
  * We got a strange header that we don't have a memoized value for.
  * Fallback to creating a new string to use as a hash key.
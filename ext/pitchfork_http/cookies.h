@@ -0,0 +1,126 @@
+#ifndef cookies_h
+#define cookies_h
+
+#include "ruby.h"
+#include "ruby/encoding.h"
+#include <string.h>
+#include "c_util.h"
+#include "lazy_env.h"
+
+/*
+ * Optional parsing of the Cookie header into env["pitchfork.cookies"],
+ * with the semantics of Rack::Utils.parse_cookies_header (Rack 3):
+ * cookies are split on ";" followed by any number of spaces, the first
+ * occurrence of a name wins, and values are decoded like
+ * URI.decode_www_form_component, or kept as-is if that would raise.
+ */
+static int parse_cookies; /* disabled by default */
+static VALUE g_http_cookie;
+static VALUE g_pitchfork_cookies;
+static VALUE empty_cookies;
+
+/* returns a UTF-8 String, or Qnil for an invalid %-encoding */
+static VALUE cookie_unescape(const char *ptr, long len)
+{
+  VALUE str = rb_utf8_str_new(NULL, len);
+  long n = www_form_decode(RSTRING_PTR(str), ptr, len);
+
+  if (n < 0)
+    return Qnil;
+  rb_str_set_len(str, n);
+  return str;
+}
+
+static VALUE cookies_hash(const char *ptr, long len)
+{
+  const char *pe = ptr + len;
+  VALUE cookies = rb_hash_new();
+
+  while (ptr < pe) {
+    const char *semi = memchr(ptr, ';', pe - ptr);
+    const char *end = semi ? semi : pe;
+
+    if (end > ptr) {
+      const char *eq = memchr(ptr, '=', end - ptr);
+      VALUE key = rb_str_new(ptr, (eq ? eq : end) - ptr);
+
+      if (rb_hash_lookup2(cookies, key, Qundef) == Qundef) {
+        VALUE value = Qnil;
+
+        if (eq) {
+          value = cookie_unescape(eq + 1, end - eq - 1);
+          if (NIL_P(value))
+            value = rb_str_new(eq + 1, end - eq - 1);
+        }
+        rb_hash_aset(cookies, key, value);
+      }
+    }
+    if (!semi)
+      break;
+    for (ptr = semi + 1; ptr < pe && *ptr == ' '; ptr++);
+  }
+  return rb_obj_freeze(cookies);
+}
+
+/* +buffer+ holds the request head for lazy_env placeholders */
+static void set_cookies(VALUE env, const char *buffer)
+{
+  VALUE v = rb_hash_aref(env, g_http_cookie);
+
+  if (FIXNUM_P(v))
+    v = cookies_hash(buffer + LAZY_POS_OFF(v), LAZY_POS_LEN(v));
+  else if (RB_TYPE_P(v, T_STRING))
+    v = cookies_hash(RSTRING_PTR(v), RSTRING_LEN(v));
+  else
+    v = empty_cookies;
+
+  rb_hash_aset(env, g_pitchfork_cookies, v);
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.parse_cookies_header(value) => Hash
+ *
+ * Parses a Cookie header +value+ like Rack::Utils.parse_cookies_header,
+ * returning a frozen Hash.
+ */
+static VALUE parse_cookies_header(VALUE self, VALUE value)
+{
+  if (NIL_P(value))
+    return empty_cookies;
+
+  StringValue(value);
+  return cookies_hash(RSTRING_PTR(value), RSTRING_LEN(value));
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.parse_cookies = true or false
+ *
+ * Makes the parser store the parsed Cookie header of every request in
+ * env["pitchfork.cookies"].
+ */
+static VALUE set_parse_cookies(VALUE self, VALUE enable)
+{
+  parse_cookies = RTEST(enable);
+  return enable;
+}
+
+static VALUE get_parse_cookies(VALUE self)
+{
+  return parse_cookies ? Qtrue : Qfalse;
+}
+
+static void init_cookies(VALUE klass)
+{
+  g_pitchfork_cookies = rb_obj_freeze(rb_str_new_cstr("pitchfork.cookies"));
+  rb_gc_register_mark_object(g_pitchfork_cookies);
+  empty_cookies = rb_obj_freeze(rb_hash_new());
+  rb_gc_register_mark_object(empty_cookies);
+  rb_define_singleton_method(klass, "parse_cookies_header",
+                             parse_cookies_header, 1);
+  rb_define_singleton_method(klass, "parse_cookies=", set_parse_cookies, 1);
+  rb_define_singleton_method(klass, "parse_cookies", get_parse_cookies, 0);
+}
+
+#endif /* cookies_h */
@@ -0,0 +1,110 @@
+#ifndef env_template_h
+#define env_template_h
+
+#include "ruby.h"
+
+/*
+ * Every env starts as a copy of a frozen template holding
+ * Pitchfork::HttpParser::DEFAULTS, so they don't need to be merged in
+ * for every request.  The template is pre-sized from a moving average
+ * of the final env size, and copying it keeps that capacity, so envs
+ * don't get rehashed several times as the request is parsed.
+ * DEFAULTS may be changed at any time (HttpServer#logger= does), its
+ * writers drop the template so the next env rebuilds it.
+ */
+static VALUE env_template = Qnil;
+static long env_template_capa;
+static long env_size_avg; /* moving average, scaled by ENV_SIZE_SCALE */
+static VALUE env_template_owner; /* Pitchfork::HttpParser */
+static ID id_initialize_copy, id_defaults;
+
+#define ENV_SIZE_SCALE 16
+/* room for what's set after parsing (rack.input, middlewares, ...) */
+#define ENV_SIZE_SLACK 8
+
+static int env_template_set_i(VALUE key, VALUE value, VALUE template)
+{
+  rb_hash_aset(template, key, value);
+  return ST_CONTINUE;
+}
+
+static void env_template_build(long capa)
+{
+  VALUE template;
+
+#ifdef HAVE_RB_HASH_NEW_CAPA
+  template = rb_hash_new_capa(capa);
+#else
+  template = rb_hash_new();
+#endif
+  /* DEFAULTS is defined by pitchfork/http_parser.rb after we're loaded */
+  if (rb_const_defined(env_template_owner, id_defaults)) {
+    VALUE defaults = rb_const_get(env_template_owner, id_defaults);
+
+    rb_hash_foreach(rb_convert_type(defaults, T_HASH, "Hash", "to_hash"),
+                    env_template_set_i, template);
+  }
+  env_template = rb_obj_freeze(template);
+  env_template_capa = capa;
+}
+
+static VALUE env_template_get(void)
+{
+  if (NIL_P(env_template))
+    env_template_build(env_template_capa);
+  return env_template;
+}
+
+/* :nodoc: called by HttpParser::DEFAULTS whenever it changes */
+static VALUE env_template_reset_bang(VALUE self)
+{
+  env_template = Qnil;
+  return Qnil;
+}
+
+/* records the size of a parsed env, resizing the template if needed */
+static void env_template_sample(long size)
+{
+  long capa = 16;
+
+  if (env_size_avg)
+    env_size_avg += size - env_size_avg / ENV_SIZE_SCALE;
+  else
+    env_size_avg = size * ENV_SIZE_SCALE;
+
+  while (capa < env_size_avg / ENV_SIZE_SCALE + ENV_SIZE_SLACK)
+    capa *= 2;
+
+  /* grow right away, but don't flip-flop around a power of two */
+  if (capa > env_template_capa || capa * 4 <= env_template_capa)
+    env_template_build(capa);
+}
+
+static VALUE env_template_new(VALUE klass)
+{
+  VALUE env;
+
+  if (klass == rb_cHash)
+    return rb_hash_dup(env_template_get());
+
+  env = rb_obj_alloc(klass);
+  rb_funcall(env, id_initialize_copy, 1, env_template_get());
+  return env;
+}
+
+static void env_template_reset(VALUE env)
+{
+  rb_funcall(env, id_initialize_copy, 1, env_template_get());
+}
+
+static void init_env_template(VALUE klass)
+{
+  env_template_owner = klass;
+  id_initialize_copy = rb_intern("initialize_copy");
+  id_defaults = rb_intern("DEFAULTS");
+  rb_gc_register_address(&env_template);
+  rb_define_singleton_method(klass, "env_template_reset!",
+                             env_template_reset_bang, 0);
+}
+
+#endif /* env_template_h */
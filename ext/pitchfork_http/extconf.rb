@@ -3,6 +3,13 @@
 
 have_const("PR_SET_CHILD_SUBREAPER", "sys/prctl.h")
 have_func("rb_enc_interned_str", "ruby.h") # Ruby 3.0+
+have_func("rb_hash_new_capa", "ruby.h") # Ruby 3.2+
+have_func("rb_io_descriptor", "ruby/io.h") # Ruby 3.1+
+have_func("rb_io_mode", "ruby/io.h") # Ruby 3.3+
+have_func("memmem", "string.h")
+have_func("getrandom", "sys/random.h")
+have_func("sendfile", "sys/sendfile.h")
+have_header("linux/errqueue.h")
 if RUBY_VERSION.start_with?('3.0.')
   # https://bugs.ruby-lang.org/issues/18772
   $CFLAGS << ' -DRB_ENC_INTERNED_STR_NULL_CHECK=1 '
@@ -11,4 +18,21 @@
 end
 
 have_func('epoll_create1', %w(sys/epoll.h))
+
+# vectorized header scanning, selected at runtime based on the CPU
+checking_for("x86 SIMD header scanning") do
+  try_compile(<<~SRC) and $defs.push("-DHAVE_X86_SIMD_SCAN")
+    #include <immintrin.h>
+    __attribute__((target("avx2"))) static int f(void) {
+      return _mm256_movemask_epi8(_mm256_set1_epi8(1));
+    }
+    __attribute__((target("sse4.2"))) static int g(void) {
+      __m128i v = _mm_set1_epi8(1);
+      return _mm_cmpestri(v, 1, v, 16, _SIDD_CMP_RANGES);
+    }
+    int main(void) {
+      return __builtin_cpu_supports("avx2") ? f() : g();
+    }
+  SRC
+end
 create_makefile("pitchfork/pitchfork_http")
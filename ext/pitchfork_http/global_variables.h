@@ -3,6 +3,7 @@
 static VALUE eHttpParserError;
 static VALUE e413;
 static VALUE e414;
+static VALUE e408;
 
 static VALUE g_rack_url_scheme;
 static VALUE g_request_method;
@@ -30,6 +31,13 @@ static VALUE g_https;
 static VALUE g_http_09;
 static VALUE g_http_10;
 static VALUE g_http_11;
+static VALUE g_method_get;
+static VALUE g_method_head;
+static VALUE g_method_post;
+static VALUE g_method_put;
+static VALUE g_method_patch;
+static VALUE g_method_delete;
+static VALUE g_method_options;
 
 /** Defines common length and error messages for input length validation. */
 #define DEF_MAX_LENGTH(N, length) \
@@ -90,6 +98,13 @@ static void init_globals(void)
   DEF_GLOBAL(http_11, "HTTP/1.1");
   DEF_GLOBAL(http_10, "HTTP/1.0");
   DEF_GLOBAL(http_09, "HTTP/0.9");
+  DEF_GLOBAL(method_get, "GET");
+  DEF_GLOBAL(method_head, "HEAD");
+  DEF_GLOBAL(method_post, "POST");
+  DEF_GLOBAL(method_put, "PUT");
+  DEF_GLOBAL(method_patch, "PATCH");
+  DEF_GLOBAL(method_delete, "DELETE");
+  DEF_GLOBAL(method_options, "OPTIONS");
 }
 
 #undef DEF_GLOBAL
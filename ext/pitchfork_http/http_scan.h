@@ -0,0 +1,276 @@
+#ifndef http_scan_h
+#define http_scan_h
+
+#include "ruby.h"
+#include <stddef.h>
+
+/*
+ * Fast paths for the two hottest loops of the Ragel machine: header
+ * field names and header values.  Ragel walks these one byte at a time
+ * through a switch; here we find the end of the run 16 or 32 bytes at a
+ * time and let the machine resume from there.  The machine still
+ * validates every byte we stop on, so the scanners only ever have to be
+ * conservative: stopping early is always correct, skipping a byte the
+ * machine would have rejected never is.
+ *
+ * The implementation is picked once at load time based on the CPU
+ * (AVX2, then SSE4.2, then a portable scalar loop), and may be forced
+ * with Pitchfork::HttpParser.scanner= for testing.
+ */
+
+/*
+ * returns the number of leading bytes in [p, pe) which match
+ * /[A-Za-z0-9_-]/, snake-upcasing them in place as the
+ * snake_upcase_field action would.
+ */
+typedef size_t (*scan_field_fn)(char *p, const char *pe);
+
+/*
+ * returns the number of leading bytes in [p, pe) which are valid
+ * header value content (anything but CTLs, except for HT)
+ */
+typedef size_t (*scan_content_fn)(const char *p, const char *pe);
+
+static inline int is_scan_field_char(unsigned char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+         (c >= '0' && c <= '9') || c == '-' || c == '_';
+}
+
+static inline int is_scan_content_char(unsigned char c)
+{
+  return (c >= 0x20 && c != 0x7f) || c == '\t';
+}
+
+static size_t scan_field_scalar(char *p, const char *pe)
+{
+  char *start = p;
+
+  for (; p < pe && is_scan_field_char(*p); p++) {
+    if (*p >= 'a' && *p <= 'z')
+      *p &= ~0x20;
+    else if (*p == '-')
+      *p = '_';
+  }
+  return p - start;
+}
+
+static size_t scan_content_scalar(const char *p, const char *pe)
+{
+  const char *start = p;
+
+  while (p < pe && is_scan_content_char(*p))
+    p++;
+  return p - start;
+}
+
+#if defined(HAVE_X86_SIMD_SCAN)
+#include <immintrin.h>
+
+/*
+ * SSE4.2: PCMPESTRI in range mode does the classification for us,
+ * the upcasing is plain SSE2 arithmetic on the whole block.
+ */
+__attribute__((target("sse4.2")))
+static size_t scan_field_sse42(char *p, const char *pe)
+{
+  static const char ranges[16] = "09AZaz--__";
+  const __m128i r = _mm_loadu_si128((const __m128i *)ranges);
+  char *start = p;
+
+  while (pe - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int i = _mm_cmpestri(r, 10, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                         _SIDD_NEGATIVE_POLARITY);
+    __m128i lower, dash;
+
+    if (i != 16) {
+      p += scan_field_scalar(p, p + i);
+      return p - start;
+    }
+    lower = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('a' - 1)),
+                          _mm_cmplt_epi8(v, _mm_set1_epi8('z' + 1)));
+    dash = _mm_cmpeq_epi8(v, _mm_set1_epi8('-'));
+    v = _mm_sub_epi8(v, _mm_and_si128(lower, _mm_set1_epi8(0x20)));
+    v = _mm_add_epi8(v, _mm_and_si128(dash, _mm_set1_epi8('_' - '-')));
+    _mm_storeu_si128((__m128i *)p, v);
+    p += 16;
+  }
+  return p - start + scan_field_scalar(p, pe);
+}
+
+__attribute__((target("sse4.2")))
+static size_t scan_content_sse42(const char *p, const char *pe)
+{
+  static const char ranges[16] = "\000\010\012\037\177\177";
+  const __m128i r = _mm_loadu_si128((const __m128i *)ranges);
+  const char *start = p;
+
+  while (pe - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int i = _mm_cmpestri(r, 6, v, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES);
+
+    if (i != 16)
+      return p - start + i;
+    p += 16;
+  }
+  return p - start + scan_content_scalar(p, pe);
+}
+
+/* unsigned lo <= v <= hi for each byte */
+#define SCAN_IN_RANGE256(v, lo, hi) _mm256_cmpeq_epi8( \
+  _mm256_min_epu8(_mm256_sub_epi8((v), _mm256_set1_epi8(lo)), \
+                  _mm256_set1_epi8((hi) - (lo))), \
+  _mm256_sub_epi8((v), _mm256_set1_epi8(lo)))
+
+__attribute__((target("avx2")))
+static size_t scan_field_avx2(char *p, const char *pe)
+{
+  char *start = p;
+
+  while (pe - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i lower = SCAN_IN_RANGE256(v, 'a', 'z');
+    __m256i dash = _mm256_cmpeq_epi8(v, _mm256_set1_epi8('-'));
+    __m256i ok = _mm256_or_si256(
+      _mm256_or_si256(lower, dash),
+      _mm256_or_si256(
+        _mm256_or_si256(SCAN_IN_RANGE256(v, 'A', 'Z'),
+                        SCAN_IN_RANGE256(v, '0', '9')),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_'))));
+    unsigned mask = ~(unsigned)_mm256_movemask_epi8(ok);
+
+    if (mask) {
+      p += scan_field_scalar(p, p + __builtin_ctz(mask));
+      return p - start;
+    }
+    v = _mm256_sub_epi8(v, _mm256_and_si256(lower, _mm256_set1_epi8(0x20)));
+    v = _mm256_add_epi8(v, _mm256_and_si256(dash,
+                                            _mm256_set1_epi8('_' - '-')));
+    _mm256_storeu_si256((__m256i *)p, v);
+    p += 32;
+  }
+  return p - start + scan_field_sse42(p, pe);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_content_avx2(const char *p, const char *pe)
+{
+  const char *start = p;
+
+  while (pe - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i ctl = _mm256_andnot_si256(
+      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')),
+      _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1f)), v));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(ctl,
+                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f))));
+
+    if (mask)
+      return p - start + __builtin_ctz(mask);
+    p += 32;
+  }
+  return p - start + scan_content_sse42(p, pe);
+}
+#endif /* HAVE_X86_SIMD_SCAN */
+
+static scan_field_fn scan_field = scan_field_scalar;
+static scan_content_fn scan_content = scan_content_scalar;
+static ID id_scan_scalar, id_scan_sse42, id_scan_avx2, id_scanner;
+
+static int scanner_supported(ID name)
+{
+  if (name == id_scan_scalar)
+    return 1;
+#if defined(HAVE_X86_SIMD_SCAN)
+  if (name == id_scan_sse42)
+    return __builtin_cpu_supports("sse4.2");
+  if (name == id_scan_avx2)
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.2");
+#endif
+  return 0;
+}
+
+static void use_scanner(ID name)
+{
+  id_scanner = name;
+  scan_field = scan_field_scalar;
+  scan_content = scan_content_scalar;
+#if defined(HAVE_X86_SIMD_SCAN)
+  if (name == id_scan_sse42) {
+    scan_field = scan_field_sse42;
+    scan_content = scan_content_sse42;
+  } else if (name == id_scan_avx2) {
+    scan_field = scan_field_avx2;
+    scan_content = scan_content_avx2;
+  }
+#endif
+}
+
+/**
+ * call-seq:
+ *   Pitchfork::HttpParser.scanner => :avx2, :sse42 or :scalar
+ *
+ * Returns the header scanning implementation in use.
+ */
+static VALUE get_scanner(VALUE self)
+{
+  return ID2SYM(id_scanner);
+}
+
+/**
+ * call-seq:
+ *   Pitchfork::HttpParser.scanner = :scalar
+ *
+ * Forces a header scanning implementation, raising ArgumentError if
+ * it isn't supported by this build or CPU.  Only meant for testing
+ * and benchmarking, the fastest one available is selected at load time.
+ */
+static VALUE set_scanner(VALUE self, VALUE name)
+{
+  ID id = SYM2ID(rb_to_symbol(name));
+
+  if (!scanner_supported(id))
+    rb_raise(rb_eArgError, "scanner %"PRIsVALUE" is not supported", name);
+  use_scanner(id);
+  return name;
+}
+
+/*
+ * returns the pointer to the last byte of the run of header value content
+ * starting at p, for actions to assign to fpc.  p itself is left alone if
+ * it's not content.
+ */
+static inline const char *skip_content(const char *p, const char *pe)
+{
+  size_t n = scan_content(p, pe);
+
+  return n ? p + n - 1 : p;
+}
+
+/* like skip_content, but snake-upcases the field name along the way */
+static inline const char *skip_field(const char *p, const char *pe)
+{
+  size_t n = scan_field(deconst(p), pe);
+
+  return n ? p + n - 1 : p;
+}
+
+static void init_http_scan(VALUE klass)
+{
+  id_scan_scalar = rb_intern("scalar");
+  id_scan_sse42 = rb_intern("sse42");
+  id_scan_avx2 = rb_intern("avx2");
+
+  if (scanner_supported(id_scan_avx2))
+    use_scanner(id_scan_avx2);
+  else if (scanner_supported(id_scan_sse42))
+    use_scanner(id_scan_sse42);
+  else
+    use_scanner(id_scan_scalar);
+
+  rb_define_singleton_method(klass, "scanner", get_scanner, 0);
+  rb_define_singleton_method(klass, "scanner=", set_scanner, 1);
+}
+
+#endif /* http_scan_h */
@@ -65,6 +65,12 @@ static VALUE httpdate(VALUE self)
 	return buf;
 }
 
+/* for the response head serializer */
+VALUE pitchfork_httpdate(void)
+{
+	return httpdate(Qnil);
+}
+
 void init_pitchfork_httpdate(void)
 {
 	VALUE mod = rb_define_module("Pitchfork");
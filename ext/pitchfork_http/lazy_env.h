@@ -0,0 +1,162 @@
+#ifndef lazy_env_h
+#define lazy_env_h
+
+#include "ruby.h"
+#include <string.h>
+#include "env_template.h"
+
+/*
+ * Optional Rack env where request header values are only turned into
+ * Strings when the application reads them.  Until then, the env holds
+ * an Integer placeholder packing the offset and length of the value in
+ * the request head, which is kept as a single frozen String in the
+ * @head instance variable once parsing is done.
+ *
+ * Rack requires CGI keys (those without a dot) to have String values,
+ * so an Integer under such a key can only be one of our placeholders.
+ */
+static VALUE cLazyEnv;
+static ID id_head;
+static int lazy_env; /* disabled by default */
+
+#define LAZY_POS(off, len) LONG2FIX(((long)(off) << 32) | (long)(len))
+#define LAZY_POS_OFF(pos) (FIX2LONG(pos) >> 32)
+#define LAZY_POS_LEN(pos) (FIX2LONG(pos) & 0xffffffffL)
+
+static int is_lazy_placeholder(VALUE key, VALUE value)
+{
+  return FIXNUM_P(value) && RB_TYPE_P(key, T_STRING) &&
+         !memchr(RSTRING_PTR(key), '.', RSTRING_LEN(key));
+}
+
+static VALUE new_env(void)
+{
+  VALUE env;
+
+  if (!lazy_env)
+    return env_template_new(rb_cHash);
+
+  env = env_template_new(cLazyEnv);
+  rb_ivar_set(env, id_head, Qnil);
+  return env;
+}
+
+static int is_lazy_env(VALUE env)
+{
+  return RBASIC_CLASS(env) == cLazyEnv;
+}
+
+/* returns the String for a placeholder, or Qundef if +value+ isn't one */
+static VALUE lazy_env_string(VALUE env, VALUE key, VALUE value)
+{
+  VALUE head;
+
+  if (!is_lazy_placeholder(key, value))
+    return Qundef;
+
+  head = rb_ivar_get(env, id_head);
+  if (NIL_P(head))
+    return Qundef;
+
+  return rb_str_substr(head, LAZY_POS_OFF(value), LAZY_POS_LEN(value));
+}
+
+/**
+ * call-seq:
+ *    env[key] => value
+ *
+ * Like Hash#[], materializing request header values on first access.
+ */
+static VALUE lazy_env_aref(VALUE self, VALUE key)
+{
+  VALUE value = rb_hash_aref(self, key);
+  VALUE str = lazy_env_string(self, key, value);
+
+  if (str == Qundef)
+    return value;
+
+  rb_hash_aset(self, key, str);
+  return str;
+}
+
+/**
+ * call-seq:
+ *    env.delete(key) => value
+ *    env.delete(key) { |key| block } => value
+ *
+ * Like Hash#delete, materializing the deleted request header value.
+ */
+static VALUE lazy_env_delete(VALUE self, VALUE key)
+{
+  VALUE value = rb_hash_lookup2(self, key, Qundef);
+  VALUE str;
+
+  if (value == Qundef)
+    return rb_block_given_p() ? rb_yield(key) : Qnil;
+  rb_hash_delete(self, key);
+  str = lazy_env_string(self, key, value);
+
+  return str == Qundef ? value : str;
+}
+
+static int materialize_i(VALUE key, VALUE value, VALUE self)
+{
+  VALUE str = lazy_env_string(self, key, value);
+
+  if (str != Qundef)
+    rb_hash_aset(self, key, str);
+
+  return ST_CONTINUE;
+}
+
+/**
+ * call-seq:
+ *    env.materialize! => env
+ *
+ * Turns all remaining request header placeholders into Strings, after
+ * which the env behaves exactly like a Hash.  Methods which can expose
+ * every value (e.g. #each, #to_h, #merge) call this first.
+ */
+static VALUE lazy_env_materialize(VALUE self)
+{
+  if (!NIL_P(rb_ivar_get(self, id_head))) {
+    rb_hash_foreach(self, materialize_i, self);
+    rb_ivar_set(self, id_head, Qnil);
+  }
+  return self;
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.lazy_env = true or false
+ *
+ * Makes parsers created (or cleared) from now on return a
+ * Pitchfork::HttpParser::LazyEnv, where request header values are only
+ * allocated when the application reads them.
+ */
+static VALUE set_lazy_env(VALUE self, VALUE enable)
+{
+  if (RTEST(enable) && sizeof(long) < 8)
+    rb_raise(rb_eNotImpError, "lazy_env requires a 64-bit platform");
+
+  lazy_env = RTEST(enable);
+  return enable;
+}
+
+static VALUE get_lazy_env(VALUE self)
+{
+  return lazy_env ? Qtrue : Qfalse;
+}
+
+static void init_lazy_env(VALUE klass)
+{
+  id_head = rb_intern("@head");
+  cLazyEnv = rb_define_class_under(klass, "LazyEnv", rb_cHash);
+  rb_define_method(cLazyEnv, "[]", lazy_env_aref, 1);
+  rb_define_method(cLazyEnv, "delete", lazy_env_delete, 1);
+  rb_define_method(cLazyEnv, "materialize!", lazy_env_materialize, 0);
+  rb_define_singleton_method(klass, "lazy_env=", set_lazy_env, 1);
+  rb_define_singleton_method(klass, "lazy_env", get_lazy_env, 0);
+}
+
+#endif /* lazy_env_h */
@@ -0,0 +1,301 @@
+#ifndef multipart_h
+#define multipart_h
+
+#include "ruby.h"
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Incremental multipart/form-data parser, fed with request body chunks
+ * as they are read.  Part data is appended to a String or written to the
+ * file descriptor of an IO (see Pitchfork::Multipart#part), so whole
+ * uploads are never held in memory nor re-read.  We only keep what may
+ * be the start of a delimiter, or an incomplete part head.
+ */
+static VALUE cMultipartParser, eMultipartError;
+static ID id_part;
+
+/* parts heads larger than this are rejected */
+#define MULTIPART_HEAD_MAX (16 * 1024)
+/* String parts together, the same default as Rack::Multipart */
+#define MULTIPART_BUFFERED_MAX (16 * 1024 * 1024)
+
+enum multipart_state {
+  MP_PREAMBLE,
+  MP_BOUNDARY, /* right after a delimiter */
+  MP_HEAD,
+  MP_BODY,
+  MP_DONE
+};
+
+struct multipart {
+  enum multipart_state state;
+  int fd; /* of sink when it's an IO, -1 otherwise */
+  long buffered_left; /* bytes String parts may still take */
+  VALUE delim; /* "\r\n--" boundary */
+  VALUE pending;
+  VALUE handler;
+  VALUE sink;
+};
+
+#ifndef HAVE_MEMMEM
+static void *
+memmem(const void *hay, size_t hlen, const void *needle, size_t nlen)
+{
+  const char *p = hay, *pe = p + hlen;
+
+  if (nlen == 0)
+    return (void *)p;
+  for (; (size_t)(pe - p) >= nlen; p++) {
+    p = memchr(p, *(const char *)needle, pe - p - nlen + 1);
+    if (!p)
+      return NULL;
+    if (!memcmp(p, needle, nlen))
+      return (void *)p;
+  }
+  return NULL;
+}
+#endif
+
+static void mp_mark(void *ptr)
+{
+  struct multipart *mp = ptr;
+
+  rb_gc_mark(mp->delim);
+  rb_gc_mark(mp->pending);
+  rb_gc_mark(mp->handler);
+  rb_gc_mark(mp->sink);
+}
+
+static size_t mp_memsize(const void *ptr)
+{
+  return sizeof(struct multipart);
+}
+
+static const rb_data_type_t mp_type = {
+    .wrap_struct_name = "pitchfork_multipart_parser",
+    .function = {
+        .dmark = mp_mark,
+        .dfree = RUBY_TYPED_DEFAULT_FREE,
+        .dsize = mp_memsize,
+    },
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static struct multipart *mp_get(VALUE self)
+{
+  struct multipart *mp;
+
+  TypedData_Get_Struct(self, struct multipart, &mp_type, mp);
+  return mp;
+}
+
+static VALUE MultipartParser_alloc(VALUE klass)
+{
+  struct multipart *mp;
+  VALUE self = TypedData_Make_Struct(klass, struct multipart, &mp_type, mp);
+
+  mp->fd = -1;
+  mp->delim = mp->pending = mp->handler = mp->sink = Qnil;
+  return self;
+}
+
+static void mp_write(struct multipart *mp, const char *ptr, long len)
+{
+  if (len == 0 || NIL_P(mp->sink))
+    return;
+
+  if (mp->fd < 0) {
+    if (len > mp->buffered_left)
+      rb_raise(e413, "multipart form data is too large");
+    mp->buffered_left -= len;
+    rb_str_cat(mp->sink, ptr, len);
+    return;
+  }
+  while (len > 0) {
+    ssize_t w = write(mp->fd, ptr, len);
+
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      rb_sys_fail("write(2) to multipart file");
+    }
+    ptr += w;
+    len -= w;
+  }
+}
+
+/* +ptr+ doesn't move since the chunk or pending buffer is on our stack */
+static void mp_part(VALUE self, struct multipart *mp, const char *ptr, long len)
+{
+  VALUE sink = rb_funcall(mp->handler, id_part, 1, rb_str_new(ptr, len));
+
+  RB_OBJ_WRITE(self, &mp->sink, sink);
+  mp->fd = RB_TYPE_P(sink, T_FILE) ? io_fd(sink) : -1;
+  if (!NIL_P(sink) && mp->fd < 0)
+    StringValue(sink);
+}
+
+/* returns the number of bytes consumed */
+static long mp_execute(VALUE self, struct multipart *mp, const char *buf, long len)
+{
+  const char *p = buf, *pe = buf + len, *q;
+  const char *delim = RSTRING_PTR(mp->delim);
+  long dlen = RSTRING_LEN(mp->delim);
+
+  while (p < pe) {
+    switch (mp->state) {
+    case MP_PREAMBLE:
+    case MP_BODY:
+      q = memmem(p, pe - p, delim, dlen);
+      if (q) {
+        if (mp->state == MP_BODY)
+          mp_write(mp, p, q - p);
+        p = q + dlen;
+        mp->state = MP_BOUNDARY;
+        continue;
+      }
+      /* keep what may be the start of a delimiter */
+      q = pe - dlen + 1 > p ? pe - dlen + 1 : p;
+      q = memchr(q, '\r', pe - q);
+      if (!q)
+        q = pe;
+      if (mp->state == MP_BODY)
+        mp_write(mp, p, q - p);
+      return q - buf;
+    case MP_BOUNDARY:
+      if (pe - p < 2)
+        return p - buf;
+      if (p[0] == '-' && p[1] == '-') {
+        RB_OBJ_WRITE(self, &mp->sink, Qnil);
+        mp->state = MP_DONE;
+        continue;
+      }
+      /* transport padding may follow the delimiter */
+      for (q = p; q < pe && (*q == ' ' || *q == '\t'); q++);
+      if (pe - q < 2) {
+        if (q - p > 1024)
+          rb_raise(eMultipartError, "invalid multipart boundary line");
+        return p - buf;
+      }
+      if (q[0] != '\r' || q[1] != '\n')
+        rb_raise(eMultipartError, "invalid multipart boundary line");
+      p = q + 2;
+      mp->state = MP_HEAD;
+      continue;
+    case MP_HEAD:
+      if (pe - p >= 2 && p[0] == '\r' && p[1] == '\n') {
+        q = p; /* no headers at all */
+      } else {
+        q = memmem(p, pe - p, "\r\n\r\n", 4);
+        if (!q) {
+          if (pe - p > MULTIPART_HEAD_MAX)
+            rb_raise(e413, "multipart part head is too large");
+          return p - buf;
+        }
+        q += 2;
+      }
+      mp_part(self, mp, p, q - p);
+      p = q + 2;
+      mp->state = MP_BODY;
+      continue;
+    case MP_DONE:
+      return len;
+    }
+  }
+  return p - buf;
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::MultipartParser.new(boundary, handler) => parser
+ *    Pitchfork::MultipartParser.new(boundary, handler, buffered_max) => parser
+ *
+ * Creates a parser for a body delimited by +boundary+.  The head of each
+ * part is passed to handler.part, which returns where the part's data
+ * goes: a String to append to, a File to write to, or +nil+ to skip it.
+ * String parts may hold +buffered_max+ bytes together (BUFFERED_MAX by
+ * default), more raises Pitchfork::RequestEntityTooLargeError.
+ */
+static VALUE MultipartParser_init(int argc, VALUE *argv, VALUE self)
+{
+  struct multipart *mp = mp_get(self);
+  VALUE delim = rb_str_new_cstr("\r\n--");
+  VALUE boundary, handler, max;
+
+  rb_scan_args(argc, argv, "21", &boundary, &handler, &max);
+  mp->buffered_left = NIL_P(max) ? MULTIPART_BUFFERED_MAX : NUM2LONG(max);
+  if (mp->buffered_left < 0)
+    rb_raise(rb_eArgError, "buffered_max must not be negative");
+  rb_str_append(delim, StringValue(boundary));
+  mp->state = MP_PREAMBLE;
+  RB_OBJ_WRITE(self, &mp->delim, rb_obj_freeze(delim));
+  /* the first delimiter may be at the very start of the body */
+  RB_OBJ_WRITE(self, &mp->pending, rb_str_new("\r\n", 2));
+  RB_OBJ_WRITE(self, &mp->handler, handler);
+  return self;
+}
+
+/**
+ * call-seq:
+ *    parser.feed(chunk) => true or false
+ *
+ * Parses the next +chunk+ of the body, returns true once the closing
+ * delimiter was seen (anything after it is ignored).
+ */
+static VALUE MultipartParser_feed(VALUE self, VALUE chunk)
+{
+  struct multipart *mp = mp_get(self);
+  long n, plen = RSTRING_LEN(mp->pending);
+
+  StringValue(chunk);
+  if (mp->state == MP_DONE)
+    return Qtrue;
+
+  if (plen == 0) {
+    n = mp_execute(self, mp, RSTRING_PTR(chunk), RSTRING_LEN(chunk));
+    rb_str_cat(mp->pending, RSTRING_PTR(chunk) + n, RSTRING_LEN(chunk) - n);
+  } else {
+    VALUE pending = mp->pending;
+
+    rb_str_append(pending, chunk);
+    n = mp_execute(self, mp, RSTRING_PTR(pending), RSTRING_LEN(pending));
+    plen = RSTRING_LEN(pending) - n;
+    memmove(RSTRING_PTR(pending), RSTRING_PTR(pending) + n, plen);
+    rb_str_set_len(pending, plen);
+  }
+  RB_GC_GUARD(chunk);
+
+  return mp->state == MP_DONE ? Qtrue : Qfalse;
+}
+
+/**
+ * call-seq:
+ *    parser.done? => true or false
+ *
+ * Whether the closing delimiter was seen.
+ */
+static VALUE MultipartParser_done(VALUE self)
+{
+  return mp_get(self)->state == MP_DONE ? Qtrue : Qfalse;
+}
+
+static void init_multipart(VALUE mPitchfork)
+{
+  cMultipartParser = rb_define_class_under(mPitchfork, "MultipartParser",
+                                           rb_cObject);
+  eMultipartError = rb_define_class_under(cMultipartParser, "Error",
+                                          eHttpParserError);
+  id_part = rb_intern("part");
+
+  /* how many bytes String parts may hold together by default */
+  rb_define_const(cMultipartParser, "BUFFERED_MAX",
+                  LONG2NUM(MULTIPART_BUFFERED_MAX));
+  rb_define_alloc_func(cMultipartParser, MultipartParser_alloc);
+  rb_define_method(cMultipartParser, "initialize", MultipartParser_init, -1);
+  rb_define_method(cMultipartParser, "feed", MultipartParser_feed, 1);
+  rb_define_method(cMultipartParser, "done?", MultipartParser_done, 0);
+}
+
+#endif /* multipart_h */
@@ -0,0 +1,161 @@
+#ifndef path_h
+#define path_h
+
+#include "ruby.h"
+#include "ruby/encoding.h"
+#include <ctype.h>
+#include "c_util.h"
+
+/*
+ * Optional decoding of the request path into env["pitchfork.path_decoded"],
+ * so routers don't need Rack::Utils.unescape_path for every request.
+ * Like URI::DEFAULT_PARSER.unescape, only valid %XX sequences are decoded
+ * and "+" is left alone.  Paths which don't decode to valid UTF-8 are
+ * stored as nil.
+ */
+enum { DECODE_PATH_OFF, DECODE_PATH_ON, DECODE_PATH_NORMALIZE };
+static int decode_path; /* disabled by default */
+static VALUE g_path_decoded;
+static ID id_normalize;
+
+/* decodes +len+ bytes at +src+ into +dst+, returns the decoded length */
+static long path_unescape(char *dst, const char *src, long len)
+{
+  const char *pe = src + len;
+  char *start = dst;
+
+  for (; src < pe; src++) {
+    if (*src == '%' && pe - src >= 3 && isxdigit((unsigned char)src[1]) &&
+        isxdigit((unsigned char)src[2])) {
+      *dst++ = (char)(hexchar2int(src[1]) << 4 | hexchar2int(src[2]));
+      src += 2;
+    } else {
+      *dst++ = *src;
+    }
+  }
+  return dst - start;
+}
+
+/*
+ * remove_dot_segments from RFC 3986 section 5.2.4, in place, returns the
+ * new length.  The output never catches up with the input, so "/." and
+ * "/.." at the end can be rewritten to "/" in the remaining input.
+ */
+static long path_normalize(char *buf, long len)
+{
+  char *in = buf, *pe = buf + len, *out = buf;
+
+  while (in < pe) {
+    long n = pe - in;
+
+    if (n >= 3 && in[0] == '.' && in[1] == '.' && in[2] == '/') {
+      in += 3;
+    } else if (n >= 2 && in[0] == '.' && in[1] == '/') {
+      in += 2;
+    } else if (n >= 3 && in[0] == '/' && in[1] == '.' && in[2] == '/') {
+      in += 2;
+    } else if (n == 2 && in[0] == '/' && in[1] == '.') {
+      in[1] = '/';
+      in += 1;
+    } else if (n >= 4 && in[0] == '/' && in[1] == '.' && in[2] == '.' &&
+               in[3] == '/') {
+      in += 3;
+      while (out > buf && *--out != '/');
+    } else if (n == 3 && in[0] == '/' && in[1] == '.' && in[2] == '.') {
+      in[2] = '/';
+      in += 2;
+      while (out > buf && *--out != '/');
+    } else if ((n == 1 && in[0] == '.') ||
+               (n == 2 && in[0] == '.' && in[1] == '.')) {
+      in = pe;
+    } else {
+      do {
+        *out++ = *in++;
+      } while (in < pe && *in != '/');
+    }
+  }
+  return out - buf;
+}
+
+/* returns a frozen UTF-8 String, or Qnil if it wouldn't be valid UTF-8 */
+static VALUE path_decode(const char *ptr, long len, int normalize)
+{
+  VALUE str = rb_utf8_str_new(NULL, len);
+  long n = path_unescape(RSTRING_PTR(str), ptr, len);
+
+  if (normalize)
+    n = path_normalize(RSTRING_PTR(str), n);
+  rb_str_set_len(str, n);
+  if (rb_enc_str_coderange(str) == ENC_CODERANGE_BROKEN)
+    return Qnil;
+
+  return rb_obj_freeze(str);
+}
+
+static void set_path_decoded(VALUE env, const char *ptr, long len)
+{
+  rb_hash_aset(env, g_path_decoded,
+               path_decode(ptr, len, decode_path == DECODE_PATH_NORMALIZE));
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.unescape_path(path, normalize = false) => String or nil
+ *
+ * Percent-decodes +path+ like Rack::Utils.unescape_path, and removes "."
+ * and ".." segments from the result when +normalize+ is true.  Returns a
+ * frozen UTF-8 String, or nil if the decoded path isn't valid UTF-8.
+ */
+static VALUE unescape_path(int argc, VALUE *argv, VALUE self)
+{
+  VALUE path;
+
+  rb_check_arity(argc, 1, 2);
+  path = argv[0];
+  StringValue(path);
+  path = path_decode(RSTRING_PTR(path), RSTRING_LEN(path),
+                     argc > 1 && RTEST(argv[1]));
+  RB_GC_GUARD(argv[0]);
+  return path;
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.decode_path = true, false or :normalize
+ *
+ * Makes the parser store the decoded path of every request in
+ * env["pitchfork.path_decoded"], see Pitchfork::HttpParser.unescape_path.
+ * With :normalize, dot segments are removed from it as well.
+ */
+static VALUE set_decode_path(VALUE self, VALUE value)
+{
+  if (SYMBOL_P(value) && SYM2ID(value) == id_normalize)
+    decode_path = DECODE_PATH_NORMALIZE;
+  else if (value == Qtrue || value == Qfalse || NIL_P(value))
+    decode_path = RTEST(value) ? DECODE_PATH_ON : DECODE_PATH_OFF;
+  else
+    rb_raise(rb_eArgError, "expected true, false or :normalize, got %"PRIsVALUE,
+             rb_inspect(value));
+  return value;
+}
+
+static VALUE get_decode_path(VALUE self)
+{
+  switch (decode_path) {
+  case DECODE_PATH_ON: return Qtrue;
+  case DECODE_PATH_NORMALIZE: return ID2SYM(id_normalize);
+  }
+  return Qfalse;
+}
+
+static void init_path(VALUE klass)
+{
+  g_path_decoded = rb_obj_freeze(rb_str_new_cstr("pitchfork.path_decoded"));
+  rb_gc_register_mark_object(g_path_decoded);
+  id_normalize = rb_intern("normalize");
+  rb_define_singleton_method(klass, "unescape_path", unescape_path, -1);
+  rb_define_singleton_method(klass, "decode_path=", set_decode_path, 1);
+  rb_define_singleton_method(klass, "decode_path", get_decode_path, 0);
+}
+
+#endif /* path_h */
@@ -16,6 +16,18 @@
 #include "c_util.h"
 #include "epollexclusive.h"
 #include "child_subreaper.h"
+#include "http_scan.h"
+#include "lazy_env.h"
+#include "static_route.h"
+#include "read_head.h"
+#include "cookies.h"
+#include "query.h"
+#include "multipart.h"
+#include "path.h"
+#include "remote_addr.h"
+#include "request_id.h"
+#include "zerocopy.h"
+#include "response.h"
 
 void init_pitchfork_httpdate(void);
 
@@ -31,6 +43,10 @@ void init_pitchfork_httpdate(void);
 #define UH_FL_TO_CLEAR 0x200
 #define UH_FL_RESSTART 0x400 /* for check_client_connection */
 #define UH_FL_HIJACK 0x800
+#define UH_FL_FROZENCONT 0x1000 /* hp->cont is the key of a cached value */
+#define UH_FL_LAZYHEAD 0x2000 /* env has placeholders into the head */
+#define UH_FL_TRUSTED 0x4000 /* heads come from a trusted upstream */
+#define UH_FL_ROUTE_SHIFT 24 /* the top byte holds a static route number */
 
 /* all of these flags need to be set for keepalive to be supported */
 #define UH_FL_KEEPALIVE (UH_FL_KAVERSION | UH_FL_REQEOF | UH_FL_HASHEADER)
@@ -54,6 +70,7 @@ struct http_parser {
     unsigned int query;
   } start;
   union {
+    unsigned int path_len; /* only used during request line processing */
     unsigned int field_len; /* only used during header processing */
     unsigned int dest_offset; /* only used during body processing */
   } s;
@@ -71,12 +88,41 @@ static VALUE cHttpParser;
 
 static void finalize_header(struct http_parser *hp);
 
+/*
+ * Parser errors only come with a few static messages, so we raise the
+ * same exceptions (with their empty backtraces) over and over instead
+ * of allocating them while floods of garbage requests are rejected.
+ */
+#define MAX_PARSER_ERRORS 32
+static struct {
+  VALUE klass;
+  const char *msg;
+  VALUE exc;
+} parser_errors[MAX_PARSER_ERRORS];
+static int nr_parser_errors;
+
 static void parser_raise(VALUE klass, const char *msg)
 {
-  VALUE exc = rb_exc_new2(klass, msg);
-  VALUE bt = rb_ary_new();
+  VALUE exc;
+  int i;
+
+  /* a reused exception would pick up $! as its cause */
+  if (NIL_P(rb_gv_get("$!"))) {
+    for (i = 0; i < nr_parser_errors; i++) {
+      if (parser_errors[i].msg == msg && parser_errors[i].klass == klass)
+        rb_exc_raise(parser_errors[i].exc);
+    }
+  }
 
-  rb_funcall(exc, id_set_backtrace, 1, bt);
+  exc = rb_exc_new_str(klass, rb_obj_freeze(rb_str_new_cstr(msg)));
+  rb_funcall(exc, id_set_backtrace, 1, rb_ary_new());
+  if (NIL_P(rb_gv_get("$!")) && nr_parser_errors < MAX_PARSER_ERRORS) {
+    i = nr_parser_errors++;
+    parser_errors[i].klass = klass;
+    parser_errors[i].msg = msg;
+    parser_errors[i].exc = exc;
+    rb_gc_register_mark_object(exc);
+  }
   rb_exc_raise(exc);
 }
 
@@ -97,7 +143,6 @@ static inline unsigned int ulong2uint(unsigned long n)
 #define MARK(M,FPC) (hp->M = ulong2uint((FPC) - buffer))
 #define PTR_TO(F) (buffer + hp->F)
 #define STR_NEW(M,FPC) rb_str_new(PTR_TO(M), LEN(M, FPC))
-#define STRIPPED_STR_NEW(M,FPC) stripped_str_new(PTR_TO(M), LEN(M, FPC))
 
 #define HP_FL_TEST(hp,fl) ((hp)->flags & (UH_FL_##fl))
 #define HP_FL_SET(hp,fl) ((hp)->flags |= (UH_FL_##fl))
@@ -109,13 +154,13 @@ static int is_lws(char c)
   return (c == ' ' || c == '\t');
 }
 
-static VALUE stripped_str_new(const char *str, long len)
+static long stripped_len(const char *str, long len)
 {
   long end;
 
   for (end = len - 1; end >= 0 && is_lws(str[end]); end--);
 
-  return rb_str_new(str, end + 1);
+  return end + 1;
 }
 
 /*
@@ -146,11 +191,73 @@ static void hp_keepalive_connection(struct http_parser *hp, VALUE val)
 static void
 request_method(struct http_parser *hp, const char *ptr, size_t len)
 {
-  VALUE v = rb_str_new(ptr, len);
+  VALUE v;
+
+  /* common methods are frozen constants, ordered by popularity */
+  if (CONST_MEM_EQ("GET", ptr, len))
+    v = g_method_get;
+  else if (CONST_MEM_EQ("POST", ptr, len))
+    v = g_method_post;
+  else if (CONST_MEM_EQ("HEAD", ptr, len))
+    v = g_method_head;
+  else if (CONST_MEM_EQ("PUT", ptr, len))
+    v = g_method_put;
+  else if (CONST_MEM_EQ("PATCH", ptr, len))
+    v = g_method_patch;
+  else if (CONST_MEM_EQ("DELETE", ptr, len))
+    v = g_method_delete;
+  else if (CONST_MEM_EQ("OPTIONS", ptr, len))
+    v = g_method_options;
+  else
+    v = rb_str_new(ptr, len);
 
   rb_hash_aset(hp->env, g_request_method, v);
 }
 
+/*
+ * REQUEST_PATH and QUERY_STRING are always contained in REQUEST_URI,
+ * so the request_path and query_string actions only record their spans
+ * and the strings are created here as substrings of a frozen
+ * REQUEST_URI, sharing its buffer instead of copying it again.
+ */
+static void
+request_uri(struct http_parser *hp, const char *ptr, size_t len)
+{
+  VALUE uri = rb_obj_freeze(rb_str_new(ptr, len));
+
+  rb_hash_aset(hp->env, g_request_uri, uri);
+
+  /*
+   * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
+   * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
+   */
+  if (CONST_MEM_EQ("*", ptr, len)) {
+    VALUE str = rb_str_new(NULL, 0);
+
+    rb_hash_aset(hp->env, g_path_info, str);
+    rb_hash_aset(hp->env, g_request_path, str);
+    if (decode_path)
+      set_path_decoded(hp->env, ptr, 0);
+    return;
+  }
+
+  if (hp->s.path_len) {
+    VALUE path = rb_str_substr(uri, 0, hp->s.path_len);
+
+    rb_hash_aset(hp->env, g_request_path, path);
+    rb_hash_aset(hp->env, g_path_info, path);
+    if (decode_path)
+      set_path_decoded(hp->env, ptr, hp->s.path_len);
+  }
+
+  if (hp->start.query) {
+    long off = hp->start.query - hp->mark;
+
+    rb_hash_aset(hp->env, g_query_string,
+                 rb_str_substr(uri, off, (long)len - off));
+  }
+}
+
 static void
 http_version(struct http_parser *hp, const char *ptr, size_t len)
 {
@@ -177,7 +284,30 @@ static inline void hp_invalid_if_trailer(struct http_parser *hp)
     parser_raise(eHttpParserError, "invalid Trailer");
 }
 
-static void write_cont_value(struct http_parser *hp,
+/*
+ * Replaces a frozen (cached) or not yet materialized (lazy) env value
+ * with a String we may append to, for duplicate and continuation lines.
+ */
+static VALUE own_value(struct http_parser *hp, const char *buffer,
+                       VALUE key, VALUE v)
+{
+  if (FIXNUM_P(v)) {
+    VALUE head = rb_ivar_get(hp->env, id_head);
+
+    /* the head is only kept once it's fully parsed */
+    if (NIL_P(head))
+      v = rb_str_new(buffer + LAZY_POS_OFF(v), LAZY_POS_LEN(v));
+    else
+      v = rb_str_substr(head, LAZY_POS_OFF(v), LAZY_POS_LEN(v));
+  } else {
+    v = rb_str_dup(v);
+  }
+  rb_hash_aset(hp->env, key, v);
+
+  return v;
+}
+
+static void write_cont_value(VALUE self, struct http_parser *hp,
                              char *buffer, const char *p)
 {
   char *vptr;
@@ -196,6 +326,13 @@ static void write_cont_value(struct http_parser *hp,
   if (len == 0)
     return;
 
+  if (HP_FL_TEST(hp, FROZENCONT)) {
+    VALUE v = own_value(hp, buffer, hp->cont, rb_hash_aref(hp->env, hp->cont));
+
+    RB_OBJ_WRITE(self, &hp->cont, v);
+    HP_FL_UNSET(hp, FROZENCONT);
+  }
+
   cont_len = RSTRING_LEN(hp->cont);
   if (cont_len > 0) {
     --hp->mark;
@@ -229,12 +366,14 @@ static int is_chunked(VALUE v)
 static void write_value(VALUE self, struct http_parser *hp,
                         const char *buffer, const char *p)
 {
-  VALUE f = find_common_field(PTR_TO(start.field), hp->s.field_len);
+  VALUE **values;
+  VALUE f = find_field(PTR_TO(start.field), hp->s.field_len, &values);
   VALUE v;
   VALUE e;
+  int lazy = !HP_FL_TEST(hp, INTRAILER) && is_lazy_env(hp->env);
 
+  HP_FL_UNSET(hp, FROZENCONT);
   VALIDATE_MAX_LENGTH(LEN(mark, p), FIELD_VALUE);
-  v = LEN(mark, p) == 0 ? rb_str_buf_new(128) : STRIPPED_STR_NEW(mark, p);
   if (NIL_P(f)) {
     const char *field = PTR_TO(start.field);
     size_t flen = hp->s.field_len;
@@ -249,8 +388,37 @@ static void write_value(VALUE self, struct http_parser *hp,
       RB_OBJ_WRITE(self, &hp->cont, Qnil);
       return;
     }
+    /* read by set_url_scheme */
+    if (CONST_MEM_EQ("X_FORWARDED_SSL", field, flen))
+      lazy = 0;
     f = uncommon_field(field, flen);
-  } else if (f == g_http_connection) {
+  } else if (f == g_http_connection || f == g_content_length ||
+             f == g_http_transfer_encoding || f == g_http_trailer ||
+             f == g_http_host || f == g_http_x_forwarded_proto) {
+    /* we need these values ourselves */
+    lazy = 0;
+  } else {
+    assert(TYPE(f) == T_STRING && "memoized object is not a string");
+    assert_frozen(f);
+  }
+
+  if (LEN(mark, p) == 0) {
+    v = rb_str_buf_new(128);
+  } else {
+    long len = stripped_len(PTR_TO(mark), LEN(mark, p));
+
+    v = cached_field_value(values, PTR_TO(mark), len);
+    if (!NIL_P(v)) {
+      /* nothing to allocate */
+    } else if (lazy) {
+      v = LAZY_POS(hp->mark, len);
+      HP_FL_SET(hp, LAZYHEAD);
+    } else {
+      v = rb_str_new(PTR_TO(mark), len);
+    }
+  }
+
+  if (f == g_http_connection) {
     hp_keepalive_connection(hp, v);
   } else if (f == g_content_length && !HP_FL_TEST(hp, CHUNKED)) {
     if (hp->len.content)
@@ -291,14 +459,18 @@ static void write_value(VALUE self, struct http_parser *hp,
   } else if (f == g_http_trailer) {
     HP_FL_SET(hp, HASTRAILER);
     hp_invalid_if_trailer(hp);
-  } else {
-    assert(TYPE(f) == T_STRING && "memoized object is not a string");
-    assert_frozen(f);
   }
 
   e = rb_hash_aref(hp->env, f);
   if (NIL_P(e)) {
-    RB_OBJ_WRITE(self, &hp->cont, rb_hash_aset(hp->env, f, v));
+    rb_hash_aset(hp->env, f, v);
+    if (FIXNUM_P(v) || OBJ_FROZEN(v)) {
+      /* remember the key in case a continuation line needs a copy */
+      RB_OBJ_WRITE(self, &hp->cont, f);
+      HP_FL_SET(hp, FROZENCONT);
+    } else {
+      RB_OBJ_WRITE(self, &hp->cont, v);
+    }
   } else if (f == g_http_host) {
     /*
      * ignored, absolute URLs in REQUEST_URI take precedence over
@@ -306,20 +478,26 @@ static void write_value(VALUE self, struct http_parser *hp,
      */
     RB_OBJ_WRITE(self, &hp->cont, Qnil);
   } else {
+    if (FIXNUM_P(e) || OBJ_FROZEN(e))
+      e = own_value(hp, buffer, f, e);
     rb_str_buf_cat(e, ",", 1);
-    RB_OBJ_WRITE(self, &hp->cont, rb_str_buf_append(e, v));
+    if (FIXNUM_P(v))
+      rb_str_buf_cat(e, buffer + LAZY_POS_OFF(v), LAZY_POS_LEN(v));
+    else
+      rb_str_buf_append(e, v);
+    RB_OBJ_WRITE(self, &hp->cont, e);
   }
 }
 
 /** Machine **/
 
 
-#line 421 "pitchfork_http.rl"
+#line 578 "pitchfork_http.rl"
 
 
 /** Data **/
 
-#line 323 "pitchfork_http.c"
+#line 501 "pitchfork_http.c"
 static const int http_parser_start = 1;
 static const int http_parser_first_final = 122;
 static const int http_parser_error = 0;
@@ -330,12 +508,32 @@ static const int http_parser_en_Trailers = 114;
 static const int http_parser_en_main = 1;
 
 
-#line 425 "pitchfork_http.rl"
+#line 582 "pitchfork_http.rl"
+
+/* returns the state to continue in once the whole head is parsed */
+static int header_done(struct http_parser *hp)
+{
+  finalize_header(hp);
+
+  if (HP_FL_TEST(hp, HASBODY)) {
+    HP_FL_SET(hp, INBODY);
+    if (HP_FL_TEST(hp, CHUNKED))
+      return http_parser_en_ChunkedBody;
+  } else {
+    HP_FL_SET(hp, REQEOF);
+    assert(!HP_FL_TEST(hp, CHUNKED) && "chunked encoding without body!");
+    if (nr_static_routes && HP_FL_TEST(hp, HASHEADER))
+      hp->flags |= static_route_match(
+          rb_hash_aref(hp->env, g_request_method),
+          rb_hash_aref(hp->env, g_request_path)) << UH_FL_ROUTE_SHIFT;
+  }
+  return http_parser_first_final;
+}
 
 static void http_parser_init(struct http_parser *hp)
 {
   int cs = 0;
-  hp->flags = 0;
+  hp->flags &= UH_FL_TRUSTED; /* a property of the connection */
   hp->mark = 0;
   hp->offset = 0;
   hp->start.field = 0;
@@ -343,12 +541,12 @@ static void http_parser_init(struct http_parser *hp)
   hp->len.content = 0;
   hp->cont = Qfalse; /* zero on MRI, should be optimized away by above */
   
-#line 347 "pitchfork_http.c"
+#line 545 "pitchfork_http.c"
 	{
 	cs = http_parser_start;
 	}
 
-#line 437 "pitchfork_http.rl"
+#line 614 "pitchfork_http.rl"
   hp->cs = cs;
 }
 
@@ -376,7 +574,7 @@ http_parser_execute(VALUE self, struct http_parser *hp, char *buffer, size_t len
     goto skip_chunk_data_hack;
   }
   
-#line 380 "pitchfork_http.c"
+#line 578 "pitchfork_http.c"
 	{
 	if ( p == pe )
 		goto _test_eof;
@@ -411,14 +609,14 @@ st0:
 cs = 0;
 	goto _out;
 tr0:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st2;
 st2:
 	if ( ++p == pe )
 		goto _test_eof2;
 case 2:
-#line 422 "pitchfork_http.c"
+#line 620 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 32: goto tr3;
 		case 33: goto st49;
@@ -444,14 +642,14 @@ case 2:
 		goto st49;
 	goto st0;
 tr3:
-#line 326 "pitchfork_http.rl"
+#line 511 "pitchfork_http.rl"
 	{ request_method(hp, PTR_TO(mark), LEN(mark, p)); }
 	goto st3;
 st3:
 	if ( ++p == pe )
 		goto _test_eof3;
 case 3:
-#line 455 "pitchfork_http.c"
+#line 653 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 42: goto tr5;
 		case 47: goto tr6;
@@ -460,147 +658,95 @@ case 3:
 	}
 	goto st0;
 tr5:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st4;
 st4:
 	if ( ++p == pe )
 		goto _test_eof4;
 case 4:
-#line 471 "pitchfork_http.c"
+#line 669 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 32: goto tr8;
 		case 35: goto tr9;
 	}
 	goto st0;
 tr8:
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st5;
 tr42:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
-#line 346 "pitchfork_http.rl"
+#line 520 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), FRAGMENT);
     rb_hash_aset(hp->env, g_fragment, STR_NEW(mark, p));
   }
 	goto st5;
 tr45:
-#line 346 "pitchfork_http.rl"
+#line 520 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), FRAGMENT);
     rb_hash_aset(hp->env, g_fragment, STR_NEW(mark, p));
   }
 	goto st5;
 tr49:
-#line 356 "pitchfork_http.rl"
+#line 529 "pitchfork_http.rl"
 	{
-    VALUE val;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_PATH);
-    val = rb_hash_aset(hp->env, g_request_path, STR_NEW(mark, p));
-
-    /* rack says PATH_INFO must start with "/" or be empty */
-    if (!STR_CSTR_EQ(val, "*"))
-      rb_hash_aset(hp->env, g_path_info, val);
+    hp->s.path_len = LEN(mark, p);
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st5;
 tr55:
-#line 350 "pitchfork_http.rl"
+#line 524 "pitchfork_http.rl"
 	{MARK(start.query, p); }
-#line 351 "pitchfork_http.rl"
+#line 525 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(start.query, p), QUERY_STRING);
-    rb_hash_aset(hp->env, g_query_string, STR_NEW(start.query, p));
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st5;
 tr59:
-#line 351 "pitchfork_http.rl"
+#line 525 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(start.query, p), QUERY_STRING);
-    rb_hash_aset(hp->env, g_query_string, STR_NEW(start.query, p));
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st5;
 st5:
 	if ( ++p == pe )
 		goto _test_eof5;
 case 5:
-#line 592 "pitchfork_http.c"
+#line 738 "pitchfork_http.c"
 	if ( (*p) == 72 )
 		goto tr10;
 	goto st0;
 tr10:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st6;
 st6:
 	if ( ++p == pe )
 		goto _test_eof6;
 case 6:
-#line 604 "pitchfork_http.c"
+#line 750 "pitchfork_http.c"
 	if ( (*p) == 84 )
 		goto st7;
 	goto st0;
@@ -660,34 +806,42 @@ case 13:
 		goto st13;
 	goto st0;
 tr18:
-#line 355 "pitchfork_http.rl"
+#line 528 "pitchfork_http.rl"
 	{ http_version(hp, PTR_TO(mark), LEN(mark, p)); }
 	goto st14;
 tr26:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
-#line 325 "pitchfork_http.rl"
-	{ write_cont_value(hp, buffer, p); }
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
+#line 510 "pitchfork_http.rl"
+	{ write_cont_value(self, hp, buffer, p); }
 	goto st14;
 tr29:
-#line 325 "pitchfork_http.rl"
-	{ write_cont_value(hp, buffer, p); }
+#line 510 "pitchfork_http.rl"
+	{ write_cont_value(self, hp, buffer, p); }
 	goto st14;
 tr36:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
-#line 324 "pitchfork_http.rl"
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
+#line 509 "pitchfork_http.rl"
 	{ write_value(self, hp, buffer, p); }
 	goto st14;
 tr39:
-#line 324 "pitchfork_http.rl"
+#line 509 "pitchfork_http.rl"
 	{ write_value(self, hp, buffer, p); }
 	goto st14;
 st14:
 	if ( ++p == pe )
 		goto _test_eof14;
 case 14:
-#line 691 "pitchfork_http.c"
+#line 845 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 9: goto st15;
 		case 10: goto tr21;
@@ -716,14 +870,18 @@ case 14:
 		goto tr23;
 	goto st0;
 tr25:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
 	goto st15;
 st15:
 	if ( ++p == pe )
 		goto _test_eof15;
 case 15:
-#line 727 "pitchfork_http.c"
+#line 885 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 9: goto tr25;
 		case 10: goto tr26;
@@ -735,14 +893,18 @@ case 15:
 		goto st0;
 	goto tr24;
 tr24:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
 	goto st16;
 st16:
 	if ( ++p == pe )
 		goto _test_eof16;
 case 16:
-#line 746 "pitchfork_http.c"
+#line 908 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto tr29;
 		case 13: goto tr30;
@@ -755,51 +917,49 @@ case 16:
 		goto st0;
 	goto st16;
 tr19:
-#line 355 "pitchfork_http.rl"
+#line 528 "pitchfork_http.rl"
 	{ http_version(hp, PTR_TO(mark), LEN(mark, p)); }
 	goto st17;
 tr27:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
-#line 325 "pitchfork_http.rl"
-	{ write_cont_value(hp, buffer, p); }
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
+#line 510 "pitchfork_http.rl"
+	{ write_cont_value(self, hp, buffer, p); }
 	goto st17;
 tr30:
-#line 325 "pitchfork_http.rl"
-	{ write_cont_value(hp, buffer, p); }
+#line 510 "pitchfork_http.rl"
+	{ write_cont_value(self, hp, buffer, p); }
 	goto st17;
 tr37:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
-#line 324 "pitchfork_http.rl"
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
+#line 509 "pitchfork_http.rl"
 	{ write_value(self, hp, buffer, p); }
 	goto st17;
 tr40:
-#line 324 "pitchfork_http.rl"
+#line 509 "pitchfork_http.rl"
 	{ write_value(self, hp, buffer, p); }
 	goto st17;
 st17:
 	if ( ++p == pe )
 		goto _test_eof17;
 case 17:
-#line 786 "pitchfork_http.c"
+#line 956 "pitchfork_http.c"
 	if ( (*p) == 10 )
 		goto st14;
 	goto st0;
 tr21:
-#line 371 "pitchfork_http.rl"
+#line 538 "pitchfork_http.rl"
 	{
-    finalize_header(hp);
-
-    cs = http_parser_first_final;
-    if (HP_FL_TEST(hp, HASBODY)) {
-      HP_FL_SET(hp, INBODY);
-      if (HP_FL_TEST(hp, CHUNKED))
-        cs = http_parser_en_ChunkedBody;
-    } else {
-      HP_FL_SET(hp, REQEOF);
-      assert(!HP_FL_TEST(hp, CHUNKED) && "chunked encoding without body!");
-    }
+    cs = header_done(hp);
     /*
      * go back to Ruby so we can call the Rack application, we'll reenter
      * the parser iff the body needs to be processed.
@@ -808,35 +968,14 @@ tr21:
   }
 	goto st122;
 tr104:
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
-#line 371 "pitchfork_http.rl"
+#line 538 "pitchfork_http.rl"
 	{
-    finalize_header(hp);
-
-    cs = http_parser_first_final;
-    if (HP_FL_TEST(hp, HASBODY)) {
-      HP_FL_SET(hp, INBODY);
-      if (HP_FL_TEST(hp, CHUNKED))
-        cs = http_parser_en_ChunkedBody;
-    } else {
-      HP_FL_SET(hp, REQEOF);
-      assert(!HP_FL_TEST(hp, CHUNKED) && "chunked encoding without body!");
-    }
+    cs = header_done(hp);
     /*
      * go back to Ruby so we can call the Rack application, we'll reenter
      * the parser iff the body needs to be processed.
@@ -845,26 +984,16 @@ tr104:
   }
 	goto st122;
 tr108:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
-#line 346 "pitchfork_http.rl"
+#line 520 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), FRAGMENT);
     rb_hash_aset(hp->env, g_fragment, STR_NEW(mark, p));
   }
-#line 371 "pitchfork_http.rl"
+#line 538 "pitchfork_http.rl"
 	{
-    finalize_header(hp);
-
-    cs = http_parser_first_final;
-    if (HP_FL_TEST(hp, HASBODY)) {
-      HP_FL_SET(hp, INBODY);
-      if (HP_FL_TEST(hp, CHUNKED))
-        cs = http_parser_en_ChunkedBody;
-    } else {
-      HP_FL_SET(hp, REQEOF);
-      assert(!HP_FL_TEST(hp, CHUNKED) && "chunked encoding without body!");
-    }
+    cs = header_done(hp);
     /*
      * go back to Ruby so we can call the Rack application, we'll reenter
      * the parser iff the body needs to be processed.
@@ -873,24 +1002,14 @@ tr108:
   }
 	goto st122;
 tr112:
-#line 346 "pitchfork_http.rl"
+#line 520 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), FRAGMENT);
     rb_hash_aset(hp->env, g_fragment, STR_NEW(mark, p));
   }
-#line 371 "pitchfork_http.rl"
+#line 538 "pitchfork_http.rl"
 	{
-    finalize_header(hp);
-
-    cs = http_parser_first_final;
-    if (HP_FL_TEST(hp, HASBODY)) {
-      HP_FL_SET(hp, INBODY);
-      if (HP_FL_TEST(hp, CHUNKED))
-        cs = http_parser_en_ChunkedBody;
-    } else {
-      HP_FL_SET(hp, REQEOF);
-      assert(!HP_FL_TEST(hp, CHUNKED) && "chunked encoding without body!");
-    }
+    cs = header_done(hp);
     /*
      * go back to Ruby so we can call the Rack application, we'll reenter
      * the parser iff the body needs to be processed.
@@ -899,46 +1018,19 @@ tr112:
   }
 	goto st122;
 tr117:
-#line 356 "pitchfork_http.rl"
+#line 529 "pitchfork_http.rl"
 	{
-    VALUE val;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_PATH);
-    val = rb_hash_aset(hp->env, g_request_path, STR_NEW(mark, p));
-
-    /* rack says PATH_INFO must start with "/" or be empty */
-    if (!STR_CSTR_EQ(val, "*"))
-      rb_hash_aset(hp->env, g_path_info, val);
+    hp->s.path_len = LEN(mark, p);
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
-#line 371 "pitchfork_http.rl"
+#line 538 "pitchfork_http.rl"
 	{
-    finalize_header(hp);
-
-    cs = http_parser_first_final;
-    if (HP_FL_TEST(hp, HASBODY)) {
-      HP_FL_SET(hp, INBODY);
-      if (HP_FL_TEST(hp, CHUNKED))
-        cs = http_parser_en_ChunkedBody;
-    } else {
-      HP_FL_SET(hp, REQEOF);
-      assert(!HP_FL_TEST(hp, CHUNKED) && "chunked encoding without body!");
-    }
+    cs = header_done(hp);
     /*
      * go back to Ruby so we can call the Rack application, we'll reenter
      * the parser iff the body needs to be processed.
@@ -947,42 +1039,20 @@ tr117:
   }
 	goto st122;
 tr124:
-#line 350 "pitchfork_http.rl"
+#line 524 "pitchfork_http.rl"
 	{MARK(start.query, p); }
-#line 351 "pitchfork_http.rl"
+#line 525 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(start.query, p), QUERY_STRING);
-    rb_hash_aset(hp->env, g_query_string, STR_NEW(start.query, p));
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
-#line 371 "pitchfork_http.rl"
+#line 538 "pitchfork_http.rl"
 	{
-    finalize_header(hp);
-
-    cs = http_parser_first_final;
-    if (HP_FL_TEST(hp, HASBODY)) {
-      HP_FL_SET(hp, INBODY);
-      if (HP_FL_TEST(hp, CHUNKED))
-        cs = http_parser_en_ChunkedBody;
-    } else {
-      HP_FL_SET(hp, REQEOF);
-      assert(!HP_FL_TEST(hp, CHUNKED) && "chunked encoding without body!");
-    }
+    cs = header_done(hp);
     /*
      * go back to Ruby so we can call the Rack application, we'll reenter
      * the parser iff the body needs to be processed.
@@ -991,40 +1061,18 @@ tr124:
   }
 	goto st122;
 tr129:
-#line 351 "pitchfork_http.rl"
+#line 525 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(start.query, p), QUERY_STRING);
-    rb_hash_aset(hp->env, g_query_string, STR_NEW(start.query, p));
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
-#line 371 "pitchfork_http.rl"
+#line 538 "pitchfork_http.rl"
 	{
-    finalize_header(hp);
-
-    cs = http_parser_first_final;
-    if (HP_FL_TEST(hp, HASBODY)) {
-      HP_FL_SET(hp, INBODY);
-      if (HP_FL_TEST(hp, CHUNKED))
-        cs = http_parser_en_ChunkedBody;
-    } else {
-      HP_FL_SET(hp, REQEOF);
-      assert(!HP_FL_TEST(hp, CHUNKED) && "chunked encoding without body!");
-    }
+    cs = header_done(hp);
     /*
      * go back to Ruby so we can call the Rack application, we'll reenter
      * the parser iff the body needs to be processed.
@@ -1036,142 +1084,93 @@ st122:
 	if ( ++p == pe )
 		goto _test_eof122;
 case 122:
-#line 1040 "pitchfork_http.c"
+#line 1088 "pitchfork_http.c"
 	goto st0;
 tr105:
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st18;
 tr109:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
-#line 346 "pitchfork_http.rl"
+#line 520 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), FRAGMENT);
     rb_hash_aset(hp->env, g_fragment, STR_NEW(mark, p));
   }
 	goto st18;
 tr113:
-#line 346 "pitchfork_http.rl"
+#line 520 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), FRAGMENT);
     rb_hash_aset(hp->env, g_fragment, STR_NEW(mark, p));
   }
 	goto st18;
 tr118:
-#line 356 "pitchfork_http.rl"
+#line 529 "pitchfork_http.rl"
 	{
-    VALUE val;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_PATH);
-    val = rb_hash_aset(hp->env, g_request_path, STR_NEW(mark, p));
-
-    /* rack says PATH_INFO must start with "/" or be empty */
-    if (!STR_CSTR_EQ(val, "*"))
-      rb_hash_aset(hp->env, g_path_info, val);
+    hp->s.path_len = LEN(mark, p);
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st18;
 tr125:
-#line 350 "pitchfork_http.rl"
+#line 524 "pitchfork_http.rl"
 	{MARK(start.query, p); }
-#line 351 "pitchfork_http.rl"
+#line 525 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(start.query, p), QUERY_STRING);
-    rb_hash_aset(hp->env, g_query_string, STR_NEW(start.query, p));
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st18;
 tr130:
-#line 351 "pitchfork_http.rl"
+#line 525 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(start.query, p), QUERY_STRING);
-    rb_hash_aset(hp->env, g_query_string, STR_NEW(start.query, p));
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st18;
 st18:
 	if ( ++p == pe )
 		goto _test_eof18;
 case 18:
-#line 1157 "pitchfork_http.c"
+#line 1153 "pitchfork_http.c"
 	if ( (*p) == 10 )
 		goto tr21;
 	goto st0;
 tr23:
-#line 319 "pitchfork_http.rl"
-	{ MARK(start.field, p); }
-#line 320 "pitchfork_http.rl"
+#line 497 "pitchfork_http.rl"
+	{
+    MARK(start.field, p);
+    p = skip_field(p, pe);
+  }
+#line 501 "pitchfork_http.rl"
 	{ snake_upcase_char(deconst(p)); }
 	goto st19;
 tr32:
-#line 320 "pitchfork_http.rl"
+#line 501 "pitchfork_http.rl"
 	{ snake_upcase_char(deconst(p)); }
 	goto st19;
 st19:
 	if ( ++p == pe )
 		goto _test_eof19;
 case 19:
-#line 1175 "pitchfork_http.c"
+#line 1174 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 33: goto tr32;
 		case 58: goto tr33;
@@ -1197,18 +1196,22 @@ case 19:
 		goto tr32;
 	goto st0;
 tr35:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
 	goto st20;
 tr33:
-#line 322 "pitchfork_http.rl"
+#line 503 "pitchfork_http.rl"
 	{ hp->s.field_len = LEN(start.field, p); }
 	goto st20;
 st20:
 	if ( ++p == pe )
 		goto _test_eof20;
 case 20:
-#line 1212 "pitchfork_http.c"
+#line 1215 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 9: goto tr35;
 		case 10: goto tr36;
@@ -1220,14 +1223,18 @@ case 20:
 		goto st0;
 	goto tr34;
 tr34:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
 	goto st21;
 st21:
 	if ( ++p == pe )
 		goto _test_eof21;
 case 21:
-#line 1231 "pitchfork_http.c"
+#line 1238 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto tr39;
 		case 13: goto tr40;
@@ -1240,105 +1247,53 @@ case 21:
 		goto st0;
 	goto st21;
 tr9:
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st22;
 tr50:
-#line 356 "pitchfork_http.rl"
+#line 529 "pitchfork_http.rl"
 	{
-    VALUE val;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_PATH);
-    val = rb_hash_aset(hp->env, g_request_path, STR_NEW(mark, p));
-
-    /* rack says PATH_INFO must start with "/" or be empty */
-    if (!STR_CSTR_EQ(val, "*"))
-      rb_hash_aset(hp->env, g_path_info, val);
+    hp->s.path_len = LEN(mark, p);
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st22;
 tr56:
-#line 350 "pitchfork_http.rl"
+#line 524 "pitchfork_http.rl"
 	{MARK(start.query, p); }
-#line 351 "pitchfork_http.rl"
+#line 525 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(start.query, p), QUERY_STRING);
-    rb_hash_aset(hp->env, g_query_string, STR_NEW(start.query, p));
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st22;
 tr60:
-#line 351 "pitchfork_http.rl"
+#line 525 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(start.query, p), QUERY_STRING);
-    rb_hash_aset(hp->env, g_query_string, STR_NEW(start.query, p));
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st22;
 st22:
 	if ( ++p == pe )
 		goto _test_eof22;
 case 22:
-#line 1342 "pitchfork_http.c"
+#line 1297 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 32: goto tr42;
 		case 35: goto st0;
@@ -1349,14 +1304,14 @@ case 22:
 		goto st0;
 	goto tr41;
 tr41:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st23;
 st23:
 	if ( ++p == pe )
 		goto _test_eof23;
 case 23:
-#line 1360 "pitchfork_http.c"
+#line 1315 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 32: goto tr45;
 		case 35: goto st0;
@@ -1367,14 +1322,14 @@ case 23:
 		goto st0;
 	goto st23;
 tr43:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st24;
 st24:
 	if ( ++p == pe )
 		goto _test_eof24;
 case 24:
-#line 1378 "pitchfork_http.c"
+#line 1333 "pitchfork_http.c"
 	if ( (*p) < 65 ) {
 		if ( 48 <= (*p) && (*p) <= 57 )
 			goto st25;
@@ -1398,20 +1353,20 @@ case 25:
 		goto st23;
 	goto st0;
 tr6:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st26;
 tr76:
-#line 330 "pitchfork_http.rl"
+#line 515 "pitchfork_http.rl"
 	{ rb_hash_aset(hp->env, g_http_host, STR_NEW(mark, p)); }
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st26;
 st26:
 	if ( ++p == pe )
 		goto _test_eof26;
 case 26:
-#line 1415 "pitchfork_http.c"
+#line 1370 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 32: goto tr49;
 		case 35: goto tr50;
@@ -1449,23 +1404,17 @@ case 28:
 		goto st26;
 	goto st0;
 tr52:
-#line 356 "pitchfork_http.rl"
+#line 529 "pitchfork_http.rl"
 	{
-    VALUE val;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_PATH);
-    val = rb_hash_aset(hp->env, g_request_path, STR_NEW(mark, p));
-
-    /* rack says PATH_INFO must start with "/" or be empty */
-    if (!STR_CSTR_EQ(val, "*"))
-      rb_hash_aset(hp->env, g_path_info, val);
+    hp->s.path_len = LEN(mark, p);
   }
 	goto st29;
 st29:
 	if ( ++p == pe )
 		goto _test_eof29;
 case 29:
-#line 1469 "pitchfork_http.c"
+#line 1418 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 32: goto tr55;
 		case 35: goto tr56;
@@ -1476,14 +1425,14 @@ case 29:
 		goto st0;
 	goto tr54;
 tr54:
-#line 350 "pitchfork_http.rl"
+#line 524 "pitchfork_http.rl"
 	{MARK(start.query, p); }
 	goto st30;
 st30:
 	if ( ++p == pe )
 		goto _test_eof30;
 case 30:
-#line 1487 "pitchfork_http.c"
+#line 1436 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 32: goto tr59;
 		case 35: goto tr60;
@@ -1494,14 +1443,14 @@ case 30:
 		goto st0;
 	goto st30;
 tr57:
-#line 350 "pitchfork_http.rl"
+#line 524 "pitchfork_http.rl"
 	{MARK(start.query, p); }
 	goto st31;
 st31:
 	if ( ++p == pe )
 		goto _test_eof31;
 case 31:
-#line 1505 "pitchfork_http.c"
+#line 1454 "pitchfork_http.c"
 	if ( (*p) < 65 ) {
 		if ( 48 <= (*p) && (*p) <= 57 )
 			goto st32;
@@ -1525,58 +1474,58 @@ case 32:
 		goto st30;
 	goto st0;
 tr7:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
-#line 321 "pitchfork_http.rl"
+#line 502 "pitchfork_http.rl"
 	{ downcase_char(deconst(p)); }
 	goto st33;
 st33:
 	if ( ++p == pe )
 		goto _test_eof33;
 case 33:
-#line 1538 "pitchfork_http.c"
+#line 1487 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 84: goto tr63;
 		case 116: goto tr63;
 	}
 	goto st0;
 tr63:
-#line 321 "pitchfork_http.rl"
+#line 502 "pitchfork_http.rl"
 	{ downcase_char(deconst(p)); }
 	goto st34;
 st34:
 	if ( ++p == pe )
 		goto _test_eof34;
 case 34:
-#line 1552 "pitchfork_http.c"
+#line 1501 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 84: goto tr64;
 		case 116: goto tr64;
 	}
 	goto st0;
 tr64:
-#line 321 "pitchfork_http.rl"
+#line 502 "pitchfork_http.rl"
 	{ downcase_char(deconst(p)); }
 	goto st35;
 st35:
 	if ( ++p == pe )
 		goto _test_eof35;
 case 35:
-#line 1566 "pitchfork_http.c"
+#line 1515 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 80: goto tr65;
 		case 112: goto tr65;
 	}
 	goto st0;
 tr65:
-#line 321 "pitchfork_http.rl"
+#line 502 "pitchfork_http.rl"
 	{ downcase_char(deconst(p)); }
 	goto st36;
 st36:
 	if ( ++p == pe )
 		goto _test_eof36;
 case 36:
-#line 1580 "pitchfork_http.c"
+#line 1529 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 58: goto tr66;
 		case 83: goto tr67;
@@ -1584,7 +1533,7 @@ case 36:
 	}
 	goto st0;
 tr66:
-#line 327 "pitchfork_http.rl"
+#line 512 "pitchfork_http.rl"
 	{
     rb_hash_aset(hp->env, g_rack_url_scheme, STR_NEW(mark, p));
   }
@@ -1593,7 +1542,7 @@ st37:
 	if ( ++p == pe )
 		goto _test_eof37;
 case 37:
-#line 1597 "pitchfork_http.c"
+#line 1546 "pitchfork_http.c"
 	if ( (*p) == 47 )
 		goto st38;
 	goto st0;
@@ -1681,14 +1630,14 @@ case 42:
 		goto st40;
 	goto st0;
 tr72:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st43;
 st43:
 	if ( ++p == pe )
 		goto _test_eof43;
 case 43:
-#line 1692 "pitchfork_http.c"
+#line 1641 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 37: goto st41;
 		case 47: goto tr76;
@@ -1740,14 +1689,14 @@ case 44:
 		goto st0;
 	goto st40;
 tr73:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st45;
 st45:
 	if ( ++p == pe )
 		goto _test_eof45;
 case 45:
-#line 1751 "pitchfork_http.c"
+#line 1700 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 37: goto st41;
 		case 47: goto st0;
@@ -1825,14 +1774,14 @@ case 47:
 		goto st0;
 	goto st40;
 tr67:
-#line 321 "pitchfork_http.rl"
+#line 502 "pitchfork_http.rl"
 	{ downcase_char(deconst(p)); }
 	goto st48;
 st48:
 	if ( ++p == pe )
 		goto _test_eof48;
 case 48:
-#line 1836 "pitchfork_http.c"
+#line 1785 "pitchfork_http.c"
 	if ( (*p) == 58 )
 		goto tr66;
 	goto st0;
@@ -2348,14 +2297,14 @@ case 67:
 		goto tr3;
 	goto st0;
 tr2:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st68;
 st68:
 	if ( ++p == pe )
 		goto _test_eof68;
 case 68:
-#line 2359 "pitchfork_http.c"
+#line 2308 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 32: goto tr3;
 		case 33: goto st49;
@@ -2439,14 +2388,14 @@ case 70:
 		goto st51;
 	goto st0;
 tr100:
-#line 326 "pitchfork_http.rl"
+#line 511 "pitchfork_http.rl"
 	{ request_method(hp, PTR_TO(mark), LEN(mark, p)); }
 	goto st71;
 st71:
 	if ( ++p == pe )
 		goto _test_eof71;
 case 71:
-#line 2450 "pitchfork_http.c"
+#line 2399 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 42: goto tr101;
 		case 47: goto tr102;
@@ -2455,14 +2404,14 @@ case 71:
 	}
 	goto st0;
 tr101:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st72;
 st72:
 	if ( ++p == pe )
 		goto _test_eof72;
 case 72:
-#line 2466 "pitchfork_http.c"
+#line 2415 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto tr104;
 		case 13: goto tr105;
@@ -2471,105 +2420,53 @@ case 72:
 	}
 	goto st0;
 tr106:
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st73;
 tr119:
-#line 356 "pitchfork_http.rl"
+#line 529 "pitchfork_http.rl"
 	{
-    VALUE val;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_PATH);
-    val = rb_hash_aset(hp->env, g_request_path, STR_NEW(mark, p));
-
-    /* rack says PATH_INFO must start with "/" or be empty */
-    if (!STR_CSTR_EQ(val, "*"))
-      rb_hash_aset(hp->env, g_path_info, val);
+    hp->s.path_len = LEN(mark, p);
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st73;
 tr126:
-#line 350 "pitchfork_http.rl"
+#line 524 "pitchfork_http.rl"
 	{MARK(start.query, p); }
-#line 351 "pitchfork_http.rl"
+#line 525 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(start.query, p), QUERY_STRING);
-    rb_hash_aset(hp->env, g_query_string, STR_NEW(start.query, p));
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st73;
 tr131:
-#line 351 "pitchfork_http.rl"
+#line 525 "pitchfork_http.rl"
 	{
     VALIDATE_MAX_URI_LENGTH(LEN(start.query, p), QUERY_STRING);
-    rb_hash_aset(hp->env, g_query_string, STR_NEW(start.query, p));
   }
-#line 331 "pitchfork_http.rl"
+#line 516 "pitchfork_http.rl"
 	{
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, p));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, p));
   }
 	goto st73;
 st73:
 	if ( ++p == pe )
 		goto _test_eof73;
 case 73:
-#line 2573 "pitchfork_http.c"
+#line 2470 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto tr108;
 		case 13: goto tr109;
@@ -2582,14 +2479,14 @@ case 73:
 		goto st0;
 	goto tr107;
 tr107:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st74;
 st74:
 	if ( ++p == pe )
 		goto _test_eof74;
 case 74:
-#line 2593 "pitchfork_http.c"
+#line 2490 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto tr112;
 		case 13: goto tr113;
@@ -2602,14 +2499,14 @@ case 74:
 		goto st0;
 	goto st74;
 tr110:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st75;
 st75:
 	if ( ++p == pe )
 		goto _test_eof75;
 case 75:
-#line 2613 "pitchfork_http.c"
+#line 2510 "pitchfork_http.c"
 	if ( (*p) < 65 ) {
 		if ( 48 <= (*p) && (*p) <= 57 )
 			goto st76;
@@ -2633,20 +2530,20 @@ case 76:
 		goto st74;
 	goto st0;
 tr102:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st77;
 tr147:
-#line 330 "pitchfork_http.rl"
+#line 515 "pitchfork_http.rl"
 	{ rb_hash_aset(hp->env, g_http_host, STR_NEW(mark, p)); }
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st77;
 st77:
 	if ( ++p == pe )
 		goto _test_eof77;
 case 77:
-#line 2650 "pitchfork_http.c"
+#line 2547 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto tr117;
 		case 13: goto tr118;
@@ -2686,23 +2583,17 @@ case 79:
 		goto st77;
 	goto st0;
 tr121:
-#line 356 "pitchfork_http.rl"
+#line 529 "pitchfork_http.rl"
 	{
-    VALUE val;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, p), REQUEST_PATH);
-    val = rb_hash_aset(hp->env, g_request_path, STR_NEW(mark, p));
-
-    /* rack says PATH_INFO must start with "/" or be empty */
-    if (!STR_CSTR_EQ(val, "*"))
-      rb_hash_aset(hp->env, g_path_info, val);
+    hp->s.path_len = LEN(mark, p);
   }
 	goto st80;
 st80:
 	if ( ++p == pe )
 		goto _test_eof80;
 case 80:
-#line 2706 "pitchfork_http.c"
+#line 2597 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto tr124;
 		case 13: goto tr125;
@@ -2715,14 +2606,14 @@ case 80:
 		goto st0;
 	goto tr123;
 tr123:
-#line 350 "pitchfork_http.rl"
+#line 524 "pitchfork_http.rl"
 	{MARK(start.query, p); }
 	goto st81;
 st81:
 	if ( ++p == pe )
 		goto _test_eof81;
 case 81:
-#line 2726 "pitchfork_http.c"
+#line 2617 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto tr129;
 		case 13: goto tr130;
@@ -2735,14 +2626,14 @@ case 81:
 		goto st0;
 	goto st81;
 tr127:
-#line 350 "pitchfork_http.rl"
+#line 524 "pitchfork_http.rl"
 	{MARK(start.query, p); }
 	goto st82;
 st82:
 	if ( ++p == pe )
 		goto _test_eof82;
 case 82:
-#line 2746 "pitchfork_http.c"
+#line 2637 "pitchfork_http.c"
 	if ( (*p) < 65 ) {
 		if ( 48 <= (*p) && (*p) <= 57 )
 			goto st83;
@@ -2766,58 +2657,58 @@ case 83:
 		goto st81;
 	goto st0;
 tr103:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
-#line 321 "pitchfork_http.rl"
+#line 502 "pitchfork_http.rl"
 	{ downcase_char(deconst(p)); }
 	goto st84;
 st84:
 	if ( ++p == pe )
 		goto _test_eof84;
 case 84:
-#line 2779 "pitchfork_http.c"
+#line 2670 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 84: goto tr134;
 		case 116: goto tr134;
 	}
 	goto st0;
 tr134:
-#line 321 "pitchfork_http.rl"
+#line 502 "pitchfork_http.rl"
 	{ downcase_char(deconst(p)); }
 	goto st85;
 st85:
 	if ( ++p == pe )
 		goto _test_eof85;
 case 85:
-#line 2793 "pitchfork_http.c"
+#line 2684 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 84: goto tr135;
 		case 116: goto tr135;
 	}
 	goto st0;
 tr135:
-#line 321 "pitchfork_http.rl"
+#line 502 "pitchfork_http.rl"
 	{ downcase_char(deconst(p)); }
 	goto st86;
 st86:
 	if ( ++p == pe )
 		goto _test_eof86;
 case 86:
-#line 2807 "pitchfork_http.c"
+#line 2698 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 80: goto tr136;
 		case 112: goto tr136;
 	}
 	goto st0;
 tr136:
-#line 321 "pitchfork_http.rl"
+#line 502 "pitchfork_http.rl"
 	{ downcase_char(deconst(p)); }
 	goto st87;
 st87:
 	if ( ++p == pe )
 		goto _test_eof87;
 case 87:
-#line 2821 "pitchfork_http.c"
+#line 2712 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 58: goto tr137;
 		case 83: goto tr138;
@@ -2825,7 +2716,7 @@ case 87:
 	}
 	goto st0;
 tr137:
-#line 327 "pitchfork_http.rl"
+#line 512 "pitchfork_http.rl"
 	{
     rb_hash_aset(hp->env, g_rack_url_scheme, STR_NEW(mark, p));
   }
@@ -2834,7 +2725,7 @@ st88:
 	if ( ++p == pe )
 		goto _test_eof88;
 case 88:
-#line 2838 "pitchfork_http.c"
+#line 2729 "pitchfork_http.c"
 	if ( (*p) == 47 )
 		goto st89;
 	goto st0;
@@ -2922,14 +2813,14 @@ case 93:
 		goto st91;
 	goto st0;
 tr143:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st94;
 st94:
 	if ( ++p == pe )
 		goto _test_eof94;
 case 94:
-#line 2933 "pitchfork_http.c"
+#line 2824 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 37: goto st92;
 		case 47: goto tr147;
@@ -2981,14 +2872,14 @@ case 95:
 		goto st0;
 	goto st91;
 tr144:
-#line 317 "pitchfork_http.rl"
+#line 495 "pitchfork_http.rl"
 	{MARK(mark, p); }
 	goto st96;
 st96:
 	if ( ++p == pe )
 		goto _test_eof96;
 case 96:
-#line 2992 "pitchfork_http.c"
+#line 2883 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 37: goto st92;
 		case 47: goto st0;
@@ -3066,14 +2957,14 @@ case 98:
 		goto st0;
 	goto st91;
 tr138:
-#line 321 "pitchfork_http.rl"
+#line 502 "pitchfork_http.rl"
 	{ downcase_char(deconst(p)); }
 	goto st99;
 st99:
 	if ( ++p == pe )
 		goto _test_eof99;
 case 99:
-#line 3077 "pitchfork_http.c"
+#line 2968 "pitchfork_http.c"
 	if ( (*p) == 58 )
 		goto tr137;
 	goto st0;
@@ -3093,7 +2984,7 @@ case 100:
 		goto tr152;
 	goto st0;
 tr151:
-#line 366 "pitchfork_http.rl"
+#line 533 "pitchfork_http.rl"
 	{
     hp->len.chunk = step_incr(hp->len.chunk, (*p), 16);
     if (hp->len.chunk < 0)
@@ -3104,7 +2995,7 @@ st101:
 	if ( ++p == pe )
 		goto _test_eof101;
 case 101:
-#line 3108 "pitchfork_http.c"
+#line 2999 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto tr153;
 		case 13: goto st102;
@@ -3121,7 +3012,7 @@ case 101:
 		goto tr152;
 	goto st0;
 tr153:
-#line 395 "pitchfork_http.rl"
+#line 552 "pitchfork_http.rl"
 	{
     HP_FL_SET(hp, INTRAILER);
     cs = http_parser_en_Trailers;
@@ -3134,7 +3025,7 @@ st123:
 	if ( ++p == pe )
 		goto _test_eof123;
 case 123:
-#line 3138 "pitchfork_http.c"
+#line 3029 "pitchfork_http.c"
 	goto st0;
 st102:
 	if ( ++p == pe )
@@ -3144,7 +3035,7 @@ case 102:
 		goto tr153;
 	goto st0;
 tr152:
-#line 366 "pitchfork_http.rl"
+#line 533 "pitchfork_http.rl"
 	{
     hp->len.chunk = step_incr(hp->len.chunk, (*p), 16);
     if (hp->len.chunk < 0)
@@ -3155,7 +3046,7 @@ st103:
 	if ( ++p == pe )
 		goto _test_eof103;
 case 103:
-#line 3159 "pitchfork_http.c"
+#line 3050 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto st104;
 		case 13: goto st107;
@@ -3176,7 +3067,7 @@ st104:
 case 104:
 	goto tr159;
 tr159:
-#line 403 "pitchfork_http.rl"
+#line 560 "pitchfork_http.rl"
 	{
   skip_chunk_data_hack: {
     size_t nr = MIN((size_t)hp->len.chunk, REMAINING);
@@ -3198,7 +3089,7 @@ st105:
 	if ( ++p == pe )
 		goto _test_eof105;
 case 105:
-#line 3202 "pitchfork_http.c"
+#line 3093 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto st100;
 		case 13: goto st106;
@@ -3405,30 +3296,38 @@ case 113:
 		goto st113;
 	goto st0;
 tr172:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
-#line 325 "pitchfork_http.rl"
-	{ write_cont_value(hp, buffer, p); }
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
+#line 510 "pitchfork_http.rl"
+	{ write_cont_value(self, hp, buffer, p); }
 	goto st114;
 tr175:
-#line 325 "pitchfork_http.rl"
-	{ write_cont_value(hp, buffer, p); }
+#line 510 "pitchfork_http.rl"
+	{ write_cont_value(self, hp, buffer, p); }
 	goto st114;
 tr182:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
-#line 324 "pitchfork_http.rl"
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
+#line 509 "pitchfork_http.rl"
 	{ write_value(self, hp, buffer, p); }
 	goto st114;
 tr185:
-#line 324 "pitchfork_http.rl"
+#line 509 "pitchfork_http.rl"
 	{ write_value(self, hp, buffer, p); }
 	goto st114;
 st114:
 	if ( ++p == pe )
 		goto _test_eof114;
 case 114:
-#line 3432 "pitchfork_http.c"
+#line 3331 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 9: goto st115;
 		case 10: goto tr167;
@@ -3457,14 +3356,18 @@ case 114:
 		goto tr169;
 	goto st0;
 tr171:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
 	goto st115;
 st115:
 	if ( ++p == pe )
 		goto _test_eof115;
 case 115:
-#line 3468 "pitchfork_http.c"
+#line 3371 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 9: goto tr171;
 		case 10: goto tr172;
@@ -3476,14 +3379,18 @@ case 115:
 		goto st0;
 	goto tr170;
 tr170:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
 	goto st116;
 st116:
 	if ( ++p == pe )
 		goto _test_eof116;
 case 116:
-#line 3487 "pitchfork_http.c"
+#line 3394 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto tr175;
 		case 13: goto tr176;
@@ -3496,35 +3403,43 @@ case 116:
 		goto st0;
 	goto st116;
 tr173:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
-#line 325 "pitchfork_http.rl"
-	{ write_cont_value(hp, buffer, p); }
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
+#line 510 "pitchfork_http.rl"
+	{ write_cont_value(self, hp, buffer, p); }
 	goto st117;
 tr176:
-#line 325 "pitchfork_http.rl"
-	{ write_cont_value(hp, buffer, p); }
+#line 510 "pitchfork_http.rl"
+	{ write_cont_value(self, hp, buffer, p); }
 	goto st117;
 tr183:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
-#line 324 "pitchfork_http.rl"
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
+#line 509 "pitchfork_http.rl"
 	{ write_value(self, hp, buffer, p); }
 	goto st117;
 tr186:
-#line 324 "pitchfork_http.rl"
+#line 509 "pitchfork_http.rl"
 	{ write_value(self, hp, buffer, p); }
 	goto st117;
 st117:
 	if ( ++p == pe )
 		goto _test_eof117;
 case 117:
-#line 3523 "pitchfork_http.c"
+#line 3438 "pitchfork_http.c"
 	if ( (*p) == 10 )
 		goto st114;
 	goto st0;
 tr167:
-#line 390 "pitchfork_http.rl"
+#line 547 "pitchfork_http.rl"
 	{
     cs = http_parser_first_final;
     goto post_exec;
@@ -3534,7 +3449,7 @@ st124:
 	if ( ++p == pe )
 		goto _test_eof124;
 case 124:
-#line 3538 "pitchfork_http.c"
+#line 3453 "pitchfork_http.c"
 	goto st0;
 st118:
 	if ( ++p == pe )
@@ -3544,20 +3459,23 @@ case 118:
 		goto tr167;
 	goto st0;
 tr169:
-#line 319 "pitchfork_http.rl"
-	{ MARK(start.field, p); }
-#line 320 "pitchfork_http.rl"
+#line 497 "pitchfork_http.rl"
+	{
+    MARK(start.field, p);
+    p = skip_field(p, pe);
+  }
+#line 501 "pitchfork_http.rl"
 	{ snake_upcase_char(deconst(p)); }
 	goto st119;
 tr178:
-#line 320 "pitchfork_http.rl"
+#line 501 "pitchfork_http.rl"
 	{ snake_upcase_char(deconst(p)); }
 	goto st119;
 st119:
 	if ( ++p == pe )
 		goto _test_eof119;
 case 119:
-#line 3561 "pitchfork_http.c"
+#line 3479 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 33: goto tr178;
 		case 58: goto tr179;
@@ -3583,18 +3501,22 @@ case 119:
 		goto tr178;
 	goto st0;
 tr181:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
 	goto st120;
 tr179:
-#line 322 "pitchfork_http.rl"
+#line 503 "pitchfork_http.rl"
 	{ hp->s.field_len = LEN(start.field, p); }
 	goto st120;
 st120:
 	if ( ++p == pe )
 		goto _test_eof120;
 case 120:
-#line 3598 "pitchfork_http.c"
+#line 3520 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 9: goto tr181;
 		case 10: goto tr182;
@@ -3606,14 +3528,18 @@ case 120:
 		goto st0;
 	goto tr180;
 tr180:
-#line 323 "pitchfork_http.rl"
-	{ MARK(mark, p); }
+#line 504 "pitchfork_http.rl"
+	{
+    MARK(mark, p);
+    if (!is_lws((*p)))
+      p = skip_content(p, pe);
+  }
 	goto st121;
 st121:
 	if ( ++p == pe )
 		goto _test_eof121;
 case 121:
-#line 3617 "pitchfork_http.c"
+#line 3543 "pitchfork_http.c"
 	switch( (*p) ) {
 		case 10: goto tr185;
 		case 13: goto tr186;
@@ -3754,7 +3680,7 @@ case 121:
 	_out: {}
 	}
 
-#line 464 "pitchfork_http.rl"
+#line 641 "pitchfork_http.rl"
 post_exec: /* "_out:" also goes here */
   if (hp->cs != http_parser_error)
     hp->cs = cs;
@@ -3764,6 +3690,120 @@ post_exec: /* "_out:" also goes here */
   assert(hp->offset <= len && "offset longer than length");
 }
 
+/*
+ * Heads from a trusted upstream (e.g. a proxy which already validated
+ * and normalized them) only get split on spaces, line ends and colons
+ * here, which is cheaper than running them through the state machine.
+ * Anything we don't expect from such a proxy (absolute URIs, HTTP/0.9,
+ * continuation lines...) is still left to http_parser_execute.
+ */
+static int trusted_line(const char *p, const char *pe, const char **eol)
+{
+  const char *lf = memchr(p, '\n', pe - p);
+
+  if (!lf)
+    return 0;
+  *eol = lf > p && lf[-1] == '\r' ? lf - 1 : lf;
+  return 1;
+}
+
+/*
+ * returns 1 and sets +blank+ to the empty line ending the head if it's
+ * complete, 0 if more needs to be read, or -1 if the head needs the
+ * strict parser
+ */
+static int trusted_scan(const char *buffer, size_t len, const char **blank)
+{
+  const char *p = buffer, *pe = buffer + len, *eol, *sp;
+
+  if (!trusted_line(p, pe, &eol))
+    return 0;
+  sp = memchr(p, ' ', eol - p);
+  if (!sp || sp == p || !(sp[1] == '/' || (sp[1] == '*' && sp[2] == ' ')) ||
+      !memchr(sp + 1, ' ', eol - sp - 1))
+    return -1;
+
+  for (p = *eol == '\r' ? eol + 2 : eol + 1; p < pe; p = eol + 1) {
+    if (!trusted_line(p, pe, &eol))
+      return 0;
+    if (eol == p) {
+      *blank = p;
+      return 1;
+    }
+    if (is_lws(*p) || *p == ':' || !memchr(p, ':', eol - p))
+      return -1;
+    if (*eol == '\r')
+      eol++;
+  }
+  return 0;
+}
+
+static void
+trusted_execute(VALUE self, struct http_parser *hp, char *buffer, size_t len)
+{
+  const char *blank;
+  char *p, *eol, *sp, *uri, *q;
+
+  switch (trusted_scan(buffer, len, &blank)) {
+  case -1:
+    http_parser_execute(self, hp, buffer, len);
+    return;
+  case 0:
+    if (len > MAX_HEADER_LEN)
+      parser_raise(e413, "HTTP header is too large");
+    return;
+  }
+
+  /* request line */
+  eol = memchr(buffer, '\n', len);
+  if (eol[-1] == '\r')
+    eol--;
+  sp = memchr(buffer, ' ', eol - buffer);
+  request_method(hp, buffer, sp - buffer);
+
+  uri = sp + 1;
+  sp = memchr(uri, ' ', eol - uri);
+  q = memchr(uri, '#', sp - uri);
+  if (q) {
+    VALIDATE_MAX_URI_LENGTH((size_t)(sp - q - 1), FRAGMENT);
+    rb_hash_aset(hp->env, g_fragment, rb_str_new(q + 1, sp - q - 1));
+  } else {
+    q = sp;
+  }
+  MARK(mark, uri);
+  p = memchr(uri, '?', q - uri);
+  if (p) {
+    MARK(start.query, p + 1);
+    VALIDATE_MAX_URI_LENGTH((size_t)(q - p - 1), QUERY_STRING);
+  } else {
+    p = q;
+  }
+  if (*uri == '/') {
+    VALIDATE_MAX_URI_LENGTH((size_t)(p - uri), REQUEST_PATH);
+    hp->s.path_len = ulong2uint(p - uri);
+  }
+  VALIDATE_MAX_URI_LENGTH((size_t)(q - uri), REQUEST_URI);
+  request_uri(hp, uri, q - uri);
+  http_version(hp, sp + 1, eol - sp - 1);
+
+  /* header lines, trusted_scan made sure each one has a colon */
+  for (p = *eol == '\r' ? eol + 2 : eol + 1; p < blank; p = eol + 1) {
+    char *colon = memchr(p, ':', blank - p);
+
+    eol = memchr(colon, '\n', blank - colon);
+    MARK(start.field, p);
+    hp->s.field_len = ulong2uint(colon - p);
+    for (; p < colon; p++)
+      snake_upcase_char(p);
+    for (p = colon + 1; p < eol && is_lws(*p); p++);
+    MARK(mark, p);
+    write_value(self, hp, buffer, eol[-1] == '\r' ? eol - 1 : eol);
+  }
+
+  hp->cs = header_done(hp);
+  hp->offset = ulong2uint((*blank == '\r' ? blank + 1 : blank) - buffer);
+}
+
 static void hp_mark(void *ptr)
 {
   struct http_parser *hp = ptr;
@@ -3917,7 +3957,7 @@ static VALUE HttpParser_init(VALUE self)
 
   http_parser_init(hp);
   RB_OBJ_WRITE(self, &hp->buf, rb_str_new(NULL, 0));
-  RB_OBJ_WRITE(self, &hp->env, rb_hash_new());
+  RB_OBJ_WRITE(self, &hp->env, new_env());
 
   return self;
 }
@@ -3938,7 +3978,13 @@ static VALUE HttpParser_clear(VALUE self)
     return HttpParser_init(self);
 
   http_parser_init(hp);
-  rb_hash_clear(hp->env);
+  if (is_lazy_env(hp->env) != lazy_env) {
+    RB_OBJ_WRITE(self, &hp->env, new_env());
+  } else {
+    env_template_reset(hp->env);
+    if (lazy_env)
+      rb_ivar_set(hp->env, id_head, Qnil);
+  }
 
   return self;
 }
@@ -3998,12 +4044,30 @@ static VALUE HttpParser_parse(VALUE self)
   if (HP_FL_TEST(hp, TO_CLEAR))
     HttpParser_clear(self);
 
-  http_parser_execute(self, hp, RSTRING_PTR(data), RSTRING_LEN(data));
+  if (HP_FL_TEST(hp, TRUSTED) && hp->cs == http_parser_start)
+    trusted_execute(self, hp, RSTRING_PTR(data), RSTRING_LEN(data));
+  else
+    http_parser_execute(self, hp, RSTRING_PTR(data), RSTRING_LEN(data));
   if (hp->offset > MAX_HEADER_LEN)
     parser_raise(e413, "HTTP header is too large");
 
   if (hp->cs == http_parser_first_final ||
       hp->cs == http_parser_en_ChunkedBody) {
+    if (!HP_FL_TEST(hp, INTRAILER)) {
+      env_template_sample(RHASH_SIZE(hp->env));
+      if (parse_cookies)
+        set_cookies(hp->env, RSTRING_PTR(data));
+      if (query_params)
+        store_query_params(hp->env);
+      if (request_context)
+        set_request_context(hp->env, RSTRING_PTR(data));
+    }
+    if (HP_FL_TEST(hp, LAZYHEAD)) {
+      VALUE head = rb_str_new(RSTRING_PTR(data), hp->offset + 1);
+
+      rb_ivar_set(hp->env, id_head, rb_obj_freeze(head));
+      HP_FL_UNSET(hp, LAZYHEAD);
+    }
     advance_str(data, hp->offset + 1);
     hp->offset = 0;
     if (HP_FL_TEST(hp, INTRAILER))
@@ -4082,6 +4146,43 @@ static VALUE HttpParser_body_eof(VALUE self)
   return hp->len.content == 0 ? Qtrue : Qfalse;
 }
 
+/**
+ * call-seq:
+ *    parser.read_head(socket) => env
+ *
+ * Reads from +socket+ until the request head is parsed, without holding
+ * the GVL while waiting for data.  Raises EOFError if the client closed
+ * the connection, and Pitchfork::RequestTimeoutError if it took longer
+ * than Pitchfork::HttpParser.header_read_timeout.
+ */
+static VALUE HttpParser_read_head(VALUE self, VALUE io)
+{
+  struct http_parser *hp = data_get(self);
+  long deadline = read_head_deadline();
+  VALUE env;
+
+  if (RSTRING_LEN(hp->buf) == 0)
+    read_head(hp->buf, io, deadline);
+  while (NIL_P(env = HttpParser_parse(self)))
+    read_head(hp->buf, io, deadline);
+
+  return env;
+}
+
+/**
+ * call-seq:
+ *    parser.static_response => response or nil
+ *
+ * Returns the response registered with Pitchfork::HttpParser.static_routes
+ * for the parsed request, if any.
+ */
+static VALUE HttpParser_static_response(VALUE self)
+{
+  struct http_parser *hp = data_get(self);
+
+  return static_route_response(hp->flags >> UH_FL_ROUTE_SHIFT);
+}
+
 /**
  * call-seq:
  *    parser.keepalive? => true or false
@@ -4100,6 +4201,33 @@ static VALUE HttpParser_keepalive(VALUE self)
   return HP_FL_ALL(hp, KEEPALIVE) ? Qtrue : Qfalse;
 }
 
+/**
+ * call-seq:
+ *    parser.trusted_upstream = true or false
+ *
+ * Marks requests read by this parser (including those after #clear) as
+ * coming from a trusted upstream, whose heads only get the minimal
+ * splitting needed to build the env instead of being fully validated.
+ */
+static VALUE HttpParser_set_trusted_upstream(VALUE self, VALUE val)
+{
+  struct http_parser *hp = data_get(self);
+
+  if (RTEST(val))
+    HP_FL_SET(hp, TRUSTED);
+  else
+    HP_FL_UNSET(hp, TRUSTED);
+
+  return val;
+}
+
+static VALUE HttpParser_trusted_upstream(VALUE self)
+{
+  struct http_parser *hp = data_get(self);
+
+  return HP_FL_TEST(hp, TRUSTED) ? Qtrue : Qfalse;
+}
+
 /**
  * call-seq:
  *    parser.next? => true or false
@@ -4138,6 +4266,79 @@ static VALUE HttpParser_buf(VALUE self)
   return data_get(self)->buf;
 }
 
+/**
+ * call-seq:
+ *    parser.write_response(io, status, headers, body, keepalive) => true, false or nil
+ *
+ * Writes a Rack response to +io+, with our own Date and Connection
+ * headers, gathering the head and body chunks into as few writes as
+ * possible.  Returns whether the connection may be reused, which
+ * requires +keepalive+ and a response the client can find the end of.
+ * If the headers have a rack.hijack callable, it is called with +io+
+ * once the head is written instead of writing +body+, and nil is
+ * returned.  +headers+ is nil for HTTP/0.9 responses.
+ */
+static VALUE HttpParser_write_response(VALUE self, VALUE io, VALUE status,
+                                       VALUE headers, VALUE body,
+                                       VALUE keepalive)
+{
+  struct http_parser *hp = data_get(self);
+  int ka = RTEST(keepalive);
+  VALUE hijack = response_write(io, status, headers, body, &ka,
+                                HP_FL_TEST(hp, RESSTART));
+
+  if (NIL_P(hijack))
+    return ka ? Qtrue : Qfalse;
+
+  HP_FL_SET(hp, HIJACK);
+  rb_funcall(hijack, rb_intern("call"), 1, io);
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *    parser.write_static_response(io, keepalive) => true or false
+ *
+ * Writes the Pitchfork::HttpServer#static_routes response matched by the
+ * request to +io+, its Date and Connection headers are the only parts
+ * not rendered ahead of time.  Returns whether to keep the connection
+ * alive, which is +keepalive+.
+ */
+static VALUE
+HttpParser_write_static_response(VALUE self, VALUE io, VALUE keepalive)
+{
+  struct http_parser *hp = data_get(self);
+  VALUE res = static_route_response(hp->flags >> UH_FL_ROUTE_SHIFT);
+  VALUE m = rb_hash_aref(hp->env, g_request_method);
+  VALUE head, body;
+
+  Check_Type(res, T_ARRAY);
+  head = rb_ary_entry(res, 0);
+  body = rb_ary_entry(res, 1);
+  StringValue(head);
+  StringValue(body);
+  if (RB_TYPE_P(m, T_STRING) && RSTRING_LEN(m) == 4 &&
+      !memcmp(RSTRING_PTR(m), "HEAD", 4))
+    body = Qnil;
+  static_response_write(io, head, body, RTEST(keepalive),
+                        HP_FL_TEST(hp, RESSTART));
+  return RTEST(keepalive) ? Qtrue : Qfalse;
+}
+
+/**
+ * call-seq:
+ *    parser.remote_addr!(peer) => String
+ *
+ * Sets REMOTE_ADDR in the env from +peer+, a client socket or the
+ * address of the client as a String, taking the X-Forwarded-For and
+ * X-Real-IP headers sent by Pitchfork::HttpParser.trusted_proxies into
+ * account.  Must be called once the request head is parsed.
+ */
+static VALUE HttpParser_remote_addr_bang(VALUE self, VALUE peer)
+{
+  return set_remote_addr(data_get(self)->env, peer);
+}
+
 static VALUE HttpParser_env(VALUE self)
 {
   return data_get(self)->env;
@@ -4266,6 +4467,8 @@ void Init_pitchfork_http(void)
                                eHttpParserError);
   e414 = rb_define_class_under(mPitchfork, "RequestURITooLongError",
                                eHttpParserError);
+  e408 = rb_define_class_under(mPitchfork, "RequestTimeoutError",
+                               eHttpParserError);
 
   id_uminus = rb_intern("-@");
   init_globals();
@@ -4274,16 +4477,27 @@ void Init_pitchfork_http(void)
   rb_define_method(cHttpParser, "clear", HttpParser_clear, 0);
   rb_define_method(cHttpParser, "parse", HttpParser_parse, 0);
   rb_define_method(cHttpParser, "add_parse", HttpParser_add_parse, 1);
+  rb_define_method(cHttpParser, "read_head", HttpParser_read_head, 1);
   rb_define_method(cHttpParser, "headers", HttpParser_headers, 2);
   rb_define_method(cHttpParser, "trailers", HttpParser_headers, 2);
   rb_define_method(cHttpParser, "filter_body", HttpParser_filter_body, 2);
   rb_define_method(cHttpParser, "content_length", HttpParser_content_length, 0);
   rb_define_method(cHttpParser, "body_eof?", HttpParser_body_eof, 0);
   rb_define_method(cHttpParser, "keepalive?", HttpParser_keepalive, 0);
+  rb_define_method(cHttpParser, "static_response", HttpParser_static_response, 0);
+  rb_define_method(cHttpParser, "trusted_upstream=",
+                   HttpParser_set_trusted_upstream, 1);
+  rb_define_method(cHttpParser, "trusted_upstream?",
+                   HttpParser_trusted_upstream, 0);
   rb_define_method(cHttpParser, "headers?", HttpParser_has_headers, 0);
   rb_define_method(cHttpParser, "next?", HttpParser_next, 0);
   rb_define_method(cHttpParser, "buf", HttpParser_buf, 0);
   rb_define_method(cHttpParser, "env", HttpParser_env, 0);
+  rb_define_method(cHttpParser, "remote_addr!", HttpParser_remote_addr_bang, 1);
+  rb_define_method(cHttpParser, "write_response",
+                   HttpParser_write_response, 5);
+  rb_define_method(cHttpParser, "write_static_response",
+                   HttpParser_write_static_response, 2);
   rb_define_method(cHttpParser, "hijacked!", HttpParser_hijacked_bang, 0);
   rb_define_method(cHttpParser, "response_start_sent=", HttpParser_rssset, 1);
   rb_define_method(cHttpParser, "response_start_sent", HttpParser_rssget, 0);
@@ -4304,13 +4518,36 @@ void Init_pitchfork_http(void)
   rb_define_const(cHttpParser, "LENGTH_MAX", OFFT2NUM(UH_OFF_T_MAX));
 
   rb_define_singleton_method(cHttpParser, "max_header_len=", set_maxhdrlen, 1);
+  rb_define_singleton_method(cHttpParser, "intern_headers", intern_headers, 1);
+  rb_define_singleton_method(cHttpParser, "header_value_cache_size=",
+                             set_header_value_cache_size, 1);
+  rb_define_singleton_method(cHttpParser, "header_value_cache_size",
+                             get_header_value_cache_size, 0);
+  rb_define_singleton_method(cHttpParser, "header_value_cache_stats",
+                             header_value_cache_stats, 0);
 
   init_common_fields();
+  init_http_scan(cHttpParser);
+  init_env_template(cHttpParser);
+  init_lazy_env(cHttpParser);
+  init_static_route(cHttpParser);
+  init_read_head(cHttpParser);
+  init_cookies(cHttpParser);
+  init_query(cHttpParser);
+  init_multipart(mPitchfork);
+  init_path(cHttpParser);
+  init_remote_addr(cHttpParser);
+  init_request_id(cHttpParser);
+  init_zerocopy(cHttpParser);
+  init_response(cHttpParser);
   SET_GLOBAL(g_http_host, "HOST");
   SET_GLOBAL(g_http_trailer, "TRAILER");
   SET_GLOBAL(g_http_transfer_encoding, "TRANSFER_ENCODING");
   SET_GLOBAL(g_content_length, "CONTENT_LENGTH");
   SET_GLOBAL(g_http_connection, "CONNECTION");
+  SET_GLOBAL(g_http_cookie, "COOKIE");
+  SET_GLOBAL(g_http_x_forwarded_for, "X_FORWARDED_FOR");
+  SET_GLOBAL(g_http_x_real_ip, "X_REAL_IP");
   id_set_backtrace = rb_intern("set_backtrace");
   init_pitchfork_httpdate();
 
@@ -14,6 +14,18 @@
 #include "c_util.h"
 #include "epollexclusive.h"
 #include "child_subreaper.h"
+#include "http_scan.h"
+#include "lazy_env.h"
+#include "static_route.h"
+#include "read_head.h"
+#include "cookies.h"
+#include "query.h"
+#include "multipart.h"
+#include "path.h"
+#include "remote_addr.h"
+#include "request_id.h"
+#include "zerocopy.h"
+#include "response.h"
 
 void init_pitchfork_httpdate(void);
 
@@ -29,6 +41,10 @@ void init_pitchfork_httpdate(void);
 #define UH_FL_TO_CLEAR 0x200
 #define UH_FL_RESSTART 0x400 /* for check_client_connection */
 #define UH_FL_HIJACK 0x800
+#define UH_FL_FROZENCONT 0x1000 /* hp->cont is the key of a cached value */
+#define UH_FL_LAZYHEAD 0x2000 /* env has placeholders into the head */
+#define UH_FL_TRUSTED 0x4000 /* heads come from a trusted upstream */
+#define UH_FL_ROUTE_SHIFT 24 /* the top byte holds a static route number */
 
 /* all of these flags need to be set for keepalive to be supported */
 #define UH_FL_KEEPALIVE (UH_FL_KAVERSION | UH_FL_REQEOF | UH_FL_HASHEADER)
@@ -52,6 +68,7 @@ struct http_parser {
     unsigned int query;
   } start;
   union {
+    unsigned int path_len; /* only used during request line processing */
     unsigned int field_len; /* only used during header processing */
     unsigned int dest_offset; /* only used during body processing */
   } s;
@@ -69,12 +86,41 @@ static VALUE cHttpParser;
 
 static void finalize_header(struct http_parser *hp);
 
+/*
+ * Parser errors only come with a few static messages, so we raise the
+ * same exceptions (with their empty backtraces) over and over instead
+ * of allocating them while floods of garbage requests are rejected.
+ */
+#define MAX_PARSER_ERRORS 32
+static struct {
+  VALUE klass;
+  const char *msg;
+  VALUE exc;
+} parser_errors[MAX_PARSER_ERRORS];
+static int nr_parser_errors;
+
 static void parser_raise(VALUE klass, const char *msg)
 {
-  VALUE exc = rb_exc_new2(klass, msg);
-  VALUE bt = rb_ary_new();
+  VALUE exc;
+  int i;
+
+  /* a reused exception would pick up $! as its cause */
+  if (NIL_P(rb_gv_get("$!"))) {
+    for (i = 0; i < nr_parser_errors; i++) {
+      if (parser_errors[i].msg == msg && parser_errors[i].klass == klass)
+        rb_exc_raise(parser_errors[i].exc);
+    }
+  }
 
-  rb_funcall(exc, id_set_backtrace, 1, bt);
+  exc = rb_exc_new_str(klass, rb_obj_freeze(rb_str_new_cstr(msg)));
+  rb_funcall(exc, id_set_backtrace, 1, rb_ary_new());
+  if (NIL_P(rb_gv_get("$!")) && nr_parser_errors < MAX_PARSER_ERRORS) {
+    i = nr_parser_errors++;
+    parser_errors[i].klass = klass;
+    parser_errors[i].msg = msg;
+    parser_errors[i].exc = exc;
+    rb_gc_register_mark_object(exc);
+  }
   rb_exc_raise(exc);
 }
 
@@ -95,7 +141,6 @@ static inline unsigned int ulong2uint(unsigned long n)
 #define MARK(M,FPC) (hp->M = ulong2uint((FPC) - buffer))
 #define PTR_TO(F) (buffer + hp->F)
 #define STR_NEW(M,FPC) rb_str_new(PTR_TO(M), LEN(M, FPC))
-#define STRIPPED_STR_NEW(M,FPC) stripped_str_new(PTR_TO(M), LEN(M, FPC))
 
 #define HP_FL_TEST(hp,fl) ((hp)->flags & (UH_FL_##fl))
 #define HP_FL_SET(hp,fl) ((hp)->flags |= (UH_FL_##fl))
@@ -107,13 +152,13 @@ static int is_lws(char c)
   return (c == ' ' || c == '\t');
 }
 
-static VALUE stripped_str_new(const char *str, long len)
+static long stripped_len(const char *str, long len)
 {
   long end;
 
   for (end = len - 1; end >= 0 && is_lws(str[end]); end--);
 
-  return rb_str_new(str, end + 1);
+  return end + 1;
 }
 
 /*
@@ -144,11 +189,73 @@ static void hp_keepalive_connection(struct http_parser *hp, VALUE val)
 static void
 request_method(struct http_parser *hp, const char *ptr, size_t len)
 {
-  VALUE v = rb_str_new(ptr, len);
+  VALUE v;
+
+  /* common methods are frozen constants, ordered by popularity */
+  if (CONST_MEM_EQ("GET", ptr, len))
+    v = g_method_get;
+  else if (CONST_MEM_EQ("POST", ptr, len))
+    v = g_method_post;
+  else if (CONST_MEM_EQ("HEAD", ptr, len))
+    v = g_method_head;
+  else if (CONST_MEM_EQ("PUT", ptr, len))
+    v = g_method_put;
+  else if (CONST_MEM_EQ("PATCH", ptr, len))
+    v = g_method_patch;
+  else if (CONST_MEM_EQ("DELETE", ptr, len))
+    v = g_method_delete;
+  else if (CONST_MEM_EQ("OPTIONS", ptr, len))
+    v = g_method_options;
+  else
+    v = rb_str_new(ptr, len);
 
   rb_hash_aset(hp->env, g_request_method, v);
 }
 
+/*
+ * REQUEST_PATH and QUERY_STRING are always contained in REQUEST_URI,
+ * so the request_path and query_string actions only record their spans
+ * and the strings are created here as substrings of a frozen
+ * REQUEST_URI, sharing its buffer instead of copying it again.
+ */
+static void
+request_uri(struct http_parser *hp, const char *ptr, size_t len)
+{
+  VALUE uri = rb_obj_freeze(rb_str_new(ptr, len));
+
+  rb_hash_aset(hp->env, g_request_uri, uri);
+
+  /*
+   * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
+   * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
+   */
+  if (CONST_MEM_EQ("*", ptr, len)) {
+    VALUE str = rb_str_new(NULL, 0);
+
+    rb_hash_aset(hp->env, g_path_info, str);
+    rb_hash_aset(hp->env, g_request_path, str);
+    if (decode_path)
+      set_path_decoded(hp->env, ptr, 0);
+    return;
+  }
+
+  if (hp->s.path_len) {
+    VALUE path = rb_str_substr(uri, 0, hp->s.path_len);
+
+    rb_hash_aset(hp->env, g_request_path, path);
+    rb_hash_aset(hp->env, g_path_info, path);
+    if (decode_path)
+      set_path_decoded(hp->env, ptr, hp->s.path_len);
+  }
+
+  if (hp->start.query) {
+    long off = hp->start.query - hp->mark;
+
+    rb_hash_aset(hp->env, g_query_string,
+                 rb_str_substr(uri, off, (long)len - off));
+  }
+}
+
 static void
 http_version(struct http_parser *hp, const char *ptr, size_t len)
 {
@@ -175,7 +282,30 @@ static inline void hp_invalid_if_trailer(struct http_parser *hp)
     parser_raise(eHttpParserError, "invalid Trailer");
 }
 
-static void write_cont_value(struct http_parser *hp,
+/*
+ * Replaces a frozen (cached) or not yet materialized (lazy) env value
+ * with a String we may append to, for duplicate and continuation lines.
+ */
+static VALUE own_value(struct http_parser *hp, const char *buffer,
+                       VALUE key, VALUE v)
+{
+  if (FIXNUM_P(v)) {
+    VALUE head = rb_ivar_get(hp->env, id_head);
+
+    /* the head is only kept once it's fully parsed */
+    if (NIL_P(head))
+      v = rb_str_new(buffer + LAZY_POS_OFF(v), LAZY_POS_LEN(v));
+    else
+      v = rb_str_substr(head, LAZY_POS_OFF(v), LAZY_POS_LEN(v));
+  } else {
+    v = rb_str_dup(v);
+  }
+  rb_hash_aset(hp->env, key, v);
+
+  return v;
+}
+
+static void write_cont_value(VALUE self, struct http_parser *hp,
                              char *buffer, const char *p)
 {
   char *vptr;
@@ -194,6 +324,13 @@ static void write_cont_value(struct http_parser *hp,
   if (len == 0)
     return;
 
+  if (HP_FL_TEST(hp, FROZENCONT)) {
+    VALUE v = own_value(hp, buffer, hp->cont, rb_hash_aref(hp->env, hp->cont));
+
+    RB_OBJ_WRITE(self, &hp->cont, v);
+    HP_FL_UNSET(hp, FROZENCONT);
+  }
+
   cont_len = RSTRING_LEN(hp->cont);
   if (cont_len > 0) {
     --hp->mark;
@@ -227,12 +364,14 @@ static int is_chunked(VALUE v)
 static void write_value(VALUE self, struct http_parser *hp,
                         const char *buffer, const char *p)
 {
-  VALUE f = find_common_field(PTR_TO(start.field), hp->s.field_len);
+  VALUE **values;
+  VALUE f = find_field(PTR_TO(start.field), hp->s.field_len, &values);
   VALUE v;
   VALUE e;
+  int lazy = !HP_FL_TEST(hp, INTRAILER) && is_lazy_env(hp->env);
 
+  HP_FL_UNSET(hp, FROZENCONT);
   VALIDATE_MAX_LENGTH(LEN(mark, p), FIELD_VALUE);
-  v = LEN(mark, p) == 0 ? rb_str_buf_new(128) : STRIPPED_STR_NEW(mark, p);
   if (NIL_P(f)) {
     const char *field = PTR_TO(start.field);
     size_t flen = hp->s.field_len;
@@ -247,8 +386,37 @@ static void write_value(VALUE self, struct http_parser *hp,
       RB_OBJ_WRITE(self, &hp->cont, Qnil);
       return;
     }
+    /* read by set_url_scheme */
+    if (CONST_MEM_EQ("X_FORWARDED_SSL", field, flen))
+      lazy = 0;
     f = uncommon_field(field, flen);
-  } else if (f == g_http_connection) {
+  } else if (f == g_http_connection || f == g_content_length ||
+             f == g_http_transfer_encoding || f == g_http_trailer ||
+             f == g_http_host || f == g_http_x_forwarded_proto) {
+    /* we need these values ourselves */
+    lazy = 0;
+  } else {
+    assert(TYPE(f) == T_STRING && "memoized object is not a string");
+    assert_frozen(f);
+  }
+
+  if (LEN(mark, p) == 0) {
+    v = rb_str_buf_new(128);
+  } else {
+    long len = stripped_len(PTR_TO(mark), LEN(mark, p));
+
+    v = cached_field_value(values, PTR_TO(mark), len);
+    if (!NIL_P(v)) {
+      /* nothing to allocate */
+    } else if (lazy) {
+      v = LAZY_POS(hp->mark, len);
+      HP_FL_SET(hp, LAZYHEAD);
+    } else {
+      v = rb_str_new(PTR_TO(mark), len);
+    }
+  }
+
+  if (f == g_http_connection) {
     hp_keepalive_connection(hp, v);
   } else if (f == g_content_length && !HP_FL_TEST(hp, CHUNKED)) {
     if (hp->len.content)
@@ -289,14 +457,18 @@ static void write_value(VALUE self, struct http_parser *hp,
   } else if (f == g_http_trailer) {
     HP_FL_SET(hp, HASTRAILER);
     hp_invalid_if_trailer(hp);
-  } else {
-    assert(TYPE(f) == T_STRING && "memoized object is not a string");
-    assert_frozen(f);
   }
 
   e = rb_hash_aref(hp->env, f);
   if (NIL_P(e)) {
-    RB_OBJ_WRITE(self, &hp->cont, rb_hash_aset(hp->env, f, v));
+    rb_hash_aset(hp->env, f, v);
+    if (FIXNUM_P(v) || OBJ_FROZEN(v)) {
+      /* remember the key in case a continuation line needs a copy */
+      RB_OBJ_WRITE(self, &hp->cont, f);
+      HP_FL_SET(hp, FROZENCONT);
+    } else {
+      RB_OBJ_WRITE(self, &hp->cont, v);
+    }
   } else if (f == g_http_host) {
     /*
      * ignored, absolute URLs in REQUEST_URI take precedence over
@@ -304,8 +476,14 @@ static void write_value(VALUE self, struct http_parser *hp,
      */
     RB_OBJ_WRITE(self, &hp->cont, Qnil);
   } else {
+    if (FIXNUM_P(e) || OBJ_FROZEN(e))
+      e = own_value(hp, buffer, f, e);
     rb_str_buf_cat(e, ",", 1);
-    RB_OBJ_WRITE(self, &hp->cont, rb_str_buf_append(e, v));
+    if (FIXNUM_P(v))
+      rb_str_buf_cat(e, buffer + LAZY_POS_OFF(v), LAZY_POS_LEN(v));
+    else
+      rb_str_buf_append(e, v);
+    RB_OBJ_WRITE(self, &hp->cont, e);
   }
 }
 
@@ -316,32 +494,28 @@ static void write_value(VALUE self, struct http_parser *hp,
 
   action mark {MARK(mark, fpc); }
 
-  action start_field { MARK(start.field, fpc); }
+  action start_field {
+    MARK(start.field, fpc);
+    p = skip_field(fpc, pe);
+  }
   action snake_upcase_field { snake_upcase_char(deconst(fpc)); }
   action downcase_char { downcase_char(deconst(fpc)); }
   action write_field { hp->s.field_len = LEN(start.field, fpc); }
-  action start_value { MARK(mark, fpc); }
+  action start_value {
+    MARK(mark, fpc);
+    if (!is_lws(fc))
+      p = skip_content(fpc, pe);
+  }
   action write_value { write_value(self, hp, buffer, fpc); }
-  action write_cont_value { write_cont_value(hp, buffer, fpc); }
+  action write_cont_value { write_cont_value(self, hp, buffer, fpc); }
   action request_method { request_method(hp, PTR_TO(mark), LEN(mark, fpc)); }
   action scheme {
     rb_hash_aset(hp->env, g_rack_url_scheme, STR_NEW(mark, fpc));
   }
   action host { rb_hash_aset(hp->env, g_http_host, STR_NEW(mark, fpc)); }
   action request_uri {
-    VALUE str;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, fpc), REQUEST_URI);
-    str = rb_hash_aset(hp->env, g_request_uri, STR_NEW(mark, fpc));
-    /*
-     * "OPTIONS * HTTP/1.1\r\n" is a valid request, but we can't have '*'
-     * in REQUEST_PATH or PATH_INFO or else Rack::Lint will complain
-     */
-    if (STR_CSTR_EQ(str, "*")) {
-      str = rb_str_new(NULL, 0);
-      rb_hash_aset(hp->env, g_path_info, str);
-      rb_hash_aset(hp->env, g_request_path, str);
-    }
+    request_uri(hp, PTR_TO(mark), LEN(mark, fpc));
   }
   action fragment {
     VALIDATE_MAX_URI_LENGTH(LEN(mark, fpc), FRAGMENT);
@@ -350,18 +524,11 @@ static void write_value(VALUE self, struct http_parser *hp,
   action start_query {MARK(start.query, fpc); }
   action query_string {
     VALIDATE_MAX_URI_LENGTH(LEN(start.query, fpc), QUERY_STRING);
-    rb_hash_aset(hp->env, g_query_string, STR_NEW(start.query, fpc));
   }
   action http_version { http_version(hp, PTR_TO(mark), LEN(mark, fpc)); }
   action request_path {
-    VALUE val;
-
     VALIDATE_MAX_URI_LENGTH(LEN(mark, fpc), REQUEST_PATH);
-    val = rb_hash_aset(hp->env, g_request_path, STR_NEW(mark, fpc));
-
-    /* rack says PATH_INFO must start with "/" or be empty */
-    if (!STR_CSTR_EQ(val, "*"))
-      rb_hash_aset(hp->env, g_path_info, val);
+    hp->s.path_len = LEN(mark, fpc);
   }
   action add_to_chunk_size {
     hp->len.chunk = step_incr(hp->len.chunk, fc, 16);
@@ -369,17 +536,7 @@ static void write_value(VALUE self, struct http_parser *hp,
       parser_raise(eHttpParserError, "invalid chunk size");
   }
   action header_done {
-    finalize_header(hp);
-
-    cs = http_parser_first_final;
-    if (HP_FL_TEST(hp, HASBODY)) {
-      HP_FL_SET(hp, INBODY);
-      if (HP_FL_TEST(hp, CHUNKED))
-        cs = http_parser_en_ChunkedBody;
-    } else {
-      HP_FL_SET(hp, REQEOF);
-      assert(!HP_FL_TEST(hp, CHUNKED) && "chunked encoding without body!");
-    }
+    cs = header_done(hp);
     /*
      * go back to Ruby so we can call the Rack application, we'll reenter
      * the parser iff the body needs to be processed.
@@ -423,10 +580,30 @@ static void write_value(VALUE self, struct http_parser *hp,
 /** Data **/
 %% write data;
 
+/* returns the state to continue in once the whole head is parsed */
+static int header_done(struct http_parser *hp)
+{
+  finalize_header(hp);
+
+  if (HP_FL_TEST(hp, HASBODY)) {
+    HP_FL_SET(hp, INBODY);
+    if (HP_FL_TEST(hp, CHUNKED))
+      return http_parser_en_ChunkedBody;
+  } else {
+    HP_FL_SET(hp, REQEOF);
+    assert(!HP_FL_TEST(hp, CHUNKED) && "chunked encoding without body!");
+    if (nr_static_routes && HP_FL_TEST(hp, HASHEADER))
+      hp->flags |= static_route_match(
+          rb_hash_aref(hp->env, g_request_method),
+          rb_hash_aref(hp->env, g_request_path)) << UH_FL_ROUTE_SHIFT;
+  }
+  return http_parser_first_final;
+}
+
 static void http_parser_init(struct http_parser *hp)
 {
   int cs = 0;
-  hp->flags = 0;
+  hp->flags &= UH_FL_TRUSTED; /* a property of the connection */
   hp->mark = 0;
   hp->offset = 0;
   hp->start.field = 0;
@@ -470,6 +647,120 @@ post_exec: /* "_out:" also goes here */
   assert(hp->offset <= len && "offset longer than length");
 }
 
+/*
+ * Heads from a trusted upstream (e.g. a proxy which already validated
+ * and normalized them) only get split on spaces, line ends and colons
+ * here, which is cheaper than running them through the state machine.
+ * Anything we don't expect from such a proxy (absolute URIs, HTTP/0.9,
+ * continuation lines...) is still left to http_parser_execute.
+ */
+static int trusted_line(const char *p, const char *pe, const char **eol)
+{
+  const char *lf = memchr(p, '\n', pe - p);
+
+  if (!lf)
+    return 0;
+  *eol = lf > p && lf[-1] == '\r' ? lf - 1 : lf;
+  return 1;
+}
+
+/*
+ * returns 1 and sets +blank+ to the empty line ending the head if it's
+ * complete, 0 if more needs to be read, or -1 if the head needs the
+ * strict parser
+ */
+static int trusted_scan(const char *buffer, size_t len, const char **blank)
+{
+  const char *p = buffer, *pe = buffer + len, *eol, *sp;
+
+  if (!trusted_line(p, pe, &eol))
+    return 0;
+  sp = memchr(p, ' ', eol - p);
+  if (!sp || sp == p || !(sp[1] == '/' || (sp[1] == '*' && sp[2] == ' ')) ||
+      !memchr(sp + 1, ' ', eol - sp - 1))
+    return -1;
+
+  for (p = *eol == '\r' ? eol + 2 : eol + 1; p < pe; p = eol + 1) {
+    if (!trusted_line(p, pe, &eol))
+      return 0;
+    if (eol == p) {
+      *blank = p;
+      return 1;
+    }
+    if (is_lws(*p) || *p == ':' || !memchr(p, ':', eol - p))
+      return -1;
+    if (*eol == '\r')
+      eol++;
+  }
+  return 0;
+}
+
+static void
+trusted_execute(VALUE self, struct http_parser *hp, char *buffer, size_t len)
+{
+  const char *blank;
+  char *p, *eol, *sp, *uri, *q;
+
+  switch (trusted_scan(buffer, len, &blank)) {
+  case -1:
+    http_parser_execute(self, hp, buffer, len);
+    return;
+  case 0:
+    if (len > MAX_HEADER_LEN)
+      parser_raise(e413, "HTTP header is too large");
+    return;
+  }
+
+  /* request line */
+  eol = memchr(buffer, '\n', len);
+  if (eol[-1] == '\r')
+    eol--;
+  sp = memchr(buffer, ' ', eol - buffer);
+  request_method(hp, buffer, sp - buffer);
+
+  uri = sp + 1;
+  sp = memchr(uri, ' ', eol - uri);
+  q = memchr(uri, '#', sp - uri);
+  if (q) {
+    VALIDATE_MAX_URI_LENGTH((size_t)(sp - q - 1), FRAGMENT);
+    rb_hash_aset(hp->env, g_fragment, rb_str_new(q + 1, sp - q - 1));
+  } else {
+    q = sp;
+  }
+  MARK(mark, uri);
+  p = memchr(uri, '?', q - uri);
+  if (p) {
+    MARK(start.query, p + 1);
+    VALIDATE_MAX_URI_LENGTH((size_t)(q - p - 1), QUERY_STRING);
+  } else {
+    p = q;
+  }
+  if (*uri == '/') {
+    VALIDATE_MAX_URI_LENGTH((size_t)(p - uri), REQUEST_PATH);
+    hp->s.path_len = ulong2uint(p - uri);
+  }
+  VALIDATE_MAX_URI_LENGTH((size_t)(q - uri), REQUEST_URI);
+  request_uri(hp, uri, q - uri);
+  http_version(hp, sp + 1, eol - sp - 1);
+
+  /* header lines, trusted_scan made sure each one has a colon */
+  for (p = *eol == '\r' ? eol + 2 : eol + 1; p < blank; p = eol + 1) {
+    char *colon = memchr(p, ':', blank - p);
+
+    eol = memchr(colon, '\n', blank - colon);
+    MARK(start.field, p);
+    hp->s.field_len = ulong2uint(colon - p);
+    for (; p < colon; p++)
+      snake_upcase_char(p);
+    for (p = colon + 1; p < eol && is_lws(*p); p++);
+    MARK(mark, p);
+    write_value(self, hp, buffer, eol[-1] == '\r' ? eol - 1 : eol);
+  }
+
+  hp->cs = header_done(hp);
+  hp->offset = ulong2uint((*blank == '\r' ? blank + 1 : blank) - buffer);
+}
+
 static void hp_mark(void *ptr)
 {
   struct http_parser *hp = ptr;
@@ -623,7 +914,7 @@ static VALUE HttpParser_init(VALUE self)
 
   http_parser_init(hp);
   RB_OBJ_WRITE(self, &hp->buf, rb_str_new(NULL, 0));
-  RB_OBJ_WRITE(self, &hp->env, rb_hash_new());
+  RB_OBJ_WRITE(self, &hp->env, new_env());
 
   return self;
 }
@@ -644,7 +935,13 @@ static VALUE HttpParser_clear(VALUE self)
     return HttpParser_init(self);
 
   http_parser_init(hp);
-  rb_hash_clear(hp->env);
+  if (is_lazy_env(hp->env) != lazy_env) {
+    RB_OBJ_WRITE(self, &hp->env, new_env());
+  } else {
+    env_template_reset(hp->env);
+    if (lazy_env)
+      rb_ivar_set(hp->env, id_head, Qnil);
+  }
 
   return self;
 }
@@ -704,12 +1001,30 @@ static VALUE HttpParser_parse(VALUE self)
   if (HP_FL_TEST(hp, TO_CLEAR))
     HttpParser_clear(self);
 
-  http_parser_execute(self, hp, RSTRING_PTR(data), RSTRING_LEN(data));
+  if (HP_FL_TEST(hp, TRUSTED) && hp->cs == http_parser_start)
+    trusted_execute(self, hp, RSTRING_PTR(data), RSTRING_LEN(data));
+  else
+    http_parser_execute(self, hp, RSTRING_PTR(data), RSTRING_LEN(data));
   if (hp->offset > MAX_HEADER_LEN)
     parser_raise(e413, "HTTP header is too large");
 
   if (hp->cs == http_parser_first_final ||
       hp->cs == http_parser_en_ChunkedBody) {
+    if (!HP_FL_TEST(hp, INTRAILER)) {
+      env_template_sample(RHASH_SIZE(hp->env));
+      if (parse_cookies)
+        set_cookies(hp->env, RSTRING_PTR(data));
+      if (query_params)
+        store_query_params(hp->env);
+      if (request_context)
+        set_request_context(hp->env, RSTRING_PTR(data));
+    }
+    if (HP_FL_TEST(hp, LAZYHEAD)) {
+      VALUE head = rb_str_new(RSTRING_PTR(data), hp->offset + 1);
+
+      rb_ivar_set(hp->env, id_head, rb_obj_freeze(head));
+      HP_FL_UNSET(hp, LAZYHEAD);
+    }
     advance_str(data, hp->offset + 1);
     hp->offset = 0;
     if (HP_FL_TEST(hp, INTRAILER))
@@ -788,6 +1103,43 @@ static VALUE HttpParser_body_eof(VALUE self)
   return hp->len.content == 0 ? Qtrue : Qfalse;
 }
 
+/**
+ * call-seq:
+ *    parser.read_head(socket) => env
+ *
+ * Reads from +socket+ until the request head is parsed, without holding
+ * the GVL while waiting for data.  Raises EOFError if the client closed
+ * the connection, and Pitchfork::RequestTimeoutError if it took longer
+ * than Pitchfork::HttpParser.header_read_timeout.
+ */
+static VALUE HttpParser_read_head(VALUE self, VALUE io)
+{
+  struct http_parser *hp = data_get(self);
+  long deadline = read_head_deadline();
+  VALUE env;
+
+  if (RSTRING_LEN(hp->buf) == 0)
+    read_head(hp->buf, io, deadline);
+  while (NIL_P(env = HttpParser_parse(self)))
+    read_head(hp->buf, io, deadline);
+
+  return env;
+}
+
+/**
+ * call-seq:
+ *    parser.static_response => response or nil
+ *
+ * Returns the response registered with Pitchfork::HttpParser.static_routes
+ * for the parsed request, if any.
+ */
+static VALUE HttpParser_static_response(VALUE self)
+{
+  struct http_parser *hp = data_get(self);
+
+  return static_route_response(hp->flags >> UH_FL_ROUTE_SHIFT);
+}
+
 /**
  * call-seq:
  *    parser.keepalive? => true or false
@@ -806,6 +1158,33 @@ static VALUE HttpParser_keepalive(VALUE self)
   return HP_FL_ALL(hp, KEEPALIVE) ? Qtrue : Qfalse;
 }
 
+/**
+ * call-seq:
+ *    parser.trusted_upstream = true or false
+ *
+ * Marks requests read by this parser (including those after #clear) as
+ * coming from a trusted upstream, whose heads only get the minimal
+ * splitting needed to build the env instead of being fully validated.
+ */
+static VALUE HttpParser_set_trusted_upstream(VALUE self, VALUE val)
+{
+  struct http_parser *hp = data_get(self);
+
+  if (RTEST(val))
+    HP_FL_SET(hp, TRUSTED);
+  else
+    HP_FL_UNSET(hp, TRUSTED);
+
+  return val;
+}
+
+static VALUE HttpParser_trusted_upstream(VALUE self)
+{
+  struct http_parser *hp = data_get(self);
+
+  return HP_FL_TEST(hp, TRUSTED) ? Qtrue : Qfalse;
+}
+
 /**
  * call-seq:
  *    parser.next? => true or false
@@ -844,6 +1223,79 @@ static VALUE HttpParser_buf(VALUE self)
   return data_get(self)->buf;
 }
 
+/**
+ * call-seq:
+ *    parser.write_response(io, status, headers, body, keepalive) => true, false or nil
+ *
+ * Writes a Rack response to +io+, with our own Date and Connection
+ * headers, gathering the head and body chunks into as few writes as
+ * possible.  Returns whether the connection may be reused, which
+ * requires +keepalive+ and a response the client can find the end of.
+ * If the headers have a rack.hijack callable, it is called with +io+
+ * once the head is written instead of writing +body+, and nil is
+ * returned.  +headers+ is nil for HTTP/0.9 responses.
+ */
+static VALUE HttpParser_write_response(VALUE self, VALUE io, VALUE status,
+                                       VALUE headers, VALUE body,
+                                       VALUE keepalive)
+{
+  struct http_parser *hp = data_get(self);
+  int ka = RTEST(keepalive);
+  VALUE hijack = response_write(io, status, headers, body, &ka,
+                                HP_FL_TEST(hp, RESSTART));
+
+  if (NIL_P(hijack))
+    return ka ? Qtrue : Qfalse;
+
+  HP_FL_SET(hp, HIJACK);
+  rb_funcall(hijack, rb_intern("call"), 1, io);
+  return Qnil;
+}
+
+/**
+ * call-seq:
+ *    parser.write_static_response(io, keepalive) => true or false
+ *
+ * Writes the Pitchfork::HttpServer#static_routes response matched by the
+ * request to +io+, its Date and Connection headers are the only parts
+ * not rendered ahead of time.  Returns whether to keep the connection
+ * alive, which is +keepalive+.
+ */
+static VALUE
+HttpParser_write_static_response(VALUE self, VALUE io, VALUE keepalive)
+{
+  struct http_parser *hp = data_get(self);
+  VALUE res = static_route_response(hp->flags >> UH_FL_ROUTE_SHIFT);
+  VALUE m = rb_hash_aref(hp->env, g_request_method);
+  VALUE head, body;
+
+  Check_Type(res, T_ARRAY);
+  head = rb_ary_entry(res, 0);
+  body = rb_ary_entry(res, 1);
+  StringValue(head);
+  StringValue(body);
+  if (RB_TYPE_P(m, T_STRING) && RSTRING_LEN(m) == 4 &&
+      !memcmp(RSTRING_PTR(m), "HEAD", 4))
+    body = Qnil;
+  static_response_write(io, head, body, RTEST(keepalive),
+                        HP_FL_TEST(hp, RESSTART));
+  return RTEST(keepalive) ? Qtrue : Qfalse;
+}
+
+/**
+ * call-seq:
+ *    parser.remote_addr!(peer) => String
+ *
+ * Sets REMOTE_ADDR in the env from +peer+, a client socket or the
+ * address of the client as a String, taking the X-Forwarded-For and
+ * X-Real-IP headers sent by Pitchfork::HttpParser.trusted_proxies into
+ * account.  Must be called once the request head is parsed.
+ */
+static VALUE HttpParser_remote_addr_bang(VALUE self, VALUE peer)
+{
+  return set_remote_addr(data_get(self)->env, peer);
+}
+
 static VALUE HttpParser_env(VALUE self)
 {
   return data_get(self)->env;
@@ -972,6 +1424,8 @@ void Init_pitchfork_http(void)
                                eHttpParserError);
   e414 = rb_define_class_under(mPitchfork, "RequestURITooLongError",
                                eHttpParserError);
+  e408 = rb_define_class_under(mPitchfork, "RequestTimeoutError",
+                               eHttpParserError);
 
   id_uminus = rb_intern("-@");
   init_globals();
@@ -980,16 +1434,27 @@ void Init_pitchfork_http(void)
   rb_define_method(cHttpParser, "clear", HttpParser_clear, 0);
   rb_define_method(cHttpParser, "parse", HttpParser_parse, 0);
   rb_define_method(cHttpParser, "add_parse", HttpParser_add_parse, 1);
+  rb_define_method(cHttpParser, "read_head", HttpParser_read_head, 1);
   rb_define_method(cHttpParser, "headers", HttpParser_headers, 2);
   rb_define_method(cHttpParser, "trailers", HttpParser_headers, 2);
   rb_define_method(cHttpParser, "filter_body", HttpParser_filter_body, 2);
   rb_define_method(cHttpParser, "content_length", HttpParser_content_length, 0);
   rb_define_method(cHttpParser, "body_eof?", HttpParser_body_eof, 0);
   rb_define_method(cHttpParser, "keepalive?", HttpParser_keepalive, 0);
+  rb_define_method(cHttpParser, "static_response", HttpParser_static_response, 0);
+  rb_define_method(cHttpParser, "trusted_upstream=",
+                   HttpParser_set_trusted_upstream, 1);
+  rb_define_method(cHttpParser, "trusted_upstream?",
+                   HttpParser_trusted_upstream, 0);
   rb_define_method(cHttpParser, "headers?", HttpParser_has_headers, 0);
   rb_define_method(cHttpParser, "next?", HttpParser_next, 0);
   rb_define_method(cHttpParser, "buf", HttpParser_buf, 0);
   rb_define_method(cHttpParser, "env", HttpParser_env, 0);
+  rb_define_method(cHttpParser, "remote_addr!", HttpParser_remote_addr_bang, 1);
+  rb_define_method(cHttpParser, "write_response",
+                   HttpParser_write_response, 5);
+  rb_define_method(cHttpParser, "write_static_response",
+                   HttpParser_write_static_response, 2);
   rb_define_method(cHttpParser, "hijacked!", HttpParser_hijacked_bang, 0);
   rb_define_method(cHttpParser, "response_start_sent=", HttpParser_rssset, 1);
   rb_define_method(cHttpParser, "response_start_sent", HttpParser_rssget, 0);
@@ -1010,13 +1475,36 @@ void Init_pitchfork_http(void)
   rb_define_const(cHttpParser, "LENGTH_MAX", OFFT2NUM(UH_OFF_T_MAX));
 
   rb_define_singleton_method(cHttpParser, "max_header_len=", set_maxhdrlen, 1);
+  rb_define_singleton_method(cHttpParser, "intern_headers", intern_headers, 1);
+  rb_define_singleton_method(cHttpParser, "header_value_cache_size=",
+                             set_header_value_cache_size, 1);
+  rb_define_singleton_method(cHttpParser, "header_value_cache_size",
+                             get_header_value_cache_size, 0);
+  rb_define_singleton_method(cHttpParser, "header_value_cache_stats",
+                             header_value_cache_stats, 0);
 
   init_common_fields();
+  init_http_scan(cHttpParser);
+  init_env_template(cHttpParser);
+  init_lazy_env(cHttpParser);
+  init_static_route(cHttpParser);
+  init_read_head(cHttpParser);
+  init_cookies(cHttpParser);
+  init_query(cHttpParser);
+  init_multipart(mPitchfork);
+  init_path(cHttpParser);
+  init_remote_addr(cHttpParser);
+  init_request_id(cHttpParser);
+  init_zerocopy(cHttpParser);
+  init_response(cHttpParser);
   SET_GLOBAL(g_http_host, "HOST");
   SET_GLOBAL(g_http_trailer, "TRAILER");
   SET_GLOBAL(g_http_transfer_encoding, "TRANSFER_ENCODING");
   SET_GLOBAL(g_content_length, "CONTENT_LENGTH");
   SET_GLOBAL(g_http_connection, "CONNECTION");
+  SET_GLOBAL(g_http_cookie, "COOKIE");
+  SET_GLOBAL(g_http_x_forwarded_for, "X_FORWARDED_FOR");
+  SET_GLOBAL(g_http_x_real_ip, "X_REAL_IP");
   id_set_backtrace = rb_intern("set_backtrace");
   init_pitchfork_httpdate();
 
@@ -0,0 +1,299 @@
+#ifndef query_h
+#define query_h
+
+#include "ruby.h"
+#include "ruby/encoding.h"
+#include <string.h>
+#include "c_util.h"
+#include "env_template.h"
+
+/*
+ * A C version of Rack::QueryParser#parse_nested_query (Rack 3.1), for
+ * query strings and application/x-www-form-urlencoded bodies:
+ * "a[b][]=1&a[b][]=2" => { "a" => { "b" => [ "1", "2" ] } }
+ *
+ * Errors are reported with the same exception classes as Rack, see
+ * pitchfork/http_parser.rb.
+ */
+#define QUERY_PARAMS_LIMIT 4096
+#define QUERY_DEPTH_LIMIT 32
+#define QUERY_BYTESIZE_LIMIT (4 * 1024 * 1024)
+
+static int query_params; /* disabled by default */
+static VALUE g_query_params;
+static VALUE query_owner; /* Pitchfork::HttpParser */
+static ID id_invalid_parameter_error, id_parameter_type_error,
+          id_params_too_deep_error, id_query_limit_error;
+
+static VALUE query_error(ID name)
+{
+  return rb_const_get(query_owner, name);
+}
+
+static VALUE query_unescape(const char *ptr, long len)
+{
+  VALUE str = rb_utf8_str_new(NULL, len);
+  long n = www_form_decode(RSTRING_PTR(str), ptr, len);
+
+  if (n < 0)
+    rb_raise(query_error(id_invalid_parameter_error),
+             "invalid %%-encoding (%.*s)", (int)len, ptr);
+  rb_str_set_len(str, n);
+  return str;
+}
+
+static VALUE query_key(const char *ptr, long len)
+{
+  return rb_utf8_str_new(ptr, len);
+}
+
+/* Rack's params_hash_has_key? */
+static int query_has_key(VALUE hash, const char *key, long len)
+{
+  const char *p, *pe = key + len;
+
+  for (p = key; p + 1 < pe; p++) {
+    if (p[0] == '[' && p[1] == ']')
+      return 0;
+  }
+
+  for (p = key; p < pe;) {
+    const char *part;
+    VALUE v;
+
+    for (; p < pe && (*p == '[' || *p == ']'); p++);
+    for (part = p; p < pe && *p != '[' && *p != ']'; p++);
+    if (p == part)
+      continue;
+    if (!RB_TYPE_P(hash, T_HASH))
+      return 0;
+    v = rb_hash_lookup2(hash, query_key(part, p - part), Qundef);
+    if (v == Qundef)
+      return 0;
+    hash = v;
+  }
+  return 1;
+}
+
+static VALUE query_container(VALUE params, VALUE key, int type)
+{
+  VALUE v = rb_hash_aref(params, key);
+
+  if (NIL_P(v)) {
+    v = type == T_ARRAY ? rb_ary_new() : rb_hash_new();
+    rb_hash_aset(params, key, v);
+  } else if (!RB_TYPE_P(v, type)) {
+    rb_raise(query_error(id_parameter_type_error),
+             "expected %s (got %"PRIsVALUE") for param `%"PRIsVALUE"'",
+             type == T_ARRAY ? "Array" : "Hash", rb_obj_class(v), key);
+  }
+  return v;
+}
+
+/* Rack's _normalize_params, +len+ is negative for a nil +name+ */
+static VALUE
+query_normalize(VALUE params, const char *name, long len, VALUE v, int depth)
+{
+  const char *k = name, *after, *pe = name + len;
+  const char *start;
+  long klen = len, alen;
+  VALUE key;
+
+  if (depth >= QUERY_DEPTH_LIMIT)
+    rb_exc_raise(rb_class_new_instance(0, NULL,
+                                       query_error(id_params_too_deep_error)));
+
+  if (len < 0) {
+    klen = alen = 0;
+    after = name;
+  } else if (depth == 0) {
+    start = len > 1 ? memchr(name + 1, '[', len - 1) : NULL;
+    if (start)
+      klen = start - name;
+    after = name + klen;
+  } else if (len >= 2 && name[0] == '[' && name[1] == ']') {
+    klen = 2;
+    after = name + 2;
+  } else if (len >= 2 && name[0] == '[' &&
+             (start = memchr(name + 1, ']', len - 1))) {
+    k = name + 1;
+    klen = start - k;
+    after = start + 1;
+  } else {
+    after = pe;
+  }
+  if (len >= 0)
+    alen = pe - after;
+
+  if (klen == 0)
+    return Qnil;
+
+  key = query_key(k, klen);
+  if (alen == 0) {
+    if (depth != 0 && klen == 2 && k[0] == '[' && k[1] == ']')
+      return rb_ary_new_from_args(1, v);
+    rb_hash_aset(params, key, v);
+  } else if (alen == 1 && after[0] == '[') {
+    rb_hash_aset(params, query_key(name, len), v);
+  } else if (alen == 2 && after[0] == '[' && after[1] == ']') {
+    rb_ary_push(query_container(params, key, T_ARRAY), v);
+  } else if (alen > 2 && after[0] == '[' && after[1] == ']') {
+    /* recognize x[][y] (hash inside array) parameters */
+    const char *child = after + 3;
+    long clen = alen - 4;
+    VALUE ary, last;
+
+    if (!(alen >= 4 && after[2] == '[' && after[alen - 1] == ']' && clen > 0 &&
+          !memchr(child, '[', clen) && !memchr(child, ']', clen))) {
+      child = after + 2;
+      clen = alen - 2;
+    }
+    ary = query_container(params, key, T_ARRAY);
+    last = RARRAY_LEN(ary) ? rb_ary_entry(ary, -1) : Qnil;
+    if (RB_TYPE_P(last, T_HASH) && !query_has_key(last, child, clen))
+      query_normalize(last, child, clen, v, depth + 1);
+    else
+      rb_ary_push(ary, query_normalize(rb_hash_new(), child, clen, v,
+                                       depth + 1));
+  } else {
+    VALUE hash = query_container(params, key, T_HASH);
+
+    rb_hash_aset(params, key,
+                 query_normalize(hash, after, alen, v, depth + 1));
+  }
+  return params;
+}
+
+static VALUE parse_query_str(VALUE str)
+{
+  const char *p, *pe;
+  long count = 0;
+  VALUE params = rb_hash_new();
+
+  if (RSTRING_LEN(str) > QUERY_BYTESIZE_LIMIT)
+    rb_raise(query_error(id_query_limit_error),
+             "total query size (%ld) exceeds limit (%d)",
+             RSTRING_LEN(str), QUERY_BYTESIZE_LIMIT);
+
+  p = RSTRING_PTR(str);
+  pe = p + RSTRING_LEN(str);
+  for (; (p = memchr(p, '&', pe - p)); p++)
+    count++;
+  if (count >= QUERY_PARAMS_LIMIT)
+    rb_raise(query_error(id_query_limit_error),
+             "total number of query parameters (%ld) exceeds limit (%d)",
+             count + 1, QUERY_PARAMS_LIMIT);
+
+  for (p = RSTRING_PTR(str); p < pe;) {
+    const char *amp = memchr(p, '&', pe - p);
+    const char *end = amp ? amp : pe;
+    const char *eq = memchr(p, '=', end - p);
+    VALUE name = Qnil, v = Qnil;
+
+    if (end > p) {
+      name = query_unescape(p, (eq ? eq : end) - p);
+      if (eq)
+        v = query_unescape(eq + 1, end - eq - 1);
+    }
+    if (NIL_P(name))
+      query_normalize(params, NULL, -1, v, 0);
+    else
+      query_normalize(params, RSTRING_PTR(name), RSTRING_LEN(name), v, 0);
+    RB_GC_GUARD(name);
+
+    if (!amp)
+      break;
+    for (p = amp + 1; p < pe && *p == ' '; p++);
+  }
+  RB_GC_GUARD(str);
+  return params;
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.parse_query(str) => Hash
+ *
+ * Parses a query string or an application/x-www-form-urlencoded body
+ * like Rack::Utils.parse_nested_query.
+ */
+static VALUE parse_query(VALUE self, VALUE str)
+{
+  if (NIL_P(str))
+    return rb_hash_new();
+
+  return parse_query_str(rb_str_new_frozen(StringValue(str)));
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.normalize_param(params, name, value) => params
+ *
+ * Stores +value+ in +params+ under the possibly nested +name+, the way
+ * Pitchfork::HttpParser.parse_query does for each parameter.
+ */
+static VALUE normalize_param(VALUE self, VALUE params, VALUE name, VALUE value)
+{
+  Check_Type(params, T_HASH);
+  StringValue(name);
+  query_normalize(params, RSTRING_PTR(name), RSTRING_LEN(name), value, 0);
+  RB_GC_GUARD(name);
+  return params;
+}
+
+static VALUE query_params_parse(VALUE env)
+{
+  VALUE params = parse_query(query_owner, rb_hash_aref(env, g_query_string));
+
+  rb_hash_aset(env, g_query_params, params);
+  return Qnil;
+}
+
+static VALUE query_params_rescue(VALUE env, VALUE err)
+{
+  return Qnil;
+}
+
+/*
+ * stores the params of a parsed request, malformed query strings are
+ * left for the app to fail on, the way Rack::Request#GET does
+ */
+static void store_query_params(VALUE env)
+{
+  rb_rescue2(query_params_parse, env, query_params_rescue, env,
+             rb_eStandardError, (VALUE)0);
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.query_params = true or false
+ *
+ * Makes requests parsed from now on have their QUERY_STRING parsed
+ * with Pitchfork::HttpParser.parse_query into env["pitchfork.query_params"].
+ */
+static VALUE set_query_params(VALUE self, VALUE enable)
+{
+  query_params = RTEST(enable);
+  return enable;
+}
+
+static VALUE get_query_params(VALUE self)
+{
+  return query_params ? Qtrue : Qfalse;
+}
+
+static void init_query(VALUE klass)
+{
+  query_owner = klass;
+  g_query_params = rb_obj_freeze(rb_str_new_cstr("pitchfork.query_params"));
+  rb_gc_register_mark_object(g_query_params);
+  id_invalid_parameter_error = rb_intern("InvalidParameterError");
+  id_parameter_type_error = rb_intern("ParameterTypeError");
+  id_params_too_deep_error = rb_intern("ParamsTooDeepError");
+  id_query_limit_error = rb_intern("QueryLimitError");
+  rb_define_singleton_method(klass, "parse_query", parse_query, 1);
+  rb_define_singleton_method(klass, "normalize_param", normalize_param, 3);
+  rb_define_singleton_method(klass, "query_params=", set_query_params, 1);
+  rb_define_singleton_method(klass, "query_params", get_query_params, 0);
+}
+
+#endif /* query_h */
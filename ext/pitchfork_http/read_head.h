@@ -0,0 +1,188 @@
+#ifndef read_head_h
+#define read_head_h
+
+#include "ruby.h"
+#include "ruby/io.h"
+#include "ruby/thread.h"
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Reads the request head with the GVL released, so a slow client
+ * trickling its headers doesn't keep the timeout thread and application
+ * threads from running.  We only take the GVL back to parse (and build
+ * Ruby objects) once the head looks complete, or the chunk is full.
+ */
+#define READ_HEAD_CHUNK 16384
+
+/* milliseconds a client gets to send the whole head, 0 for no limit */
+static long header_read_timeout;
+
+struct read_head_args {
+  int fd;
+  int err;
+  char *ptr;
+  long len;
+  long capa;
+  long deadline; /* CLOCK_MONOTONIC milliseconds, 0 for none */
+};
+
+static long monotonic_msec(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* a cheap guess, the parser has the final say */
+static int head_complete(const char *ptr, long len, long from)
+{
+  const char *p, *pe = ptr + len;
+  const char *eol = memchr(ptr, '\n', len);
+
+  if (!eol)
+    return 0;
+
+  /* HTTP/0.9 requests are only a request line */
+  for (p = ptr; p + 5 <= eol && memcmp(p, "HTTP/", 5); p++);
+  if (p + 5 > eol)
+    return 1;
+
+  /* look for an empty line, without rescanning what we already had */
+  p = ptr + (from > 3 ? from - 3 : 0);
+  while ((p = memchr(p, '\n', pe - p)) && ++p < pe) {
+    if (*p == '\n' || (*p == '\r' && p + 1 < pe && p[1] == '\n'))
+      return 1;
+  }
+  return 0;
+}
+
+static void *read_head_nogvl(void *ptr)
+{
+  struct read_head_args *a = ptr;
+
+  for (;;) {
+    long from = a->len;
+    ssize_t r = read(a->fd, a->ptr + a->len, a->capa - a->len);
+
+    if (r > 0) {
+      a->len += r;
+      if (a->len == a->capa || head_complete(a->ptr, a->len, from))
+        return NULL;
+    } else if (r == 0) {
+      return NULL;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      struct pollfd pfd;
+      int timeout = -1, rc;
+
+      if (a->deadline) {
+        long left = a->deadline - monotonic_msec();
+
+        timeout = left > 0 ? (int)left : 0;
+      }
+      pfd.fd = a->fd;
+      pfd.events = POLLIN;
+      rc = poll(&pfd, 1, timeout);
+      if (rc <= 0) {
+        a->err = rc ? errno : ETIMEDOUT;
+        return NULL;
+      }
+    } else {
+      a->err = errno;
+      return NULL;
+    }
+  }
+}
+
+static int io_fd(VALUE io)
+{
+#ifdef HAVE_RB_IO_DESCRIPTOR
+  return rb_io_descriptor(io);
+#else
+  rb_io_t *fptr;
+
+  GetOpenFile(io, fptr);
+  return fptr->fd;
+#endif
+}
+
+/*
+ * appends at least one byte of the request read from +io+ to +buf+,
+ * raises EOFError like IO#readpartial if the client is gone, and
+ * Pitchfork::RequestTimeoutError once +deadline+ is reached
+ */
+static VALUE read_head(VALUE buf, VALUE io, long deadline)
+{
+  struct read_head_args a;
+  long len = RSTRING_LEN(buf);
+
+  a.fd = io_fd(io);
+  a.deadline = deadline;
+  rb_str_modify_expand(buf, READ_HEAD_CHUNK);
+  for (;;) {
+    a.err = 0;
+    a.len = len;
+    a.capa = len + READ_HEAD_CHUNK;
+    rb_str_locktmp(buf);
+    a.ptr = RSTRING_PTR(buf);
+    rb_thread_call_without_gvl(read_head_nogvl, &a, RUBY_UBF_IO, NULL);
+    rb_str_unlocktmp(buf);
+    rb_str_set_len(buf, a.len);
+
+    /* any error will show up again on the next read */
+    if (a.len > len)
+      return buf;
+    if (a.err == EINTR) {
+      rb_thread_check_ints();
+      continue;
+    }
+    if (a.err == ETIMEDOUT)
+      parser_raise(e408, "request head not received in time");
+    if (a.err)
+      rb_syserr_fail(a.err, "read(2)");
+    rb_eof_error();
+  }
+}
+
+static long read_head_deadline(void)
+{
+  return header_read_timeout ? monotonic_msec() + header_read_timeout : 0;
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.header_read_timeout = seconds
+ *
+ * Limits how long HttpParser#read_head waits for a complete request head,
+ * +0+ disables the limit.  It has a resolution of 1ms, shorter limits
+ * are rounded up to it.
+ */
+static VALUE set_header_read_timeout(VALUE self, VALUE seconds)
+{
+  double msec = NUM2DBL(seconds) * 1000;
+
+  if (!(msec >= 0 && msec <= INT_MAX)) /* NaN, too */
+    rb_raise(rb_eArgError, "header_read_timeout out of range");
+  /* don't let a tiny limit truncate to 0, which disables it */
+  header_read_timeout = msec > 0 && msec < 1 ? 1 : (long)msec;
+  return seconds;
+}
+
+static VALUE get_header_read_timeout(VALUE self)
+{
+  return rb_float_new(header_read_timeout / 1000.0);
+}
+
+static void init_read_head(VALUE klass)
+{
+  rb_define_singleton_method(klass, "header_read_timeout=",
+                             set_header_read_timeout, 1);
+  rb_define_singleton_method(klass, "header_read_timeout",
+                             get_header_read_timeout, 0);
+}
+
+#endif /* read_head_h */
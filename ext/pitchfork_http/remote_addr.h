@@ -0,0 +1,274 @@
+#ifndef remote_addr_h
+#define remote_addr_h
+
+#include "ruby.h"
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "lazy_env.h"
+
+/*
+ * Sets REMOTE_ADDR from getpeername(2), without allocating an Addrinfo.
+ * When the peer is one of the trusted_proxies, X-Forwarded-For is walked
+ * from right to left past the trusted addresses, and the first untrusted
+ * one is the client.  X-Real-IP is used if there is no X-Forwarded-For.
+ *
+ * Addresses are stored in their canonical form as interned Strings, so
+ * clients sending many requests always get the same object.
+ */
+struct ip_addr {
+  int family; /* AF_INET or AF_INET6 */
+  unsigned char bytes[16];
+};
+
+struct trusted_proxy {
+  struct ip_addr net;
+  unsigned int bits;
+};
+
+static struct trusted_proxy *trusted_proxies;
+static long nr_trusted_proxies;
+static VALUE trusted_proxies_ary = Qnil;
+static VALUE g_remote_addr, g_http_x_forwarded_for, g_http_x_real_ip;
+
+/* parses an address from a header, which may be bracketed or have a port */
+static int ip_parse(const char *ptr, long len, struct ip_addr *a)
+{
+  char buf[INET6_ADDRSTRLEN];
+  const char *pe = ptr + len, *colon;
+
+  for (; ptr < pe && (*ptr == ' ' || *ptr == '\t'); ptr++);
+  for (; pe > ptr && (pe[-1] == ' ' || pe[-1] == '\t'); pe--);
+
+  if (ptr < pe && *ptr == '[') { /* [::1]:8080 */
+    const char *end = memchr(ptr, ']', pe - ptr);
+
+    if (!end)
+      return 0;
+    ptr++;
+    pe = end;
+  } else if ((colon = memchr(ptr, ':', pe - ptr)) &&
+             !memchr(colon + 1, ':', pe - colon - 1)) { /* 1.2.3.4:8080 */
+    pe = colon;
+  }
+  if (ptr == pe || pe - ptr >= (long)sizeof(buf))
+    return 0;
+
+  memcpy(buf, ptr, pe - ptr);
+  buf[pe - ptr] = 0;
+  a->family = memchr(ptr, ':', pe - ptr) ? AF_INET6 : AF_INET;
+  return inet_pton(a->family, buf, a->bytes) == 1;
+}
+
+/* IPv4 clients of IPv6 listeners match IPv4 networks */
+static void ip_unmap(const struct ip_addr *a, struct ip_addr *out)
+{
+  if (a->family == AF_INET6 &&
+      IN6_IS_ADDR_V4MAPPED((const struct in6_addr *)a->bytes)) {
+    out->family = AF_INET;
+    memmove(out->bytes, a->bytes + 12, 4);
+  } else {
+    *out = *a;
+  }
+}
+
+static int ip_trusted(const struct ip_addr *addr)
+{
+  struct ip_addr a;
+  long i;
+
+  ip_unmap(addr, &a);
+  for (i = 0; i < nr_trusted_proxies; i++) {
+    const struct trusted_proxy *t = &trusted_proxies[i];
+    unsigned int full = t->bits / 8, rest = t->bits % 8;
+
+    if (t->net.family != a.family || memcmp(t->net.bytes, a.bytes, full))
+      continue;
+    if (rest == 0 ||
+        !((t->net.bytes[full] ^ a.bytes[full]) & (0xff << (8 - rest))))
+      return 1;
+  }
+  return 0;
+}
+
+static VALUE ip_str(const struct ip_addr *a)
+{
+  char buf[INET6_ADDRSTRLEN];
+
+  if (!inet_ntop(a->family, a->bytes, buf, sizeof(buf)))
+    rb_sys_fail("inet_ntop");
+  return str_new_dd_freeze(buf, (long)strlen(buf));
+}
+
+/* UNIX sockets peers are 127.0.0.1, as they always were */
+static void peer_addr(int fd, struct ip_addr *a)
+{
+  union {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+    struct sockaddr_storage ss;
+  } u;
+  socklen_t len = sizeof(u);
+
+  if (getpeername(fd, &u.sa, &len) < 0)
+    rb_sys_fail("getpeername(2)");
+
+  if (u.sa.sa_family == AF_INET6) {
+    a->family = AF_INET6;
+    memcpy(a->bytes, &u.in6.sin6_addr, 16);
+  } else if (u.sa.sa_family == AF_INET) {
+    a->family = AF_INET;
+    memcpy(a->bytes, &u.in.sin_addr, 4);
+  } else {
+    a->family = AF_INET;
+    memcpy(a->bytes, "\x7f\0\0\x01", 4);
+  }
+}
+
+static VALUE forwarded_value(VALUE env, VALUE key)
+{
+  VALUE v = rb_hash_aref(env, key);
+
+  if (FIXNUM_P(v)) {
+    v = lazy_env_string(env, key, v);
+    return v == Qundef ? Qnil : v;
+  }
+  return RB_TYPE_P(v, T_STRING) ? v : Qnil;
+}
+
+/* walks X-Forwarded-For from the right, updating +a+ with each hop */
+static void walk_forwarded_for(VALUE xff, struct ip_addr *a)
+{
+  const char *ptr = RSTRING_PTR(xff), *pe = ptr + RSTRING_LEN(xff);
+  struct ip_addr hop;
+
+  while (pe > ptr) {
+    const char *start = pe;
+
+    while (start > ptr && start[-1] != ',')
+      start--;
+    if (!ip_parse(start, pe - start, &hop))
+      break;
+    *a = hop;
+    if (start == ptr || !ip_trusted(a))
+      break;
+    pe = start - 1;
+  }
+  RB_GC_GUARD(xff);
+}
+
+/*
+ * +peer+ is the client socket, or the address of the peer as a String
+ * for IO-like objects which aren't sockets
+ */
+static VALUE set_remote_addr(VALUE env, VALUE peer)
+{
+  struct ip_addr a;
+  VALUE v;
+
+  if (RB_TYPE_P(peer, T_FILE)) {
+    peer_addr(io_fd(peer), &a);
+  } else {
+    StringValue(peer);
+    if (!ip_parse(RSTRING_PTR(peer), RSTRING_LEN(peer), &a)) {
+      rb_hash_aset(env, g_remote_addr, peer);
+      return peer;
+    }
+  }
+
+  if (nr_trusted_proxies && ip_trusted(&a)) {
+    v = forwarded_value(env, g_http_x_forwarded_for);
+    if (!NIL_P(v)) {
+      walk_forwarded_for(v, &a);
+    } else {
+      struct ip_addr real;
+
+      v = forwarded_value(env, g_http_x_real_ip);
+      if (!NIL_P(v) && ip_parse(RSTRING_PTR(v), RSTRING_LEN(v), &real))
+        a = real;
+    }
+  }
+
+  v = ip_str(&a);
+  rb_hash_aset(env, g_remote_addr, v);
+  return v;
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.trusted_proxies = ["10.0.0.0/8", "::1"]
+ *
+ * Sets the addresses or CIDR networks of the proxies whose
+ * X-Forwarded-For and X-Real-IP headers are used for REMOTE_ADDR.
+ */
+static VALUE set_trusted_proxies(VALUE self, VALUE list)
+{
+  struct trusted_proxy *tmp;
+  long i, n;
+
+  list = rb_check_array_type(list);
+  if (NIL_P(list))
+    rb_raise(rb_eTypeError, "trusted_proxies must be an Array");
+  list = rb_ary_dup(list);
+  n = RARRAY_LEN(list);
+  tmp = ALLOC_N(struct trusted_proxy, n ? n : 1);
+
+  for (i = 0; i < n; i++) {
+    VALUE str = rb_ary_entry(list, i);
+    const char *ptr, *slash;
+    long len;
+    unsigned long max;
+
+    if (!RB_TYPE_P(str, T_STRING)) {
+      xfree(tmp);
+      rb_raise(rb_eTypeError, "not a String: %"PRIsVALUE, rb_inspect(str));
+    }
+    ptr = RSTRING_PTR(str);
+    len = RSTRING_LEN(str);
+    slash = memchr(ptr, '/', len);
+    if (!ip_parse(ptr, slash ? slash - ptr : len, &tmp[i].net))
+      goto bad;
+    ip_unmap(&tmp[i].net, &tmp[i].net);
+    max = tmp[i].net.family == AF_INET ? 32 : 128;
+    tmp[i].bits = (unsigned int)max;
+    if (slash) {
+      off_t bits = parse_length(slash + 1, len - (slash + 1 - ptr));
+
+      if (bits < 0 || slash + 1 == ptr + len || (unsigned long)bits > max)
+        goto bad;
+      tmp[i].bits = (unsigned int)bits;
+    }
+    rb_ary_store(list, i, rb_obj_freeze(rb_str_dup(str)));
+    continue;
+bad:
+    xfree(tmp);
+    rb_raise(rb_eArgError, "invalid trusted proxy: %"PRIsVALUE,
+             rb_inspect(str));
+  }
+
+  xfree(trusted_proxies);
+  trusted_proxies = tmp;
+  nr_trusted_proxies = n;
+  trusted_proxies_ary = rb_obj_freeze(list);
+  return list;
+}
+
+static VALUE get_trusted_proxies(VALUE self)
+{
+  return trusted_proxies_ary;
+}
+
+static void init_remote_addr(VALUE klass)
+{
+  rb_gc_register_address(&trusted_proxies_ary);
+  trusted_proxies_ary = rb_obj_freeze(rb_ary_new());
+  g_remote_addr = rb_obj_freeze(rb_str_new_cstr("REMOTE_ADDR"));
+  rb_gc_register_mark_object(g_remote_addr);
+  rb_define_singleton_method(klass, "trusted_proxies=", set_trusted_proxies, 1);
+  rb_define_singleton_method(klass, "trusted_proxies", get_trusted_proxies, 0);
+}
+
+#endif /* remote_addr_h */
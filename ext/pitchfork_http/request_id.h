@@ -0,0 +1,258 @@
+#ifndef request_id_h
+#define request_id_h
+
+#include "ruby.h"
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef HAVE_GETRANDOM
+#  include <sys/random.h>
+#endif
+#include "lazy_env.h"
+
+/*
+ * Optional extraction of the request context once the head is parsed:
+ * a valid W3C traceparent header is split into env["pitchfork.trace_id"],
+ * env["pitchfork.parent_id"] and env["pitchfork.trace_flags"], and
+ * env["pitchfork.request_id"] is X-Request-Id, or a new UUIDv7 if the
+ * header is missing or invalid.  All values are frozen Strings.
+ *
+ * UUIDs come from a xoshiro256** generator seeded from the kernel, which
+ * workers reseed after forking so they never share a sequence.
+ */
+#define REQUEST_ID_MAX 255
+
+static int request_context; /* disabled by default */
+static VALUE g_http_traceparent, g_http_x_request_id;
+static VALUE g_request_id, g_trace_id, g_parent_id, g_trace_flags;
+static uint64_t rid_state[4];
+
+static uint64_t rid_rotl(uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t rid_next(void)
+{
+  uint64_t *s = rid_state;
+  uint64_t result = rid_rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rid_rotl(s[3], 45);
+  return result;
+}
+
+static void rid_seed(void)
+{
+  uint64_t seed[4];
+  ssize_t n = -1;
+  struct timespec ts;
+  int i;
+
+#ifdef HAVE_GETRANDOM
+  n = getrandom(seed, sizeof(seed), GRND_NONBLOCK);
+#endif
+  if (n != (ssize_t)sizeof(seed)) {
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+
+    n = fd < 0 ? -1 : read(fd, seed, sizeof(seed));
+    if (fd >= 0)
+      close(fd);
+  }
+  /* the state must not be all zeros, and should differ between forks */
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  if (n != (ssize_t)sizeof(seed))
+    memset(seed, 0, sizeof(seed));
+  seed[0] ^= (uint64_t)ts.tv_nsec;
+  seed[1] ^= (uint64_t)ts.tv_sec;
+  seed[2] ^= (uint64_t)getpid();
+  seed[3] ^= 0x9e3779b97f4a7c15ULL;
+
+  memcpy(rid_state, seed, sizeof(seed));
+  for (i = 0; i < 8; i++)
+    rid_next();
+}
+
+static const char rid_hex[] = "0123456789abcdef";
+
+/* RFC 9562 UUIDv7: a 48-bit Unix timestamp in ms then 74 random bits */
+static VALUE uuid7_new(void)
+{
+  unsigned char b[16];
+  char buf[36], *p = buf;
+  struct timespec ts;
+  uint64_t ms, r1 = rid_next(), r2 = rid_next();
+  int i;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ms = (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+  for (i = 0; i < 6; i++)
+    b[i] = (unsigned char)(ms >> (40 - 8 * i));
+  b[6] = 0x70 | (unsigned char)((r1 >> 8) & 0x0f);
+  b[7] = (unsigned char)r1;
+  for (i = 8; i < 16; i++)
+    b[i] = (unsigned char)(r2 >> (8 * (i - 8)));
+  b[8] = 0x80 | (b[8] & 0x3f);
+
+  for (i = 0; i < 16; i++) {
+    if (i == 4 || i == 6 || i == 8 || i == 10)
+      *p++ = '-';
+    *p++ = rid_hex[b[i] >> 4];
+    *p++ = rid_hex[b[i] & 0xf];
+  }
+  return rb_obj_freeze(rb_usascii_str_new(buf, sizeof(buf)));
+}
+
+/* +buffer+ holds the request head for lazy_env placeholders */
+static int
+env_value(VALUE env, VALUE key, const char *buffer, const char **ptr, long *len)
+{
+  VALUE v = rb_hash_aref(env, key);
+
+  if (FIXNUM_P(v)) {
+    *ptr = buffer + LAZY_POS_OFF(v);
+    *len = LAZY_POS_LEN(v);
+    return 1;
+  }
+  if (RB_TYPE_P(v, T_STRING)) {
+    *ptr = RSTRING_PTR(v);
+    *len = RSTRING_LEN(v);
+    return 1;
+  }
+  return 0;
+}
+
+static int is_lower_hex(const char *p, long len, int nonzero)
+{
+  int zero = 1;
+
+  for (; len-- > 0; p++) {
+    if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f')))
+      return 0;
+    if (*p != '0')
+      zero = 0;
+  }
+  return !(nonzero && zero);
+}
+
+/* version "-" trace-id "-" parent-id "-" trace-flags */
+static int valid_traceparent(const char *p, long len)
+{
+  if (len < 55 || p[2] != '-' || p[35] != '-' || p[52] != '-')
+    return 0;
+  if (!is_lower_hex(p, 2, 0) || (p[0] == 'f' && p[1] == 'f'))
+    return 0;
+  /* later versions may append fields */
+  if (len > 55 && ((p[0] == '0' && p[1] == '0') || p[55] != '-'))
+    return 0;
+  return is_lower_hex(p + 3, 32, 1) && is_lower_hex(p + 36, 16, 1) &&
+         is_lower_hex(p + 53, 2, 0);
+}
+
+/* the characters ActionDispatch::RequestId keeps */
+static int valid_request_id(const char *p, long len)
+{
+  if (len == 0 || len > REQUEST_ID_MAX)
+    return 0;
+  for (; len-- > 0; p++) {
+    if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z') ||
+          (*p >= 'A' && *p <= 'Z') || *p == '_' || *p == '-' || *p == '@'))
+      return 0;
+  }
+  return 1;
+}
+
+static void set_request_context(VALUE env, const char *buffer)
+{
+  const char *ptr;
+  long len;
+  VALUE id;
+
+  if (env_value(env, g_http_traceparent, buffer, &ptr, &len) &&
+      valid_traceparent(ptr, len)) {
+    rb_hash_aset(env, g_trace_id, rb_obj_freeze(rb_usascii_str_new(ptr + 3, 32)));
+    rb_hash_aset(env, g_parent_id, rb_obj_freeze(rb_usascii_str_new(ptr + 36, 16)));
+    rb_hash_aset(env, g_trace_flags, rb_obj_freeze(rb_usascii_str_new(ptr + 53, 2)));
+  }
+
+  if (env_value(env, g_http_x_request_id, buffer, &ptr, &len) &&
+      valid_request_id(ptr, len))
+    id = rb_obj_freeze(rb_usascii_str_new(ptr, len));
+  else
+    id = uuid7_new();
+  rb_hash_aset(env, g_request_id, id);
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.request_context = true or false
+ *
+ * Makes the parser set env["pitchfork.request_id"] for every request,
+ * and split valid traceparent headers into env["pitchfork.trace_id"],
+ * env["pitchfork.parent_id"] and env["pitchfork.trace_flags"].
+ */
+static VALUE set_request_context_m(VALUE self, VALUE enable)
+{
+  request_context = RTEST(enable);
+  return enable;
+}
+
+static VALUE get_request_context(VALUE self)
+{
+  return request_context ? Qtrue : Qfalse;
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.uuid7 => String
+ *
+ * Returns a new UUIDv7, as used for missing request IDs.
+ */
+static VALUE uuid7(VALUE self)
+{
+  return uuid7_new();
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.reseed_request_ids => nil
+ *
+ * Reseeds the generator of request IDs, which must be done after fork(2).
+ */
+static VALUE reseed_request_ids(VALUE self)
+{
+  rid_seed();
+  return Qnil;
+}
+
+static VALUE request_context_key(const char *name)
+{
+  VALUE key = rb_obj_freeze(rb_str_new_cstr(name));
+
+  rb_gc_register_mark_object(key);
+  return key;
+}
+
+static void init_request_id(VALUE klass)
+{
+  rid_seed();
+  g_http_traceparent = request_context_key("HTTP_TRACEPARENT");
+  g_http_x_request_id = request_context_key("HTTP_X_REQUEST_ID");
+  g_request_id = request_context_key("pitchfork.request_id");
+  g_trace_id = request_context_key("pitchfork.trace_id");
+  g_parent_id = request_context_key("pitchfork.parent_id");
+  g_trace_flags = request_context_key("pitchfork.trace_flags");
+  rb_define_singleton_method(klass, "request_context=", set_request_context_m, 1);
+  rb_define_singleton_method(klass, "request_context", get_request_context, 0);
+  rb_define_singleton_method(klass, "uuid7", uuid7, 0);
+  rb_define_singleton_method(klass, "reseed_request_ids", reseed_request_ids, 0);
+}
+
+#endif /* request_id_h */
@@ -0,0 +1,822 @@
+#ifndef response_h
+#define response_h
+
+#include "ruby.h"
+#include "ruby/io.h"
+#include <string.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#ifdef HAVE_SENDFILE
+#  include <sys/sendfile.h>
+#endif
+#include "c_util.h"
+#include "zerocopy.h"
+
+/*
+ * Writes Rack responses, see HttpParser#write_response.
+ * Status lines of the codes in HttpResponse::STATUS_CODES are rendered
+ * once, and each head is built in a buffer the worker reuses, so writing
+ * it doesn't allocate unless header keys or values aren't Strings.
+ *
+ * The head and body chunks are gathered into writev(2) calls.  Bodies
+ * which are neither Arrays nor of a known Content-Length may be streams
+ * (e.g. server-sent events), so their head is written before the first
+ * chunk is asked for, and their chunks as they come.
+ * Bodies backed by regular files (Files, or responding to to_path) are
+ * sent with sendfile(2), including single ranges from Content-Range.
+ * Pitchfork::Chunked bodies are framed here, each chunk gathered between
+ * its size line and CRLF without being copied.
+ */
+#define RESPONSE_BUF_KEEP (64 * 1024) /* larger buffers aren't kept */
+#define RESPONSE_START "HTTP/1.1 "
+#define RESPONSE_START_LEN (sizeof(RESPONSE_START) - 1)
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#  define GATHER_MAX IOV_MAX
+#else
+#  define GATHER_MAX 1024
+#endif
+#define GATHER_BYTES (256 * 1024) /* copied chunks we hold on to */
+#define SENDFILE_MAX (1L << 30)
+
+VALUE pitchfork_httpdate(void);
+
+#define STATUS_LINES_MAX 600
+static VALUE status_codes; /* HttpResponse::STATUS_CODES */
+static VALUE status_lines; /* [ message, line ] pairs, by status code */
+static VALUE response_buf; /* Qnil while in use */
+static ID id_status_codes, id_write, id_each, id_to_i, id_to_path, id_pos;
+static ID id_chunked_body, id_chunked_tail;
+static int cork_responses; /* disabled by default */
+
+struct response_head {
+  VALUE buf;
+  VALUE hijack;
+  VALUE length; /* Content-Length */
+  VALUE range; /* Content-Range */
+  long code;
+  int keepalive;
+  int framed;
+};
+
+static int field_eq(VALUE key, const char *name, long len)
+{
+  return RSTRING_LEN(key) == len &&
+         !STRNCASECMP(RSTRING_PTR(key), name, (size_t)len);
+}
+#define FIELD_EQ(key, name) field_eq(key, name, sizeof(name) - 1)
+
+static int has_close(VALUE value)
+{
+  const char *p, *pe;
+
+  value = rb_obj_as_string(value);
+  pe = RSTRING_PTR(value) + RSTRING_LEN(value);
+  for (p = RSTRING_PTR(value); pe - p >= 5; p++) {
+    if (!STRNCASECMP(p, "close", 5))
+      return 1;
+  }
+  return 0;
+}
+
+static void
+head_line(VALUE buf, VALUE key, const char *ptr, long len)
+{
+  rb_str_buf_cat(buf, RSTRING_PTR(key), RSTRING_LEN(key));
+  rb_str_buf_cat(buf, ": ", 2);
+  rb_str_buf_cat(buf, ptr, len);
+  rb_str_buf_cat(buf, "\r\n", 2);
+}
+
+/* Rack 2 joins multiple values with "\n", like value.split(/\n+/) */
+static void head_lines(VALUE buf, VALUE key, VALUE value)
+{
+  const char *p = RSTRING_PTR(value), *pe = p + RSTRING_LEN(value);
+  const char *nl = memchr(p, '\n', pe - p);
+
+  if (!nl) {
+    head_line(buf, key, p, pe - p);
+    return;
+  }
+  for (;;) {
+    const char *next = nl;
+
+    while (next < pe && *next == '\n')
+      next++;
+    /* a leading empty value is only kept if others follow */
+    if (nl > p || next < pe)
+      head_line(buf, key, p, nl - p);
+    if (next == pe)
+      break;
+    p = next;
+    nl = memchr(p, '\n', pe - p);
+    if (!nl)
+      nl = pe;
+  }
+  RB_GC_GUARD(value);
+}
+
+/* the single value of a header we need, Qnil for odd ones */
+static VALUE field_value(VALUE value)
+{
+  if (RB_TYPE_P(value, T_ARRAY))
+    value = RARRAY_LEN(value) == 1 ? RARRAY_AREF(value, 0) : Qnil;
+  return NIL_P(value) ? Qnil : rb_obj_as_string(value);
+}
+
+static void response_field(struct response_head *rh, VALUE key, VALUE value)
+{
+  key = rb_obj_as_string(key);
+
+  /* we set these ourselves, but the app may want the client gone */
+  if (FIELD_EQ(key, "Date") || FIELD_EQ(key, "Connection")) {
+    if (rh->keepalive && has_close(value))
+      rh->keepalive = 0;
+    return;
+  }
+  if (RSTRING_LEN(key) == 11 && !memcmp(RSTRING_PTR(key), "rack.hijack", 11)) {
+    rh->hijack = value;
+    return;
+  }
+  if (FIELD_EQ(key, "Content-Length")) {
+    rh->length = field_value(value);
+    rh->framed = 1;
+  } else if (FIELD_EQ(key, "Content-Range")) {
+    rh->range = field_value(value);
+  } else if (rh->keepalive && !rh->framed &&
+             FIELD_EQ(key, "Transfer-Encoding")) {
+    rh->framed = 1;
+  }
+
+  if (RB_TYPE_P(value, T_ARRAY)) { /* Rack 3 */
+    long i;
+
+    for (i = 0; i < RARRAY_LEN(value); i++) {
+      VALUE v = rb_obj_as_string(RARRAY_AREF(value, i));
+
+      head_line(rh->buf, key, RSTRING_PTR(v), RSTRING_LEN(v));
+    }
+  } else if (RB_TYPE_P(value, T_STRING)) {
+    head_lines(rh->buf, key, value);
+  } else {
+    value = rb_obj_as_string(value);
+    head_line(rh->buf, key, RSTRING_PTR(value), RSTRING_LEN(value));
+  }
+  RB_GC_GUARD(key);
+}
+
+static int response_field_i(VALUE key, VALUE value, VALUE arg)
+{
+  response_field((struct response_head *)arg, key, value);
+  return ST_CONTINUE;
+}
+
+/* for headers which are not a Hash, but respond to each */
+static VALUE response_field_each(RB_BLOCK_CALL_FUNC_ARGLIST(pair, arg))
+{
+  if (argc == 2)
+    response_field((struct response_head *)arg, argv[0], argv[1]);
+  else
+    response_field((struct response_head *)arg, rb_ary_entry(pair, 0),
+                   rb_ary_entry(pair, 1));
+  return Qnil;
+}
+
+/* apps may change Rack::Utils::HTTP_STATUS_CODES at any time */
+static VALUE status_line(long code)
+{
+  VALUE msg, line;
+
+  if (NIL_P(status_codes)) {
+    status_codes = rb_const_get(rb_path2class("Pitchfork::HttpResponse"),
+                                id_status_codes);
+    status_lines = rb_ary_new_capa(STATUS_LINES_MAX * 2);
+    rb_ary_store(status_lines, STATUS_LINES_MAX * 2 - 1, Qnil);
+  }
+  if (code < 0 || code >= STATUS_LINES_MAX)
+    return Qnil;
+
+  msg = rb_hash_lookup(status_codes, LONG2FIX(code));
+  if (NIL_P(msg))
+    return Qnil;
+  if (RARRAY_AREF(status_lines, code * 2) == msg)
+    return RARRAY_AREF(status_lines, code * 2 + 1);
+
+  line = rb_obj_freeze(rb_sprintf(RESPONSE_START "%ld %"PRIsVALUE"\r\n",
+                                  code, msg));
+  rb_ary_store(status_lines, code * 2, msg);
+  rb_ary_store(status_lines, code * 2 + 1, line);
+  return line;
+}
+
+/*
+ * appends the head of a response to rh->buf and updates rh->keepalive,
+ * rh->hijack is the rack.hijack callable, if any
+ */
+static void response_head(struct response_head *rh, VALUE status,
+                          VALUE headers, int start_sent)
+{
+  VALUE buf = rh->buf;
+  long code = FIXNUM_P(status) ? FIX2LONG(status) :
+              NUM2LONG(rb_funcall(status, id_to_i, 0));
+  VALUE line = status_line(code);
+  VALUE date = pitchfork_httpdate();
+
+  if (NIL_P(line)) {
+    VALUE str = rb_obj_as_string(status);
+
+    if (!start_sent)
+      rb_str_buf_cat(buf, RESPONSE_START, RESPONSE_START_LEN);
+    rb_str_buf_cat(buf, RSTRING_PTR(str), RSTRING_LEN(str));
+    rb_str_buf_cat(buf, "\r\n", 2);
+  } else {
+    long off = start_sent ? (long)RESPONSE_START_LEN : 0;
+
+    rb_str_buf_cat(buf, RSTRING_PTR(line) + off, RSTRING_LEN(line) - off);
+  }
+  rb_str_buf_cat(buf, "Date: ", 6);
+  rb_str_buf_cat(buf, RSTRING_PTR(date), RSTRING_LEN(date));
+  rb_str_buf_cat(buf, "\r\n", 2);
+
+  rh->hijack = rh->length = rh->range = Qnil;
+  rh->code = code;
+  /* the client can only find the end of other responses when we close */
+  rh->framed = code < 200 || code == 204 || code == 304;
+  if (RB_TYPE_P(headers, T_HASH))
+    rb_hash_foreach(headers, response_field_i, (VALUE)rh);
+  else
+    rb_block_call(headers, id_each, 0, NULL, response_field_each, (VALUE)rh);
+
+  rh->keepalive = rh->keepalive && rh->framed && NIL_P(rh->hijack);
+  if (rh->keepalive)
+    rb_str_buf_cat(buf, "Connection: keep-alive\r\n\r\n", 26);
+  else
+    rb_str_buf_cat(buf, "Connection: close\r\n\r\n", 21);
+}
+
+/*
+ * returns the reusable buffer, or a new one if another thread is using
+ * it, see response_buf_release
+ */
+static VALUE response_buf_acquire(void)
+{
+  VALUE buf = response_buf;
+
+  if (NIL_P(buf))
+    return rb_str_buf_new(1024);
+  response_buf = Qnil;
+  rb_str_set_len(buf, 0);
+  return buf;
+}
+
+static void response_buf_release(VALUE buf)
+{
+  if (rb_str_capacity(buf) <= RESPONSE_BUF_KEEP)
+    response_buf = buf;
+}
+
+struct gather {
+  VALUE io;
+  VALUE status;
+  VALUE headers;
+  VALUE body;
+  struct response_head rh;
+  int start_sent;
+  int fd; /* -1 to use io.write */
+  int file_fd; /* opened from body.to_path, -1 if none */
+  int stream; /* write chunks as they come */
+  int corked;
+  int zerocopy; /* the current flush uses MSG_ZEROCOPY */
+  struct zerocopy zc;
+  int chunked; /* frame chunks for Transfer-Encoding: chunked */
+  int n;
+  long bytes;
+  /* on the stack, so the GC won't free nor move them */
+  VALUE chunks[GATHER_MAX];
+  /* the part of each chunk to write, chunk frames are in rh.buf */
+  long offs[GATHER_MAX];
+  long lens[GATHER_MAX];
+};
+
+static void response_cork(int fd, int on)
+{
+#ifdef TCP_CORK
+  /* fails harmlessly for UNIX sockets */
+  (void)setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+#endif
+}
+
+/* writes whole chunks, rebuilding the vector after partial writes */
+static void gather_writev(struct gather *g)
+{
+  struct iovec iov[GATHER_MAX];
+  long done = 0;
+
+  for (;;) {
+    long skip = done;
+    ssize_t w;
+    int i, n = 0;
+
+    for (i = 0; i < g->n; i++) {
+      long len = g->lens[i];
+
+      if (skip >= len) {
+        skip -= len;
+        continue;
+      }
+      iov[n].iov_base = RSTRING_PTR(g->chunks[i]) + g->offs[i] + skip;
+      iov[n].iov_len = (size_t)(len - skip);
+      skip = 0;
+      n++;
+    }
+    if (n == 0)
+      return;
+    w = g->zerocopy ? zerocopy_send(&g->zc, g->fd, iov, n) :
+                      writev(g->fd, iov, n);
+    if (w >= 0)
+      done += w;
+    else if (g->zerocopy && errno == ENOBUFS) /* out of optmem, copy */
+      g->zerocopy = 0;
+    else if (!rb_io_wait_writable(g->fd))
+      rb_sys_fail("writev(2)");
+  }
+}
+
+/* the pages of MSG_ZEROCOPY sends must not change until they're reaped */
+static int gather_freeze(struct gather *g)
+{
+  int i;
+
+  for (i = 0; i < g->n; i++) {
+    if (g->chunks[i] != g->rh.buf && !OBJ_FROZEN(g->chunks[i]))
+      g->chunks[i] = rb_str_new_frozen(g->chunks[i]);
+  }
+  return 1;
+}
+
+static void gather_flush(struct gather *g, int last)
+{
+  if (g->n == 0)
+    return;
+  if (g->fd < 0) {
+    int i;
+
+    for (i = 0; i < g->n; i++) {
+      if (g->offs[i] || g->lens[i] != RSTRING_LEN(g->chunks[i]))
+        g->chunks[i] = rb_str_subseq(g->chunks[i], g->offs[i], g->lens[i]);
+    }
+    rb_funcallv(g->io, id_write, g->n, g->chunks);
+  } else {
+    /* keep the kernel from sending partial frames between our writes */
+    if (cork_responses && !last && !g->stream && !g->corked) {
+      response_cork(g->fd, 1);
+      g->corked = 1;
+    }
+    g->zerocopy = zerocopy_threshold && g->bytes >= zerocopy_threshold &&
+                  zerocopy_enable(g->fd) && gather_freeze(g);
+    gather_writev(g);
+    if (g->zc.sent)
+      zerocopy_reap(&g->zc, g->fd);
+  }
+  g->n = 0;
+  g->bytes = 0;
+  /* the head and chunk frames are written */
+  if (!NIL_P(g->rh.buf))
+    rb_str_set_len(g->rh.buf, 0);
+}
+
+static void gather_piece(struct gather *g, VALUE str, long off, long len)
+{
+  g->chunks[g->n] = str;
+  g->offs[g->n] = off;
+  g->lens[g->n] = len;
+  g->n++;
+}
+
+/* appends +len+ bytes of a chunk frame to rh.buf, and gathers them */
+static void gather_frame(struct gather *g, const char *ptr, long len)
+{
+  long off = RSTRING_LEN(g->rh.buf);
+
+  rb_str_buf_cat(g->rh.buf, ptr, len);
+  gather_piece(g, g->rh.buf, off, len);
+}
+
+/* the chunk size line, in hex */
+static void gather_chunk_size(struct gather *g, long size)
+{
+  static const char hex[] = "0123456789abcdef";
+  char buf[sizeof(long) * 2 + 2], *p = buf + sizeof(buf);
+
+  *--p = '\n';
+  *--p = '\r';
+  do {
+    *--p = hex[size & 0xf];
+    size >>= 4;
+  } while (size);
+  gather_frame(g, p, buf + sizeof(buf) - p);
+}
+
+static void gather_chunk(struct gather *g, VALUE chunk, int copy)
+{
+  chunk = rb_obj_as_string(chunk);
+  if (RSTRING_LEN(chunk) == 0)
+    return;
+  /* the body may reuse its buffer for the next chunk */
+  if (copy && !OBJ_FROZEN(chunk))
+    chunk = rb_str_new_frozen(chunk);
+  if (g->chunked) {
+    if (g->n + 3 > GATHER_MAX)
+      gather_flush(g, 0);
+    gather_chunk_size(g, RSTRING_LEN(chunk));
+    gather_piece(g, chunk, 0, RSTRING_LEN(chunk));
+    gather_frame(g, "\r\n", 2);
+  } else {
+    gather_piece(g, chunk, 0, RSTRING_LEN(chunk));
+  }
+  g->bytes += RSTRING_LEN(chunk);
+  if (g->stream || g->n == GATHER_MAX || (copy && g->bytes >= GATHER_BYTES))
+    gather_flush(g, 0);
+}
+
+static VALUE gather_each(RB_BLOCK_CALL_FUNC_ARGLIST(chunk, arg))
+{
+  struct gather *g = (struct gather *)arg;
+
+  gather_chunk(g, chunk, !g->stream);
+  return Qnil;
+}
+
+/* IO#write is used for IO-like objects and buffered IOs */
+static int gather_fd(VALUE io)
+{
+  int mode;
+
+  if (!RB_TYPE_P(io, T_FILE))
+    return -1;
+#ifdef HAVE_RB_IO_MODE
+  mode = rb_io_mode(io);
+#else
+  {
+    rb_io_t *fptr;
+
+    GetOpenFile(io, fptr);
+    mode = fptr->mode;
+  }
+#endif
+  return (mode & FMODE_SYNC) ? io_fd(io) : -1;
+}
+
+#ifdef HAVE_SENDFILE
+struct sendfile_args {
+  int out;
+  int in;
+  int err; /* -1 if the file ended early */
+  off_t off;
+  off_t left;
+};
+
+static void *sendfile_nogvl(void *ptr)
+{
+  struct sendfile_args *a = ptr;
+
+  while (a->left > 0) {
+    size_t count = a->left > SENDFILE_MAX ? SENDFILE_MAX : (size_t)a->left;
+    ssize_t w = sendfile(a->out, a->in, &a->off, count);
+
+    if (w > 0) {
+      a->left -= w;
+    } else if (w == 0) {
+      a->err = -1;
+      return NULL;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      struct pollfd pfd;
+
+      pfd.fd = a->out;
+      pfd.events = POLLOUT;
+      if (poll(&pfd, 1, -1) < 0) {
+        a->err = errno;
+        return NULL;
+      }
+    } else {
+      a->err = errno;
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * sends +len+ bytes of +in+ from +off+ with the GVL released, as reading
+ * the file may block.  Returns 0 if the socket doesn't support it.
+ */
+static int gather_sendfile(struct gather *g, int in, off_t off, off_t len)
+{
+  struct sendfile_args a;
+
+  a.out = g->fd;
+  a.in = in;
+  a.off = off;
+  a.left = len;
+  for (;;) {
+    a.err = 0;
+    rb_thread_call_without_gvl(sendfile_nogvl, &a, RUBY_UBF_IO, NULL);
+    if (a.err == EINTR) {
+      rb_thread_check_ints();
+      continue;
+    }
+    if ((a.err == EINVAL || a.err == ENOSYS) && a.left == len)
+      return 0;
+    if (a.err == -1)
+      rb_eof_error();
+    if (a.err)
+      rb_syserr_fail(a.err, "sendfile(2)");
+    return 1;
+  }
+}
+
+/* "bytes START-END/SIZE" */
+static int content_range(VALUE value, off_t *start, off_t *end)
+{
+  const char *p = RSTRING_PTR(value), *pe = p + RSTRING_LEN(value);
+  const char *dash, *slash;
+
+  if (pe - p < 6 || STRNCASECMP(p, "bytes ", 6))
+    return 0;
+  p += 6;
+  if (!(dash = memchr(p, '-', pe - p)) ||
+      !(slash = memchr(dash, '/', pe - dash)) ||
+      dash == p || slash == dash + 1)
+    return 0;
+  *start = parse_length(p, dash - p);
+  *end = parse_length(dash + 1, slash - dash - 1);
+  return *start >= 0 && *end >= *start;
+}
+
+/* the part of a +size+ byte file the headers ask for */
+static int sendfile_range(struct gather *g, off_t size, off_t *off, off_t *len)
+{
+  struct response_head *rh = &g->rh;
+  off_t length = -1;
+
+  if (!NIL_P(rh->length)) {
+    length = parse_length(RSTRING_PTR(rh->length), RSTRING_LEN(rh->length));
+    if (length < 0 || RSTRING_LEN(rh->length) == 0)
+      return 0;
+  }
+  if (!NIL_P(rh->range)) {
+    off_t start, end;
+
+    if (!content_range(rh->range, &start, &end) || end >= size)
+      return 0;
+    *off = start;
+    *len = end - start + 1;
+    return length < 0 || length == *len;
+  }
+  /* multipart/byteranges are left to the body */
+  if (rh->code == 206)
+    return 0;
+  *len = length < 0 ? size - *off : length;
+  return *len >= 0;
+}
+#endif /* HAVE_SENDFILE */
+
+/*
+ * sends bodies backed by regular files with sendfile(2), returns 0 if
+ * the body must be read instead
+ */
+static int gather_file(struct gather *g)
+{
+#ifdef HAVE_SENDFILE
+  struct stat st;
+  off_t off = 0, len;
+  int in;
+
+  if (g->fd < 0 || RB_TYPE_P(g->body, T_ARRAY))
+    return 0;
+  if (RB_TYPE_P(g->body, T_FILE)) {
+    in = io_fd(g->body);
+  } else if (rb_respond_to(g->body, id_to_path)) {
+    VALUE path = rb_get_path(rb_funcall(g->body, id_to_path, 0));
+
+    in = g->file_fd = rb_cloexec_open(StringValueCStr(path), O_RDONLY, 0);
+    if (in < 0)
+      return 0;
+    rb_update_max_fd(in);
+  } else {
+    return 0;
+  }
+  /* pipes and sockets can't seek, their bodies are read by each */
+  if (fstat(in, &st) < 0 || !S_ISREG(st.st_mode))
+    return 0;
+  /* IO#pos accounts for what's already in the read buffer */
+  if (RB_TYPE_P(g->body, T_FILE))
+    off = NUM2OFFT(rb_funcall(g->body, id_pos, 0));
+  if (!sendfile_range(g, st.st_size, &off, &len))
+    return 0;
+
+  g->stream = 0;
+  gather_flush(g, len == 0);
+  return len == 0 || gather_sendfile(g, in, off, len);
+#else
+  return 0;
+#endif
+}
+
+static void gather_body(struct gather *g, VALUE body)
+{
+  if (RB_TYPE_P(body, T_ARRAY)) {
+    long i;
+
+    for (i = 0; i < RARRAY_LEN(body); i++)
+      gather_chunk(g, RARRAY_AREF(body, i), 0);
+  } else {
+    /* the first event of a stream may take a while */
+    if (g->stream)
+      gather_flush(g, 0);
+    rb_block_call(body, id_each, 0, NULL, gather_each, (VALUE)g);
+  }
+}
+
+/*
+ * frames the chunks of the body Pitchfork::Chunked wraps ourselves, so
+ * they are written as they are instead of joined into new Strings
+ */
+static void gather_chunked(struct gather *g)
+{
+  VALUE body = rb_funcall(g->body, id_chunked_body, 0);
+
+  if (NIL_P(g->rh.buf))
+    g->rh.buf = response_buf_acquire();
+  if (RB_TYPE_P(body, T_ARRAY))
+    g->stream = 0;
+  g->chunked = 1;
+  gather_body(g, body);
+  g->chunked = 0;
+  /* the last chunk, trailers and the final CRLF */
+  gather_chunk(g, rb_funcall(g->body, id_chunked_tail, 0), 0);
+}
+
+static VALUE gather_response(VALUE arg)
+{
+  struct gather *g = (struct gather *)arg;
+
+  g->fd = gather_fd(g->io);
+  g->stream = !RB_TYPE_P(g->body, T_ARRAY);
+  if (!NIL_P(g->headers)) {
+    g->rh.buf = response_buf_acquire();
+    response_head(&g->rh, g->status, g->headers, g->start_sent);
+    gather_piece(g, g->rh.buf, 0, RSTRING_LEN(g->rh.buf));
+    if (!NIL_P(g->rh.hijack)) {
+      gather_flush(g, 1);
+      return Qnil;
+    }
+    if (!NIL_P(g->rh.length))
+      g->stream = 0;
+  } else {
+    g->rh.keepalive = 0; /* HTTP/0.9 */
+  }
+
+  if (rb_respond_to(g->body, id_chunked_body))
+    gather_chunked(g);
+  else if (gather_file(g))
+    return Qnil;
+  else
+    gather_body(g, g->body);
+  gather_flush(g, 1);
+  return Qnil;
+}
+
+static VALUE gather_done(VALUE arg)
+{
+  struct gather *g = (struct gather *)arg;
+
+  if (g->zc.sent)
+    zerocopy_reap(&g->zc, g->fd);
+  if (g->file_fd >= 0)
+    close(g->file_fd);
+  if (g->corked)
+    response_cork(g->fd, 0);
+  if (!NIL_P(g->rh.buf))
+    response_buf_release(g->rh.buf);
+  return Qnil;
+}
+
+static void gather_init(struct gather *g, VALUE io, int start_sent)
+{
+  g->io = RB_TYPE_P(io, T_FILE) ? rb_io_get_write_io(io) : io;
+  g->status = g->headers = g->body = Qnil;
+  g->rh.buf = g->rh.hijack = g->rh.length = g->rh.range = Qnil;
+  g->rh.code = 0;
+  g->rh.keepalive = 0;
+  g->file_fd = -1;
+  g->start_sent = start_sent;
+  g->corked = g->zerocopy = g->chunked = g->n = 0;
+  g->zc.sent = g->zc.done = 0;
+  g->bytes = 0;
+}
+
+/*
+ * writes a whole response to +io+, or only its head if the headers have
+ * a rack.hijack callable, which is returned.  +keepalive+ is updated as
+ * for response_head, HTTP/0.9 responses without +headers+ never allow it.
+ */
+static VALUE response_write(VALUE io, VALUE status, VALUE headers,
+                            VALUE body, int *keepalive, int start_sent)
+{
+  struct gather g;
+
+  gather_init(&g, io, start_sent);
+  g.status = status;
+  g.headers = headers;
+  g.body = body;
+  g.rh.keepalive = *keepalive;
+  rb_ensure(gather_response, (VALUE)&g, gather_done, (VALUE)&g);
+
+  *keepalive = g.rh.keepalive;
+  return g.rh.hijack;
+}
+
+/* +status+ is the pre-rendered head, +body+ nil for HEAD requests */
+static VALUE gather_static(VALUE arg)
+{
+  struct gather *g = (struct gather *)arg;
+  VALUE date = pitchfork_httpdate();
+  long off = g->start_sent ? (long)RESPONSE_START_LEN : 0;
+
+  g->fd = gather_fd(g->io);
+  g->stream = 0;
+  g->rh.buf = response_buf_acquire();
+  rb_str_buf_cat(g->rh.buf, "Date: ", 6);
+  rb_str_buf_cat(g->rh.buf, RSTRING_PTR(date), RSTRING_LEN(date));
+  if (g->rh.keepalive)
+    rb_str_buf_cat(g->rh.buf, "\r\nConnection: keep-alive\r\n\r\n", 28);
+  else
+    rb_str_buf_cat(g->rh.buf, "\r\nConnection: close\r\n\r\n", 23);
+
+  gather_piece(g, g->status, off, RSTRING_LEN(g->status) - off);
+  gather_piece(g, g->rh.buf, 0, RSTRING_LEN(g->rh.buf));
+  if (!NIL_P(g->body) && RSTRING_LEN(g->body))
+    gather_piece(g, g->body, 0, RSTRING_LEN(g->body));
+  gather_flush(g, 1);
+  return Qnil;
+}
+
+/*
+ * writes a static_route response, +head+ is the pre-rendered status line
+ * and headers but Date and Connection
+ */
+static void static_response_write(VALUE io, VALUE head, VALUE body,
+                                  int keepalive, int start_sent)
+{
+  struct gather g;
+
+  gather_init(&g, io, start_sent);
+  g.status = head;
+  g.body = body;
+  g.rh.keepalive = keepalive;
+  rb_ensure(gather_static, (VALUE)&g, gather_done, (VALUE)&g);
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.cork_responses = true or false
+ *
+ * Sets TCP_CORK on Linux while writing responses which take more than
+ * one writev(2), so no partial frames are sent between them.
+ */
+static VALUE set_cork_responses(VALUE self, VALUE enable)
+{
+  cork_responses = RTEST(enable);
+  return enable;
+}
+
+static VALUE get_cork_responses(VALUE self)
+{
+  return cork_responses ? Qtrue : Qfalse;
+}
+
+static void init_response(VALUE klass)
+{
+  status_codes = status_lines = Qnil;
+  rb_gc_register_address(&status_codes);
+  rb_gc_register_address(&status_lines);
+  response_buf = rb_str_buf_new(1024);
+  rb_gc_register_address(&response_buf);
+  id_status_codes = rb_intern("STATUS_CODES");
+  id_write = rb_intern("write");
+  id_each = rb_intern("each");
+  id_to_i = rb_intern("to_i");
+  id_to_path = rb_intern("to_path");
+  id_pos = rb_intern("pos");
+  id_chunked_body = rb_intern("chunked_body");
+  id_chunked_tail = rb_intern("chunked_tail");
+  rb_define_singleton_method(klass, "cork_responses=", set_cork_responses, 1);
+  rb_define_singleton_method(klass, "cork_responses", get_cork_responses, 0);
+}
+
+#endif /* response_h */
@@ -0,0 +1,140 @@
+#ifndef static_route_h
+#define static_route_h
+
+#include "ruby.h"
+#include <string.h>
+
+/*
+ * Responses configured with the static_route directive.  GET and HEAD
+ * requests without a body are matched on their path once the head is
+ * parsed, so the server can write the pre-rendered response without
+ * calling the Rack application.
+ */
+struct static_route {
+  char *path; /* a copy, GC.compact may move the String */
+  long path_len;
+  unsigned long hits;
+};
+
+static struct static_route *static_routes;
+static long nr_static_routes;
+static VALUE static_route_values = Qnil;
+
+/* routes are numbered from 1 in the parser flags, 0 is no match */
+#define STATIC_ROUTE_MAX 255
+
+/* returns the route number for +method+ and +path+, or 0 */
+static unsigned int static_route_match(VALUE method, VALUE path)
+{
+  const char *m;
+  long i;
+
+  if (!RB_TYPE_P(method, T_STRING) || !RB_TYPE_P(path, T_STRING))
+    return 0;
+
+  m = RSTRING_PTR(method);
+  switch (RSTRING_LEN(method)) {
+  case 3: if (memcmp(m, "GET", 3)) return 0; break;
+  case 4: if (memcmp(m, "HEAD", 4)) return 0; break;
+  default: return 0;
+  }
+
+  for (i = 0; i < nr_static_routes; i++) {
+    struct static_route *route = &static_routes[i];
+
+    if (route->path_len == RSTRING_LEN(path) &&
+        !memcmp(route->path, RSTRING_PTR(path), route->path_len)) {
+      route->hits++;
+      return (unsigned int)i + 1;
+    }
+  }
+  return 0;
+}
+
+/* responses are looked up in static_route_values, which the GC updates */
+static VALUE static_route_response(unsigned int nr)
+{
+  if (!nr || nr > nr_static_routes)
+    return Qnil;
+  return rb_ary_entry(rb_ary_entry(static_route_values, nr - 1), 1);
+}
+
+static void static_routes_free(struct static_route *routes, long n)
+{
+  long i;
+
+  for (i = 0; i < n; i++)
+    xfree(routes[i].path);
+  xfree(routes);
+}
+
+static int static_route_add_i(VALUE path, VALUE response, VALUE ary)
+{
+  path = rb_str_new_frozen(rb_convert_type(path, T_STRING, "String", "to_str"));
+  rb_ary_push(ary, rb_assoc_new(path, response));
+  return ST_CONTINUE;
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.static_routes = { path => response }
+ *
+ * Replaces the static routes, +response+ is what #static_response
+ * returns for matching requests.  Hit counters are reset.
+ */
+static VALUE set_static_routes(VALUE self, VALUE routes)
+{
+  VALUE ary = rb_ary_new();
+  struct static_route *tmp;
+  long i, n;
+
+  rb_hash_foreach(rb_convert_type(routes, T_HASH, "Hash", "to_hash"),
+                  static_route_add_i, ary);
+  n = RARRAY_LEN(ary);
+  if (n > STATIC_ROUTE_MAX)
+    rb_raise(rb_eArgError, "too many static routes (> %d)", STATIC_ROUTE_MAX);
+
+  tmp = n ? ALLOC_N(struct static_route, n) : NULL;
+  for (i = 0; i < n; i++) {
+    VALUE path = rb_ary_entry(rb_ary_entry(ary, i), 0);
+
+    tmp[i].path_len = RSTRING_LEN(path);
+    tmp[i].path = ALLOC_N(char, tmp[i].path_len ? tmp[i].path_len : 1);
+    memcpy(tmp[i].path, RSTRING_PTR(path), tmp[i].path_len);
+    tmp[i].hits = 0;
+  }
+
+  static_routes_free(static_routes, nr_static_routes);
+  static_routes = tmp;
+  nr_static_routes = n;
+  static_route_values = rb_ary_freeze(ary);
+  return routes;
+}
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.static_route_hits => { path => count }
+ *
+ * The number of requests answered by each static route in this process.
+ */
+static VALUE static_route_hits(VALUE self)
+{
+  VALUE hits = rb_hash_new();
+  long i;
+
+  for (i = 0; i < nr_static_routes; i++) {
+    VALUE path = rb_ary_entry(rb_ary_entry(static_route_values, i), 0);
+
+    rb_hash_aset(hits, path, ULONG2NUM(static_routes[i].hits));
+  }
+  return hits;
+}
+
+static void init_static_route(VALUE klass)
+{
+  rb_gc_register_address(&static_route_values);
+  rb_define_singleton_method(klass, "static_routes=", set_static_routes, 1);
+  rb_define_singleton_method(klass, "static_route_hits", static_route_hits, 0);
+}
+
+#endif /* static_route_h */
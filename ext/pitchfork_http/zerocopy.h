@@ -0,0 +1,176 @@
+#ifndef zerocopy_h
+#define zerocopy_h
+
+#include "ruby.h"
+#include "ruby/thread.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#if defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+    defined(HAVE_LINUX_ERRQUEUE_H)
+#  include <linux/errqueue.h>
+#  define HAVE_ZEROCOPY 1
+#endif
+
+/*
+ * Optional MSG_ZEROCOPY sends of large response bodies on Linux, so the
+ * kernel transmits from the pages of the Strings instead of copying them
+ * into the socket buffer.  The pages must not change until the kernel is
+ * done with them, so every send is followed by reaping its completions
+ * from the socket error queue while the Strings are still referenced.
+ */
+static long zerocopy_threshold; /* bytes, 0 disables MSG_ZEROCOPY */
+
+struct zerocopy {
+  uint32_t sent; /* sendmsg(2) calls with MSG_ZEROCOPY */
+  uint32_t done; /* ... the kernel is done with */
+};
+
+#ifdef HAVE_ZEROCOPY
+/* returns whether +fd+ takes MSG_ZEROCOPY, only TCP sockets do */
+static int zerocopy_enable(int fd)
+{
+  int on = 1;
+
+  return setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+}
+
+static ssize_t
+zerocopy_send(struct zerocopy *zc, int fd, struct iovec *iov, int n)
+{
+  struct msghdr msg;
+  ssize_t w;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = (size_t)n;
+  w = sendmsg(fd, &msg, MSG_ZEROCOPY);
+  if (w >= 0)
+    zc->sent++;
+  return w;
+}
+
+/* counts the completions of one error queue message, -1 if empty */
+static int zerocopy_recv(struct zerocopy *zc, int fd)
+{
+  char control[128];
+  struct msghdr msg;
+  struct cmsghdr *cm;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+    return -1;
+
+  for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+    struct sock_extended_err serr;
+
+    if (!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) &&
+        !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+      continue;
+    memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+    /* ids [ee_info, ee_data] are done, counting wraps around */
+    if (serr.ee_errno == 0 && serr.ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+      zc->done += serr.ee_data - serr.ee_info + 1;
+  }
+  return 0;
+}
+
+struct zerocopy_wait_args {
+  int fd;
+  int err;
+  short revents;
+};
+
+static void *zerocopy_wait_nogvl(void *ptr)
+{
+  struct zerocopy_wait_args *a = ptr;
+  struct pollfd pfd;
+
+  /* POLLERR is always reported, and means the error queue has data */
+  pfd.fd = a->fd;
+  pfd.events = 0;
+  if (poll(&pfd, 1, -1) < 0)
+    a->err = errno;
+  a->revents = pfd.revents;
+  return NULL;
+}
+
+/*
+ * waits until the kernel is done with all our pages.  Gives up if the
+ * connection is gone without telling us, after which the kernel still
+ * holds references to the pages.
+ */
+static void zerocopy_reap(struct zerocopy *zc, int fd)
+{
+  while (zc->done != zc->sent) {
+    struct zerocopy_wait_args a;
+
+    if (zerocopy_recv(zc, fd) == 0)
+      continue;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+      break;
+    a.fd = fd;
+    a.err = 0;
+    a.revents = 0;
+    rb_thread_call_without_gvl(zerocopy_wait_nogvl, &a, RUBY_UBF_IO, NULL);
+    if (a.err == EINTR)
+      rb_thread_check_ints();
+    else if (a.err || !(a.revents & POLLERR))
+      break;
+  }
+  zc->sent = zc->done = 0;
+}
+#else /* !HAVE_ZEROCOPY */
+static int zerocopy_enable(int fd)
+{
+  return 0;
+}
+
+static ssize_t
+zerocopy_send(struct zerocopy *zc, int fd, struct iovec *iov, int n)
+{
+  return writev(fd, iov, n);
+}
+
+static void zerocopy_reap(struct zerocopy *zc, int fd)
+{
+}
+#endif /* !HAVE_ZEROCOPY */
+
+/**
+ * call-seq:
+ *    Pitchfork::HttpParser.zerocopy_threshold = bytes
+ *
+ * Sends response bodies of at least +bytes+ with MSG_ZEROCOPY on Linux
+ * TCP sockets, +0+ disables it.
+ */
+static VALUE set_zerocopy_threshold(VALUE self, VALUE bytes)
+{
+  long n = NUM2LONG(bytes);
+
+  if (n < 0)
+    rb_raise(rb_eArgError, "zerocopy_threshold must not be negative");
+  zerocopy_threshold = n;
+  return bytes;
+}
+
+static VALUE get_zerocopy_threshold(VALUE self)
+{
+  return LONG2NUM(zerocopy_threshold);
+}
+
+static void init_zerocopy(VALUE klass)
+{
+  rb_define_singleton_method(klass, "zerocopy_threshold=",
+                             set_zerocopy_threshold, 1);
+  rb_define_singleton_method(klass, "zerocopy_threshold",
+                             get_zerocopy_threshold, 0);
+}
+
+#endif /* zerocopy_h */
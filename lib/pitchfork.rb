@@ -203,6 +203,7 @@ def self.time_now(int = false)
 require_relative "pitchfork/message"
 require_relative "pitchfork/chunked"
 require_relative "pitchfork/http_parser"
+require_relative "pitchfork/multipart"
 require_relative "pitchfork/refork_condition"
 require_relative "pitchfork/configurator"
 require_relative "pitchfork/tmpio"
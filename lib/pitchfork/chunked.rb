@@ -32,6 +32,7 @@ class Chunked
     class Body
       TERM = "\r\n"
       TAIL = "0#{TERM}"
+      TAIL_TERM = "#{TAIL}#{TERM}".freeze
 
       # Store the response body to be chunked.
       def initialize(body)
@@ -40,7 +41,7 @@ def initialize(body)
 
       # For each element yielded by the response body, yield
       # the element in chunked encoding.
-      def each(&block)
+      def each
         term = TERM
         @body.each do |chunk|
           size = chunk.bytesize
@@ -48,20 +49,23 @@ def each(&block)
 
           yield [size.to_s(16), term, chunk.b, term].join
         end
-        yield TAIL
-        yield_trailers(&block)
-        yield term
+        yield chunked_tail
       end
 
-      # Close the response body if the response body supports it.
-      def close
-        @body.close if @body.respond_to?(:close)
+      # The response body being chunked.  Pitchfork::HttpParser#write_response
+      # frames its chunks itself rather than calling #each.
+      def chunked_body
+        @body
       end
 
-      private
+      # The last chunk, trailers and the final CRLF, once the body is written.
+      def chunked_tail
+        TAIL_TERM
+      end
 
-      # Do nothing as this class does not support trailer headers.
-      def yield_trailers
+      # Close the response body if the response body supports it.
+      def close
+        @body.close if @body.respond_to?(:close)
       end
     end
 
@@ -72,13 +76,13 @@ def yield_trailers
     # Trailer header listing the headers that the +trailers+ method
     # will return.
     class TrailerBody < Body
-      private
-
-      # Yield strings for each trailer header.
-      def yield_trailers
+      # The last chunk, followed by the trailer headers.
+      def chunked_tail
+        tail = TAIL.dup
         @body.trailers.each_pair do |k, v|
-          yield "#{k}: #{v}\r\n"
+          tail << "#{k}: #{v}\r\n"
         end
+        tail << TERM
       end
     end
 
@@ -68,6 +68,21 @@ class Configurator
       :check_client_connection => false,
       :rewindable_input => true,
       :client_body_buffer_size => Pitchfork::Const::MAX_BODY,
+      :header_value_cache_size => 0,
+      :lazy_env => false,
+      :parse_cookies => false,
+      :query_params => false,
+      :parse_multipart => false,
+      :decode_path => false,
+      :trusted_proxies => [].freeze,
+      :request_context => false,
+      :cork_responses => false,
+      :zerocopy_threshold => 0,
+      :keepalive_requests => 1,
+      :keepalive_timeout => 1,
+      :static_routes => {}.freeze,
+      :header_read_timeout => 0,
+      :body_min_rate => 0,
     }
     #:startdoc:
 
@@ -191,7 +206,8 @@ def listen(address, options = {})
           Integer === value or
             raise ArgumentError, "not an integer: #{key}=#{value.inspect}"
         end
-        [ :tcp_nodelay, :tcp_nopush, :ipv6only, :reuseport ].each do |key|
+        [ :tcp_nodelay, :tcp_nopush, :ipv6only, :reuseport,
+          :trusted_upstream ].each do |key|
           (value = options[key]).nil? and next
           TrueClass === value || FalseClass === value or
             raise ArgumentError, "not boolean: #{key}=#{value.inspect}"
@@ -218,6 +234,90 @@ def check_client_connection(bool)
       set_bool(:check_client_connection, bool)
     end
 
+    def header_value_cache_size(size)
+      set_int(:header_value_cache_size, size, 0)
+    end
+
+    def lazy_env(bool)
+      set_bool(:lazy_env, bool)
+    end
+
+    def parse_cookies(bool)
+      set_bool(:parse_cookies, bool)
+    end
+
+    def query_params(bool)
+      set_bool(:query_params, bool)
+    end
+
+    def parse_multipart(bool)
+      set_bool(:parse_multipart, bool)
+    end
+
+    def request_context(bool)
+      set_bool(:request_context, bool)
+    end
+
+    def cork_responses(bool)
+      set_bool(:cork_responses, bool)
+    end
+
+    def zerocopy_threshold(bytes)
+      set_int(:zerocopy_threshold, bytes, 0)
+    end
+
+    def trusted_proxies(list)
+      Array === list && list.all? { |x| String === x } or
+        raise ArgumentError, "not an Array of Strings: trusted_proxies=#{list.inspect}"
+      set[:trusted_proxies] = list
+    end
+
+    def decode_path(value)
+      case value
+      when true, false, :normalize
+        set[:decode_path] = value
+      else
+        raise ArgumentError, "decode_path=#{value.inspect} not true, false or :normalize"
+      end
+    end
+
+    def header_read_timeout(seconds)
+      Numeric === seconds && seconds >= 0 or
+        raise ArgumentError, "not a non-negative number: header_read_timeout=#{seconds.inspect}"
+      set[:header_read_timeout] = seconds
+    end
+
+    def body_min_rate(bytes)
+      set_int(:body_min_rate, bytes, 0)
+    end
+
+    def keepalive_requests(nr)
+      set_int(:keepalive_requests, nr, 1)
+    end
+
+    def keepalive_timeout(seconds)
+      Numeric === seconds && seconds > 0 or
+        raise ArgumentError, "not a positive number: keepalive_timeout=#{seconds.inspect}"
+      set[:keepalive_timeout] = seconds
+    end
+
+    # Answers GET and HEAD requests for +path+ with a fixed response,
+    # without calling the application.
+    #
+    # example:
+    #.  static_route "/_health", 200, { "content-type" => "text/plain" }, "OK"
+    def static_route(path, status = 200, headers = {}, body = "")
+      String === path && path.start_with?("/") or
+        raise ArgumentError, "not an absolute path: static_route=#{path.inspect}"
+      Hash === headers or
+        raise ArgumentError, "not a Hash: static_route headers=#{headers.inspect}"
+      String === body or
+        raise ArgumentError, "not a String: static_route body=#{body.inspect}"
+      routes = set[:static_routes]
+      routes = {} if routes == :unset
+      set[:static_routes] = routes.merge(path => [status, headers, body])
+    end
+
     # Defines the number of requests per-worker after which a new generation
     # should be spawned.
     #
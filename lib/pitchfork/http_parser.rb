@@ -5,8 +5,28 @@
 module Pitchfork
   class HttpParser
 
-    # default parameters we merge into the request env for Rack handlers
-    DEFAULTS = {
+    # Hash which has the C extension rebuild its env template (see
+    # DEFAULTS) whenever it is changed
+    class Defaults < Hash # :nodoc:
+      ([
+        :[]=, :store, :delete, :delete_if, :reject!, :select!, :filter!,
+        :keep_if, :update, :merge!, :replace, :clear, :shift, :compact!,
+        :transform_keys!, :transform_values!,
+      ] & public_instance_methods).each do |name|
+        define_method(name) do |*args, &block|
+          begin
+            super(*args, &block)
+          ensure
+            HttpParser.env_template_reset!
+          end
+        end
+      end
+    end
+
+    # default parameters every request env starts with for Rack handlers,
+    # copied into a template by the C extension when the first env is built,
+    # and again after they change
+    DEFAULTS = Defaults[{
       "rack.errors" => $stderr,
       "rack.multiprocess" => true,
       "rack.multithread" => false,
@@ -17,7 +37,7 @@ class HttpParser
 
       # this is not in the Rack spec, but some apps may rely on it
       "SERVER_SOFTWARE" => "Pitchfork #{Pitchfork::Const::UNICORN_VERSION}"
-    }
+    }]
 
     NULL_IO = StringIO.new("")
 
@@ -26,6 +46,7 @@ class HttpParser
     EMPTY_ARRAY = [].freeze
     @@input_class = Pitchfork::TeeInput
     @@check_client_connection = false
+    @@parse_multipart = false
     @@tcpi_inspect_ok = Socket.const_defined?(:TCP_INFO)
 
     def self.input_class
@@ -44,6 +65,69 @@ def self.check_client_connection=(bool)
       @@check_client_connection = bool
     end
 
+    def self.parse_multipart
+      @@parse_multipart
+    end
+
+    def self.parse_multipart=(bool)
+      @@parse_multipart = bool
+    end
+
+    # Rack env returned when +lazy_env+ is enabled. Request header values
+    # are kept as placeholders into the request head until read, #[],
+    # #delete and #materialize! are implemented in C.
+    class LazyEnv
+      def fetch(key, *args, &block)
+        key?(key) ? self[key] : super
+      end
+
+      def dig(key, *rest)
+        value = self[key]
+        rest.empty? || value.nil? ? value : value.dig(*rest)
+      end
+
+      # these only ever expose old values to a block
+      [:update, :merge!].each do |name|
+        define_method(name) do |*others, &block|
+          materialize! if block
+          super(*others, &block)
+        end
+      end
+
+      # methods which don't need header values
+      KEY_METHODS = [
+        :[], :[]=, :store, :delete, :fetch, :dig, :update, :merge!, :clear,
+        :key?, :has_key?, :include?, :member?, :keys, :each_key, :size,
+        :length, :empty?, :compare_by_identity, :compare_by_identity?,
+        :default, :default=, :default_proc, :default_proc=, :rehash,
+      ]
+
+      # anything else may expose every value (ours or those of another
+      # LazyEnv argument, e.g. #== or #merge), so materialize them first
+      (Hash.public_instance_methods(false) - KEY_METHODS).each do |name|
+        define_method(name) do |*args, &block|
+          materialize!
+          args.each { |arg| arg.materialize! if LazyEnv === arg }
+          super(*args, &block)
+        end
+      end
+    end
+
+    # Errors raised by HttpParser.parse_query, the same classes as
+    # Rack::QueryParser raises when Rack has them.
+    {
+      InvalidParameterError: ArgumentError,
+      ParameterTypeError: TypeError,
+      ParamsTooDeepError: RangeError,
+      QueryLimitError: RangeError,
+    }.each do |name, superclass|
+      if defined?(::Rack::QueryParser) && ::Rack::QueryParser.const_defined?(name, false)
+        const_set(name, ::Rack::QueryParser.const_get(name, false))
+      else
+        const_set(name, Class.new(superclass))
+      end
+    end
+
     # :startdoc:
 
     # Does the majority of the IO processing.  It has been written in
@@ -56,12 +140,32 @@ def self.check_client_connection=(bool)
     # Anyone who thinks they can make it faster is more than welcome to
     # take a crack at it.
     #
-    # returns an environment hash suitable for Rack if successful
+    # returns an environment hash suitable for Rack if successful, or nil
+    # if the request matched a static route
     # This does minimal exception trapping and it is up to the caller
     # to handle any socket errors (e.g. user aborted upload).
     def read(socket)
       e = env
 
+      # short circuit the common case with small GET requests first,
+      # on persistent connections the server may have already read the
+      # start of this request, or all of it if the client pipelines them
+      if BasicSocket === socket
+        # read(2) without the GVL until the head is complete, so other
+        # threads can run while slow clients send their headers
+        read_head(socket)
+      else
+        socket.readpartial(16384, buf) if buf.empty?
+        if parse.nil?
+          # Parser is not done, queue up more data to read and continue parsing
+          # an Exception thrown from the parser will throw us out of the loop
+          false until add_parse(socket.readpartial(16384))
+        end
+      end
+
+      # static_route responses don't need anything else
+      return if static_response
+
       # From https://www.ietf.org/rfc/rfc3875:
       # "Script authors should be aware that the REMOTE_ADDR and
       #  REMOTE_HOST meta-variables (see sections 4.1.8 and 4.1.9)
@@ -69,31 +173,33 @@ def read(socket)
       #  identify the client for the immediate request to the server;
       #  that client may be a proxy, gateway, or other intermediary
       #  acting on behalf of the actual source client."
-      address = socket.remote_address
-      e['REMOTE_ADDR'] = if address.unix?
-        "127.0.0.1"
+      #
+      # REMOTE_ADDR is the client address given by trusted_proxies, if any
+      if BasicSocket === socket
+        remote_addr!(socket)
       else
-        address.ip_address
-      end
-
-      # short circuit the common case with small GET requests first
-      socket.readpartial(16384, buf)
-      if parse.nil?
-        # Parser is not done, queue up more data to read and continue parsing
-        # an Exception thrown from the parser will throw us out of the loop
-        false until add_parse(socket.readpartial(16384))
+        address = socket.remote_address
+        remote_addr!(address.unix? ? "127.0.0.1" : address.ip_address)
       end
 
       check_client_connection(socket) if @@check_client_connection
 
-      e['rack.input'] = 0 == content_length ?
-                        NULL_IO : @@input_class.new(socket, self)
+      if 0 == content_length
+        e['rack.input'] = NULL_IO
+      elsif @@parse_multipart && !e['HTTP_EXPECT'] &&
+            (boundary = Multipart.boundary(e['CONTENT_TYPE']))
+        # sets rack.input itself, uploads are only written once.  Clients
+        # expecting 100-continue wait for the app to answer first.
+        Multipart.new(e, boundary).parse(StreamInput.new(socket, self))
+      else
+        e['rack.input'] = @@input_class.new(socket, self)
+      end
 
       # for Rack hijacking in Rack 1.5 and later
       e['pitchfork.socket'] = socket
       e['rack.hijack'] = self
 
-      e.merge!(DEFAULTS)
+      e
     end
 
     # for rack.hijack, we respond to this method so no extra allocation
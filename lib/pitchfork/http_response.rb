@@ -14,10 +14,15 @@ module HttpResponse
     STATUS_CODES = defined?(Rack::Utils::HTTP_STATUS_CODES) ?
                    Rack::Utils::HTTP_STATUS_CODES : {}
 
+    # rendered once, so rejecting bad requests doesn't allocate
+    ERROR_RESPONSES = Hash.new do |responses, code|
+      responses[code] = "HTTP/1.1 #{code} #{STATUS_CODES[code]}\r\n\r\n".freeze
+    end
+
     # internal API, code will always be common-enough-for-even-old-Rack
     def err_response(code, response_start_sent)
-      "#{response_start_sent ? '' : 'HTTP/1.1 '}" \
-        "#{code} #{STATUS_CODES[code]}\r\n\r\n"
+      response = ERROR_RESPONSES[code]
+      response_start_sent ? response.byteslice(9..-1) : response
     end
 
     def append_header(buf, key, value)
@@ -32,39 +37,32 @@ def append_header(buf, key, value)
       end
     end
 
-    # writes the rack_response to socket as an HTTP response
+    # writes the rack_response to socket as an HTTP response, keeping the
+    # connection open for another request if +keepalive+ is true and the
+    # response allows it.  Returns whether the connection may be reused.
     def http_response_write(socket, status, headers, body,
-                            req = Pitchfork::HttpParser.new)
-      hijack = nil
+                            req = Pitchfork::HttpParser.new, keepalive = false)
+      # gathered into writev(2) calls in C, which also calls rack.hijack
+      req.write_response(socket, status, headers, body, keepalive) || false
+    end
 
-      if headers
-        code = status.to_i
-        msg = STATUS_CODES[code]
-        start = req.response_start_sent ? ''.freeze : 'HTTP/1.1 '.freeze
-        buf = "#{start}#{msg ? %Q(#{code} #{msg}) : status}\r\n" \
-              "Date: #{httpdate}\r\n" \
-              "Connection: close\r\n"
-        headers.each do |key, value|
-          case key
-          when %r{\A(?:Date|Connection)\z}i
-            next
-          when "rack.hijack"
-            # This should only be hit under Rack >= 1.5, as this was an illegal
-            # key in Rack < 1.5
-            hijack = value
-          else
-            append_header(buf, key, value)
-          end
-        end
-        socket.write(buf << "\r\n".freeze)
+    # pre-renders a static_route response, everything but the Date and
+    # Connection headers
+    def static_response(status, headers, body)
+      code = status.to_i
+      msg = STATUS_CODES[code]
+      head = "HTTP/1.1 #{msg ? %Q(#{code} #{msg}) : status}\r\n"
+      headers.each do |key, value|
+        next if %r{\A(?:Date|Connection|Content-Length)\z}i.match?(key)
+        append_header(head, key, value)
       end
+      head << "Content-Length: #{body.bytesize}\r\n"
+      [head.freeze, body.b.freeze].freeze
+    end
 
-      if hijack
-        req.hijacked!
-        hijack.call(socket)
-      else
-        body.each { |chunk| socket.write(chunk) }
-      end
+    # writes the response of the static_route +req+ matched
+    def static_response_write(socket, req, keepalive)
+      req.write_static_response(socket, keepalive)
     end
   end
 end
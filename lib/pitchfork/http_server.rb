@@ -78,7 +78,8 @@ def extend_deadline(extra_time)
                   :after_worker_fork, :after_mold_fork,
                   :listener_opts, :children,
                   :orig_app, :config, :ready_pipe,
-                  :default_middleware, :early_hints
+                  :default_middleware, :early_hints,
+                  :keepalive_requests, :keepalive_timeout
     attr_writer   :after_worker_exit, :before_worker_exit, :after_worker_ready, :after_request_complete,
                   :refork_condition, :after_worker_timeout, :after_worker_hard_timeout
 
@@ -444,6 +445,108 @@ def check_client_connection=(bool)
       Pitchfork::HttpParser.check_client_connection = bool
     end
 
+    def header_value_cache_size
+      Pitchfork::HttpParser.header_value_cache_size
+    end
+
+    def header_value_cache_size=(size)
+      Pitchfork::HttpParser.header_value_cache_size = size
+    end
+
+    def lazy_env
+      Pitchfork::HttpParser.lazy_env
+    end
+
+    def lazy_env=(bool)
+      Pitchfork::HttpParser.lazy_env = bool
+    end
+
+    def parse_cookies
+      Pitchfork::HttpParser.parse_cookies
+    end
+
+    def parse_cookies=(bool)
+      Pitchfork::HttpParser.parse_cookies = bool
+    end
+
+    def query_params
+      Pitchfork::HttpParser.query_params
+    end
+
+    def query_params=(bool)
+      Pitchfork::HttpParser.query_params = bool
+    end
+
+    def parse_multipart
+      Pitchfork::HttpParser.parse_multipart
+    end
+
+    def parse_multipart=(bool)
+      Pitchfork::HttpParser.parse_multipart = bool
+    end
+
+    def request_context
+      Pitchfork::HttpParser.request_context
+    end
+
+    def request_context=(bool)
+      Pitchfork::HttpParser.request_context = bool
+    end
+
+    def cork_responses
+      Pitchfork::HttpParser.cork_responses
+    end
+
+    def cork_responses=(bool)
+      Pitchfork::HttpParser.cork_responses = bool
+    end
+
+    def zerocopy_threshold
+      Pitchfork::HttpParser.zerocopy_threshold
+    end
+
+    def zerocopy_threshold=(bytes)
+      Pitchfork::HttpParser.zerocopy_threshold = bytes
+    end
+
+    def trusted_proxies
+      Pitchfork::HttpParser.trusted_proxies
+    end
+
+    def trusted_proxies=(list)
+      Pitchfork::HttpParser.trusted_proxies = list
+    end
+
+    def decode_path
+      Pitchfork::HttpParser.decode_path
+    end
+
+    def decode_path=(value)
+      Pitchfork::HttpParser.decode_path = value
+    end
+
+    def header_read_timeout
+      Pitchfork::HttpParser.header_read_timeout
+    end
+
+    def header_read_timeout=(seconds)
+      Pitchfork::HttpParser.header_read_timeout = seconds
+    end
+
+    def body_min_rate
+      Pitchfork::StreamInput.body_min_rate
+    end
+
+    def body_min_rate=(bytes)
+      Pitchfork::StreamInput.body_min_rate = bytes
+    end
+
+    def static_routes=(routes)
+      Pitchfork::HttpParser.static_routes = routes.each_with_object({}) do |(path, response), rendered|
+        rendered[path] = static_response(*response)
+      end
+    end
+
     private
 
     # wait for a signal handler to wake us up and then consume the pipe
@@ -549,6 +652,8 @@ def after_fork_internal
       # The OpenSSL PRNG is seeded with only the pid, and apps with frequently
       # dying workers can recycle pids
       OpenSSL::Random.seed(rand.to_s) if defined?(OpenSSL::Random)
+      # likewise for the generator of request IDs
+      Pitchfork::HttpParser.reseed_request_ids
     end
 
     def spawn_worker(worker, detach:)
@@ -653,6 +758,8 @@ def handle_error(client, e)
       code = case e
       when EOFError,Errno::ECONNRESET,Errno::EPIPE,Errno::ENOTCONN
         # client disconnected on us and there's nothing we can do
+      when Pitchfork::RequestTimeoutError
+        408
       when Pitchfork::RequestURITooLongError
         414
       when Pitchfork::RequestEntityTooLargeError
@@ -664,6 +771,7 @@ def handle_error(client, e)
         500
       end
       if code
+        SharedMemory.rejected_request!(code)
         client.write_nonblock(err_response(code, @request.response_start_sent), exception: false)
       end
       client.close
@@ -691,10 +799,19 @@ def e100_response_write(client, env)
 
     # once a client is accepted, it is processed in its entirety here
     # in 3 easy steps: read request, call app, write app response
-    def process_client(client, timeout_handler)
+    # +keepalive+ allows leaving the connection open for another request,
+    # and +buffered+ holds what was already read from it
+    def process_client(client, timeout_handler, keepalive = false, buffered = nil)
       env = nil
       @request = Pitchfork::HttpParser.new
-      env = @request.read(client)
+      @request.trusted_upstream = true if @trusted_client
+      @request.buf << buffered if buffered
+      unless env = @request.read(client)
+        keepalive = static_response_write(client, @request,
+                                          keepalive && @request.keepalive?)
+        close_client(client) unless keepalive
+        return
+      end
 
       proc_name status: "processing: #{env["PATH_INFO"]}"
 
@@ -720,18 +837,13 @@ def process_client(client, timeout_handler)
           return env if @request.hijacked?
         end
         @request.headers? or headers = nil
-        http_response_write(client, status, headers, body, @request)
+        keepalive = http_response_write(client, status, headers, body, @request,
+                                        keepalive && @request.keepalive?)
       ensure
         body.respond_to?(:close) and body.close
       end
 
-      unless client.closed? # rack.hijack may've close this for us
-        begin
-          client.shutdown # in case of fork() in Rack app
-        rescue Errno::ENOTCONN
-        end
-        client.close # flush and uncork socket immediately, no keepalive
-      end
+      close_client(client) unless keepalive
       env
     rescue => e
       handle_error(client, e)
@@ -742,6 +854,36 @@ def process_client(client, timeout_handler)
       env
     end
 
+    def close_client(client)
+      unless client.closed? # rack.hijack may've close this for us
+        begin
+          client.shutdown # in case of fork() in Rack app
+        rescue Errno::ENOTCONN
+        end
+        client.close # flush and uncork socket immediately
+      end
+    end
+
+    # Returns the start of the next request on a persistent connection,
+    # either pipelined behind the last one or sent within keepalive_timeout,
+    # or closes the connection and returns nil.
+    def keepalive_read(client, readers)
+      buf = @request.buf
+      return buf unless buf.empty?
+
+      # don't leave the end of the last response corked while waiting
+      tcp_nopush_flush(client) if @nopush_client
+      if readers[0] && client.wait_readable(@keepalive_timeout)
+        buf = client.read_nonblock(16384, buf, exception: false)
+        return buf if String === buf
+      end
+      close_client(client)
+      nil
+    rescue IOError, SystemCallError
+      client.close unless client.closed?
+      nil
+    end
+
     def nuke_listeners!(readers)
       # only called from the worker, ordering is important here
       tmp = readers.dup
@@ -768,6 +910,16 @@ def init_worker_process(worker)
 
       after_worker_fork.call(self, worker) # can drop perms and create listeners
       LISTENERS.each { |sock| sock.close_on_exec = true }
+      # molds promoted from a worker no longer have listener_opts, but kept this
+      if listener_opts
+        @trusted_listeners = LISTENERS.select do |sock|
+          (listener_opts[sock_name(sock)] || {})[:trusted_upstream]
+        end
+        @nopush_listeners = LISTENERS.select do |sock|
+          NOPUSH && TCPServer === sock &&
+            (listener_opts[sock_name(sock)] || {})[:tcp_nopush] == true
+        end
+      end
 
       @config = nil
       @listener_opts = @orig_app = nil
@@ -829,9 +981,19 @@ def worker_loop(worker)
               when Message
                 worker.update(client)
               else
-                request_env = process_client(client, prepare_timeout(worker))
-                @after_request_complete&.call(self, worker, request_env)
-                worker.increment_requests_count
+                served = 0
+                buffered = nil
+                @trusted_client = @trusted_listeners.include?(sock)
+                @nopush_client = @nopush_listeners.include?(sock)
+                begin
+                  served += 1
+                  request_env = process_client(client, prepare_timeout(worker),
+                                               served < @keepalive_requests, buffered)
+                  @after_request_complete&.call(self, worker, request_env)
+                  worker.increment_requests_count
+                  worker.update_deadline(@timeout)
+                end until client.closed? || @request.hijacked? ||
+                          !(buffered = keepalive_read(client, readers))
               end
               worker.update_deadline(@timeout)
             end
@@ -68,6 +68,13 @@ def shutting_down?
         SharedMemory.shutting_down?
       end
 
+      # Returns the number of requests the workers rejected as invalid
+      # since the server started, by HTTP status code (400, 408, 413 and 414).
+      # The counters live in memory shared by all pitchfork processes.
+      def rejected_requests
+        SharedMemory.rejected_requests
+      end
+
       private
 
       def io_open?(io)
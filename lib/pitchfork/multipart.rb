@@ -0,0 +1,110 @@
+# -*- encoding: binary -*-
+
+module Pitchfork
+  # Parses multipart/form-data request bodies while they are read from the
+  # client, when Pitchfork::Configurator#parse_multipart is enabled.  File
+  # parts are written to their own Pitchfork::TmpIO as they arrive.
+  #
+  # The params are stored in the env where Rack::Request#POST looks for
+  # already parsed form data, in the same format as Rack's own multipart
+  # parser, and in env["pitchfork.multipart"].  "rack.input" is then
+  # empty.
+  class Multipart # :nodoc:
+    BOUNDARY = %r{\Amultipart/form-data.*;\s*boundary=(?:"([^"]{1,70})"|([^;,\s"]{1,70}))}ni
+    DISPOSITION = /^Content-Disposition:[ \t]*form-data([^\r\n]*)/ni
+    PARAM = /;\s*([\w*-]+)=(?:"((?:\\.|[^"\\])*)"|([^;\s]*))/n
+    CONTENT_TYPE = /^Content-Type:[ \t]*([^\r\n]*)/ni
+    CHARSET = /;\s*charset=\"?([\w-]+)/ni
+
+    # the same defaults as Rack::Multipart
+    PARTS_LIMIT = 4096
+    FILES_LIMIT = 128
+
+    # returns the boundary of a multipart/form-data +content_type+
+    def self.boundary(content_type)
+      BOUNDARY =~ content_type and ($1 || $2)
+    end
+
+    def initialize(env, boundary)
+      @env = env
+      @boundary = boundary
+      @params = {}
+      @parts = @files = 0
+      @name = @value = nil
+    end
+
+    # reads all of +input+, returns the params
+    def parse(input)
+      parser = MultipartParser.new(@boundary, self)
+      buf = String.new
+      parser.feed(buf) while input.read(Const::CHUNK_SIZE, buf)
+      parser.done? or raise MultipartParser::Error, "bad content body"
+      finish_part
+
+      @env["rack.request.form_input"] = @env["rack.input"] = HttpParser::NULL_IO
+      @env["rack.request.form_hash"] = @env["pitchfork.multipart"] = @params
+    end
+
+    # called by MultipartParser with the head of each part, returns
+    # where to store its data
+    def part(head)
+      finish_part
+      if (@parts += 1) > PARTS_LIMIT
+        raise RequestEntityTooLargeError, "more than #{PARTS_LIMIT} multipart parts"
+      end
+
+      params = {}
+      head =~ DISPOSITION and $1.scan(PARAM) do |key, quoted, token|
+        params[key.downcase] = quoted ? quoted.gsub(/\\(.)/n, '\1') : token
+      end
+      type = head =~ CONTENT_TYPE ? $1.strip : nil
+      @name = params["name"]
+      filename = params["filename"] || filename_star(params["filename*"])
+
+      if filename == ""
+        # no file was selected
+        @name = nil
+      elsif filename
+        if (@files += 1) > FILES_LIMIT
+          raise RequestEntityTooLargeError, "more than #{FILES_LIMIT} multipart files"
+        end
+        tmp = TmpIO.new
+        (@env["rack.tempfiles"] ||= []) << tmp
+        @value = { filename: basename(filename), type: type, name: @name,
+                   tempfile: tmp, head: head }
+        tmp
+      else
+        @value = String.new(encoding: charset(type))
+      end
+    end
+
+    private
+
+    def finish_part
+      name, value, @name, @value = @name, @value, nil, nil
+      return unless name
+
+      value[:tempfile].rewind if Hash === value
+      HttpParser.normalize_param(@params, name, value)
+    end
+
+    # RFC 5987 extended value, e.g. UTF-8''na%C3%AFve.txt
+    def filename_star(value)
+      return unless value && value =~ /\A([\w-]+)'[^']*'(.*)\z/n
+      encoding = charset("; charset=#$1")
+      $2.gsub(/%(\h\h)/n) { $1.hex.chr }.force_encoding(encoding)
+    end
+
+    # IE sends full Windows paths
+    def basename(filename)
+      filename = filename.dup.force_encoding(Encoding::UTF_8).scrub
+      filename.split(%r{[/\\]}).last || ""
+    end
+
+    def charset(type)
+      type && type =~ CHARSET ? Encoding.find($1) : Encoding::UTF_8
+    rescue ArgumentError
+      Encoding::UTF_8
+    end
+  end
+end
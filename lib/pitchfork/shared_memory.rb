@@ -10,7 +10,9 @@ module SharedMemory
     CURRENT_GENERATION_OFFSET = 0
     SHUTDOWN_OFFSET = 1
     MOLD_TICK_OFFSET = 2
-    WORKER_TICK_OFFSET = 3
+    REJECTED_REQUESTS_OFFSET = 3
+    REJECTED_REQUESTS_CODES = [400, 408, 413, 414].freeze
+    WORKER_TICK_OFFSET = REJECTED_REQUESTS_OFFSET + REJECTED_REQUESTS_CODES.size
 
     DROPS = [Raindrops.new(PER_DROP)]
 
@@ -30,6 +32,18 @@ def shutting_down?
       DROPS[0][SHUTDOWN_OFFSET] > 0
     end
 
+    def rejected_request!(code)
+      if index = REJECTED_REQUESTS_CODES.index(code)
+        DROPS[0].incr(REJECTED_REQUESTS_OFFSET + index)
+      end
+    end
+
+    def rejected_requests
+      REJECTED_REQUESTS_CODES.each_with_index.map do |code, index|
+        [code, DROPS[0][REJECTED_REQUESTS_OFFSET + index]]
+      end.to_h
+    end
+
     class Field
       def initialize(offset)
         @drop = DROPS.fetch(offset / PER_DROP)
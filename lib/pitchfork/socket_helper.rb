@@ -25,6 +25,17 @@ module SocketHelper
       :tcp_nodelay => true,
     }
 
+    # TCP_CORK in Linux or TCP_NOPUSH in FreeBSD, set by :tcp_nopush
+    NOPUSH = Socket.const_defined?(:TCP_CORK) ? :TCP_CORK :
+             Socket.const_defined?(:TCP_NOPUSH) ? :TCP_NOPUSH : nil
+
+    # sends out the partial frame a :tcp_nopush socket holds back, and
+    # keeps holding back what's written after
+    def tcp_nopush_flush(sock)
+      sock.setsockopt(:IPPROTO_TCP, NOPUSH, 0)
+      sock.setsockopt(:IPPROTO_TCP, NOPUSH, 1)
+    end
+
     # configure platform-specific options (only tested on Linux 2.6 so far)
     def accf_arg(af_name)
       [ af_name, nil ].pack('a16a240')
@@ -43,12 +54,8 @@ def set_tcp_sockopt(sock, opt)
       end
 
       val = opt[:tcp_nopush]
-      unless val.nil?
-        if Socket.const_defined?(:TCP_CORK) # Linux
-          sock.setsockopt(:IPPROTO_TCP, :TCP_CORK, val)
-        elsif Socket.const_defined?(:TCP_NOPUSH) # FreeBSD
-          sock.setsockopt(:IPPROTO_TCP, :TCP_NOPUSH, val)
-        end
+      if !val.nil? && NOPUSH
+        sock.setsockopt(:IPPROTO_TCP, NOPUSH, val)
       end
 
       # No good reason to ever have deferred accepts off in single-threaded
@@ -10,6 +10,19 @@ class StreamInput
     # The default is 16 kilobytes.
     @@io_chunk_size = Pitchfork::Const::CHUNK_SIZE # :nodoc:
 
+    # The minimum rate (in +bytes+ per second) at which clients must send
+    # request bodies, after a one second grace period.  Slower clients get
+    # a Pitchfork::RequestTimeoutError.  0 (the default) disables the check.
+    @@body_min_rate = 0 # :nodoc:
+
+    def self.body_min_rate=(bytes) # :nodoc:
+      @@body_min_rate = bytes
+    end
+
+    def self.body_min_rate # :nodoc:
+      @@body_min_rate
+    end
+
     # Initializes a new StreamInput object.  You normally do not have to call
     # this unless you are writing an HTTP server.
     def initialize(socket, request) # :nodoc:
@@ -19,6 +32,7 @@ def initialize(socket, request) # :nodoc:
       @buf = request.buf
       @rbuf = ''
       @bytes_read = 0
+      @started_at = nil # the first socket_read, for body_min_rate
       filter_body(@rbuf, @buf) unless @buf.empty?
     end
 
@@ -51,7 +65,7 @@ def read(length = nil, rv = '')
           rv.replace(@rbuf.slice!(0, @rbuf.size))
           until to_read == 0 || eof? || (rv.size > 0 && @chunked)
             begin
-              @socket.readpartial(to_read, @buf)
+              socket_read(to_read, @buf)
             rescue EOFError
               eof!
             end
@@ -87,7 +101,7 @@ def gets(sep = $/)
       begin
         @rbuf.sub!(re, '') and return $1
         return @rbuf.empty? ? nil : @rbuf.slice!(0, @rbuf.size) if eof?
-        @socket.readpartial(@@io_chunk_size, @buf) or eof!
+        socket_read(@@io_chunk_size, @buf) or eof!
         filter_body(once = '', @buf)
         @rbuf << once
       end while true
@@ -111,7 +125,7 @@ def each
     def eof?
       if @parser.body_eof?
         while @chunked && ! @parser.parse
-          once = @socket.readpartial(@@io_chunk_size) or eof!
+          once = socket_read(@@io_chunk_size) or eof!
           @buf << once
         end
         @socket = nil
@@ -131,7 +145,7 @@ def read_all(dst)
       dst.replace(@rbuf)
       @socket or return
       until eof?
-        @socket.readpartial(@@io_chunk_size, @buf) or eof!
+        socket_read(@@io_chunk_size, @buf) or eof!
         filter_body(@rbuf, @buf)
         dst << @rbuf
       end
@@ -139,6 +153,28 @@ def read_all(dst)
       @rbuf.clear
     end
 
+    # IO#readpartial, waiting no longer than body_min_rate allows
+    def socket_read(length, buf = nil)
+      return @socket.readpartial(length, buf) unless @@body_min_rate > 0
+
+      # the app may take a while before reading the body, and what came
+      # with the head doesn't count
+      unless @started_at
+        @started_at = Pitchfork.time_now
+        @started_bytes = @bytes_read
+      end
+      while (rv = @socket.read_nonblock(length, buf, exception: false)) == :wait_readable
+        wait = @started_at + 1 +
+               (@bytes_read - @started_bytes).fdiv(@@body_min_rate) -
+               Pitchfork.time_now
+        unless wait > 0 && @socket.wait_readable(wait)
+          raise Pitchfork::RequestTimeoutError,
+                "body_min_rate not met, bytes_read=#{@bytes_read}", []
+        end
+      end
+      rv or raise EOFError, "end of file reached", []
+    end
+
     def eof!
       # in case client only did a premature shutdown(SHUT_WR)
       # we do support clients that shutdown(SHUT_WR) after the
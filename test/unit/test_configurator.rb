@@ -111,6 +111,23 @@ def test_listen_option_bad
     end
   end
 
+  def test_listen_option_trusted_upstream
+    tmp = Tempfile.new('pitchfork_config')
+    listener = "127.0.0.1:12345"
+    tmp.syswrite("listen '#{listener}', trusted_upstream: true\n")
+    cfg = Pitchfork::Configurator.new(:config_file => tmp.path)
+    test_struct = TestStruct.new
+    cfg.commit!(test_struct)
+    assert_equal({ trusted_upstream: true }, test_struct.listener_opts[listener])
+
+    tmp.truncate(0)
+    tmp.rewind
+    tmp.syswrite("listen '#{listener}', trusted_upstream: 1\n")
+    assert_raises(ArgumentError) do
+      Pitchfork::Configurator.new(:config_file => tmp.path)
+    end
+  end
+
   def test_listen_option_bad_delay
     tmp = Tempfile.new('pitchfork_config')
     expect = { :delay => "five" }
@@ -160,6 +177,54 @@ def test_check_client_connection_with_tcp_bad
     end
   end
 
+  def test_keepalive
+    tmp = Tempfile.new('pitchfork_config')
+    test_struct = TestStruct.new
+    tmp.syswrite("keepalive_requests 100\nkeepalive_timeout 0.5\n")
+    Pitchfork::Configurator.new(:config_file => tmp.path).commit!(test_struct)
+    assert_equal 100, test_struct.keepalive_requests
+    assert_equal 0.5, test_struct.keepalive_timeout
+
+    [ "keepalive_requests 0", "keepalive_timeout 0", "keepalive_timeout '1'" ].each do |bad|
+      tmp = Tempfile.new('pitchfork_config')
+      tmp.syswrite("#{bad}\n")
+      assert_raises(ArgumentError) do
+        Pitchfork::Configurator.new(:config_file => tmp.path)
+      end
+    end
+  end
+
+  def test_decode_path
+    tmp = Tempfile.new('pitchfork_config')
+    test_struct = TestStruct.new
+    tmp.syswrite("decode_path :normalize\n")
+    Pitchfork::Configurator.new(:config_file => tmp.path).commit!(test_struct)
+    assert_equal :normalize, test_struct.decode_path
+
+    tmp = Tempfile.new('pitchfork_config')
+    tmp.syswrite("decode_path 'yes'\n")
+    assert_raises(ArgumentError) do
+      Pitchfork::Configurator.new(:config_file => tmp.path)
+    end
+  end
+
+  def test_static_route
+    tmp = Tempfile.new('pitchfork_config')
+    test_struct = TestStruct.new
+    tmp.syswrite("static_route '/_ping'\n")
+    tmp.syswrite("static_route '/_health', 200, {}, 'OK'\n")
+    Pitchfork::Configurator.new(:config_file => tmp.path).commit!(test_struct)
+    assert_equal({ "/_ping" => [200, {}, ""], "/_health" => [200, {}, "OK"] },
+                 test_struct.static_routes)
+    assert_equal({}, Pitchfork::Configurator::DEFAULTS[:static_routes])
+
+    tmp = Tempfile.new('pitchfork_config')
+    tmp.syswrite("static_route '_health'\n")
+    assert_raises(ArgumentError) do
+      Pitchfork::Configurator.new(:config_file => tmp.path)
+    end
+  end
+
   def test_after_worker_fork_proc
     test_struct = TestStruct.new
     [ proc { |a,b| }, Proc.new { |a,b| }, lambda { |a,b| } ].each do |my_proc|
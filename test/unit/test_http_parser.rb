@@ -879,5 +879,28 @@ def test_dedupe
         assert_same exp, key
       end
     end if RUBY_VERSION.to_r >= 2.5 && RUBY_ENGINE == 'ruby'
+
+    def test_intern_headers
+      keys = HttpParser.intern_headers(%w(X-Interned-Test X_INTERNED_OTHER Host))
+      assert_equal %w(HTTP_X_INTERNED_TEST HTTP_X_INTERNED_OTHER HTTP_HOST), keys
+      assert keys.all?(&:frozen?)
+      assert_same keys[0], HttpParser.intern_headers(%w(x-interned-test))[0]
+
+      parser = HttpParser.new
+      get = "GET / HTTP/1.1\r\nX-Interned-Test: a\r\nX-Interned-Other: b\r\n" \
+            "X-Interned-Test: c\r\n\r\n"
+      assert parser.add_parse(get)
+      assert_equal 'a,c', parser.env['HTTP_X_INTERNED_TEST']
+      assert_equal 'b', parser.env['HTTP_X_INTERNED_OTHER']
+      assert_same keys[0], parser.env.keys.detect { |k| k == keys[0] }
+      assert_same keys[1], parser.env.keys.detect { |k| k == keys[1] }
+    end
+
+    def test_intern_headers_invalid
+      [ '', 'X Space', 'X:Colon', 'Version', 'x' * 257 ].each do |name|
+        assert_raises(ArgumentError) { HttpParser.intern_headers([name]) }
+      end
+      assert_raises(TypeError) { HttpParser.intern_headers('X-Foo') }
+    end
   end
 end
@@ -23,6 +23,555 @@ def test_is_chunked
       end
     end
 
+    def test_header_value_cache
+      HttpParser.header_value_cache_size = 2
+      stats = HttpParser.header_value_cache_stats
+      req = "GET / HTTP/1.1\r\nAccept-Encoding: gzip  \r\nTE: a\r\n\r\n".freeze
+      env = @parser.add_parse(req)
+      assert_equal 'gzip', env['HTTP_ACCEPT_ENCODING']
+      assert_predicate env['HTTP_ACCEPT_ENCODING'], :frozen?
+      first = env['HTTP_ACCEPT_ENCODING']
+
+      @parser.clear
+      env = @parser.add_parse(req)
+      assert_same first, env['HTTP_ACCEPT_ENCODING']
+      assert_operator HttpParser.header_value_cache_stats[:hits], :>=, stats[:hits] + 2
+
+      # duplicates and continuation lines must not modify cached values
+      @parser.clear
+      env = @parser.add_parse("GET / HTTP/1.1\r\nAccept-Encoding: gzip\r\n" \
+                              "TE: a\r\n b\r\nAccept-Encoding: br\r\n\r\n")
+      assert_equal 'gzip,br', env['HTTP_ACCEPT_ENCODING']
+      assert_equal 'a b', env['HTTP_TE']
+      assert_equal 'gzip', first
+      @parser.clear
+      env = @parser.add_parse(req)
+      assert_equal 'a', env['HTTP_TE']
+
+      # uncommon headers are never cached
+      @parser.clear
+      env = @parser.add_parse("GET / HTTP/1.1\r\nX-Uncached: yes\r\n\r\n")
+      refute_predicate env['HTTP_X_UNCACHED'], :frozen?
+
+      # nor are credentials
+      2.times do
+        @parser.clear
+        env = @parser.add_parse("GET / HTTP/1.1\r\nCookie: s=1\r\n" \
+                                "Authorization: Bearer t\r\n\r\n")
+        refute_predicate env['HTTP_COOKIE'], :frozen?
+        refute_predicate env['HTTP_AUTHORIZATION'], :frozen?
+      end
+
+      assert_raises(ArgumentError) { HttpParser.header_value_cache_size = 17 }
+    ensure
+      HttpParser.header_value_cache_size = 0
+    end
+
+    def test_lazy_env
+      req = "GET / HTTP/1.1\r\nHost: example.com\r\nAccept: */*  \r\n" \
+            "X-Dup: a\r\nX-Dup: b\r\nX-Cont: c\r\n d\r\nCookie: k=v\r\n" \
+            "X-Forwarded-Proto: https\r\nUser-Agent: ua\r\n\r\n"
+      @parser.buf << req
+      eager = @parser.parse.dup
+
+      HttpParser.lazy_env = true
+      @parser.clear
+      env = @parser.add_parse(req)
+      assert_kind_of HttpParser::LazyEnv, env
+      assert_equal 'https', env['rack.url_scheme']
+      assert_equal 'example.com', env['SERVER_NAME']
+      assert_equal 'a,b', env['HTTP_X_DUP']
+      assert_equal 'c d', env['HTTP_X_CONT']
+      assert_equal '*/*', env['HTTP_ACCEPT']
+      refute_predicate env['HTTP_ACCEPT'], :frozen?
+      assert_equal 'k=v', env.fetch('HTTP_COOKIE')
+      assert_equal 1, env.fetch('HTTP_MISSING', 1)
+      assert_equal 'ua', env.delete('HTTP_USER_AGENT') { flunk }
+      assert_equal 'HTTP_USER_AGENT?', env.delete('HTTP_USER_AGENT') { |k| "#{k}?" }
+      assert_nil env.delete('HTTP_USER_AGENT')
+      env['HTTP_USER_AGENT'] = 'ua'
+      assert_equal eager, env.to_h
+      assert_equal eager, env
+
+      # the env is reused and must not leak the previous head
+      @parser.clear
+      env = @parser.add_parse("GET / HTTP/1.1\r\nAccept: text/html\r\n\r\n")
+      assert_equal 'text/html', env['HTTP_ACCEPT']
+      refute env.key?('HTTP_COOKIE')
+      env.each { |k, v| assert_kind_of String, v, k unless k.include?('.') }
+
+      HttpParser.lazy_env = false
+      @parser.clear
+      assert_instance_of Hash, @parser.env
+    ensure
+      HttpParser.lazy_env = false
+    end
+
+    def test_parse_cookies_header
+      {
+        nil => {},
+        "" => {},
+        "a=1; b=hello%20world+x;  c; a=2;;d=%zz;e=%E2%9C%93;=f;g=" => {
+          "a" => "1", "b" => "hello world x", "c" => nil, "d" => "%zz",
+          "e" => "\u2713", "" => "f", "g" => "",
+        },
+        " x=1 ;y=2%" => { " x" => "1 ", "y" => "2%" },
+        "a=b=c" => { "a" => "b=c" },
+      }.each do |header, expect|
+        cookies = HttpParser.parse_cookies_header(header)
+        assert_equal expect, cookies, header.inspect
+        assert_predicate cookies, :frozen?
+      end
+      assert_equal Encoding::UTF_8, HttpParser.parse_cookies_header("a=b")["a"].encoding
+    end
+
+    def test_parse_cookies
+      req = "GET / HTTP/1.1\r\nCookie: s=a%2Cb; t=1\r\nCookie: u=2\r\n\r\n"
+      refute HttpParser.parse_cookies
+      @parser.buf << req
+      refute @parser.parse.key?("pitchfork.cookies")
+
+      HttpParser.parse_cookies = true
+      [false, true].each do |lazy|
+        HttpParser.lazy_env = lazy
+        @parser = HttpParser.new
+        @parser.buf << req
+        env = @parser.parse
+        assert_equal({ "s" => "a,b", "t" => "1,u=2" }, env["pitchfork.cookies"])
+      end
+
+      @parser.clear
+      @parser.buf << "GET / HTTP/1.1\r\n\r\n"
+      assert_equal({}, @parser.parse["pitchfork.cookies"])
+    ensure
+      HttpParser.parse_cookies = false
+      HttpParser.lazy_env = false
+    end
+
+    def test_parse_query
+      {
+        nil => {},
+        "" => {},
+        "a=1&&b=2&  c=3" => { "a" => "1", "b" => "2", "c" => "3" },
+        "a&b=&=c" => { "a" => nil, "b" => "" },
+        "a+b=c+d%21" => { "a b" => "c d!" },
+        "a[]=1&a[]=2" => { "a" => [ "1", "2" ] },
+        "a[b][c]=1&a[b][d]=2" => { "a" => { "b" => { "c" => "1", "d" => "2" } } },
+        "x[][y]=1&x[][z]=2&x[][y]=3" => { "x" => [ { "y" => "1", "z" => "2" }, { "y" => "3" } ] },
+        "a[][]=1" => { "a" => [ [ "1" ] ] },
+        "a[=1&b]=2" => { "a[" => "1", "b]" => "2" },
+        "a%5Bb%5D=1" => { "a" => { "b" => "1" } },
+      }.each do |query, expect|
+        assert_equal expect, HttpParser.parse_query(query), query.inspect
+      end
+
+      assert_raises(HttpParser::InvalidParameterError) { HttpParser.parse_query("a=%zz") }
+      assert_raises(HttpParser::ParameterTypeError) { HttpParser.parse_query("a=1&a[]=2") }
+      assert_raises(HttpParser::ParameterTypeError) { HttpParser.parse_query("a[]=1&a[b]=2") }
+      assert_raises(HttpParser::ParamsTooDeepError) do
+        HttpParser.parse_query("a#{"[b]" * 32}=1")
+      end
+      assert_raises(HttpParser::QueryLimitError) { HttpParser.parse_query("a&" * 4096) }
+    end
+
+    def test_query_params
+      req = "GET /?a[b]=1&c=2 HTTP/1.1\r\n\r\n"
+      @parser.buf << req
+      assert_nil @parser.parse["pitchfork.query_params"]
+
+      HttpParser.query_params = true
+      [false, true].each do |lazy|
+        HttpParser.lazy_env = lazy
+        @parser = HttpParser.new
+        @parser.buf << req
+        env = @parser.parse
+        params = env.fetch("pitchfork.query_params")
+        assert_equal({ "a" => { "b" => "1" }, "c" => "2" }, params)
+        assert_nil env.default_proc
+        Marshal.dump(env.reject { |_, v| IO === v }) # rack.errors can't be
+      end
+
+      # left for the app to fail on, like Rack::Request#GET
+      @parser = HttpParser.new
+      @parser.buf << "GET /?a=1&a[]=2 HTTP/1.1\r\n\r\n"
+      refute @parser.parse.key?("pitchfork.query_params")
+    ensure
+      HttpParser.query_params = false
+      HttpParser.lazy_env = false
+    end
+
+    def test_unescape_path
+      {
+        "/a%20b+c" => "/a b+c",
+        "/%E2%9C%93/%zz/%4" => "/\u2713/%zz/%4",
+        "/a%2Fb" => "/a/b",
+        "" => "",
+      }.each do |path, expect|
+        assert_equal expect, HttpParser.unescape_path(path), path.inspect
+      end
+      assert_nil HttpParser.unescape_path("/%FF")
+      assert_equal Encoding::UTF_8, HttpParser.unescape_path("/a").encoding
+      assert_predicate HttpParser.unescape_path("/a"), :frozen?
+
+      {
+        "/a/b/c/./../../g" => "/a/g",
+        "/a/%2E%2E/b/./c" => "/b/c",
+        "/../../x" => "/x",
+        "/a/.." => "/",
+        "/a/." => "/a/",
+        "/a/..b/.c" => "/a/..b/.c",
+        "mid/content=5/../6" => "mid/6",
+      }.each do |path, expect|
+        assert_equal expect, HttpParser.unescape_path(path, true), path.inspect
+      end
+    end
+
+    def test_decode_path
+      req = "GET /a%20b/../c?x=%20 HTTP/1.1\r\n\r\n"
+      refute HttpParser.decode_path
+      @parser.buf << req
+      refute @parser.parse.key?("pitchfork.path_decoded")
+
+      [true, :normalize].each do |value|
+        HttpParser.decode_path = value
+        assert_equal value, HttpParser.decode_path
+        [false, true].each do |trusted|
+          @parser = HttpParser.new
+          @parser.trusted_upstream = trusted
+          @parser.buf << req
+          env = @parser.parse
+          assert_equal "/a%20b/../c", env["PATH_INFO"]
+          expect = value == :normalize ? "/c" : "/a b/../c"
+          assert_equal expect, env["pitchfork.path_decoded"]
+        end
+      end
+
+      @parser.clear
+      @parser.buf << "GET /%C0 HTTP/1.1\r\n\r\n"
+      env = @parser.parse
+      assert env.key?("pitchfork.path_decoded")
+      assert_nil env["pitchfork.path_decoded"]
+
+      assert_raises(ArgumentError) { HttpParser.decode_path = :yes }
+    ensure
+      HttpParser.decode_path = false
+    end
+
+    def test_trusted_proxies
+      req = "GET / HTTP/1.1\r\n" \
+            "X-Forwarded-For: 203.0.113.7, 198.51.100.1:4711 , 10.1.2.3\r\n" \
+            "X-Real-IP: 192.0.2.1\r\n\r\n"
+      @parser.buf << req
+      @parser.parse
+      assert_equal "192.168.0.1", @parser.remote_addr!("192.168.0.1")
+      assert_equal "192.168.0.1", @parser.env["REMOTE_ADDR"]
+
+      HttpParser.trusted_proxies = ["10.0.0.0/8", "192.168.0.1", "2001:db8::/32"]
+      assert_equal ["10.0.0.0/8", "192.168.0.1", "2001:db8::/32"], HttpParser.trusted_proxies
+      [false, true].each do |lazy|
+        HttpParser.lazy_env = lazy
+        @parser = HttpParser.new
+        @parser.buf << req
+        @parser.parse
+        assert_equal "198.51.100.1", @parser.remote_addr!("192.168.0.1")
+        assert_equal "198.51.100.1", @parser.remote_addr!("::ffff:10.0.0.1")
+        assert_equal "192.168.0.2", @parser.remote_addr!("192.168.0.2")
+      end
+
+      HttpParser.trusted_proxies = ["0.0.0.0/0", "::/0"]
+      assert_equal "203.0.113.7", @parser.remote_addr!("2001:db8::1")
+
+      @parser.clear
+      @parser.buf << "GET / HTTP/1.1\r\nX-Real-IP: [2001:DB8::0:2]:80\r\n\r\n"
+      @parser.parse
+      addr = @parser.remote_addr!("10.0.0.1")
+      assert_equal "2001:db8::2", addr
+      assert_predicate addr, :frozen?
+
+      @parser.clear
+      @parser.buf << "GET / HTTP/1.1\r\nX-Forwarded-For: unknown, 10.9.9.9\r\n\r\n"
+      @parser.parse
+      assert_equal "10.9.9.9", @parser.remote_addr!("10.0.0.1")
+
+      TCPServer.open("127.0.0.1", 0) do |srv|
+        HttpParser.trusted_proxies = ["127.0.0.1/32"]
+        client = TCPSocket.new("127.0.0.1", srv.addr[1])
+        client.write("GET / HTTP/1.1\r\nX-Forwarded-For: 192.0.2.9\r\n\r\n")
+        sock = srv.accept
+        env = HttpParser.new.read(sock)
+        assert_equal "192.0.2.9", env["REMOTE_ADDR"]
+
+        HttpParser.trusted_proxies = []
+        client.write("GET / HTTP/1.1\r\nX-Forwarded-For: 192.0.2.9\r\n\r\n")
+        env = HttpParser.new.read(sock)
+        assert_equal "127.0.0.1", env["REMOTE_ADDR"]
+      ensure
+        client&.close
+        sock&.close
+      end
+
+      %w(10.0.0.0/33 ::/129 10.0.0.0/ nope 10.0.0.0/8x).each do |bad|
+        assert_raises(ArgumentError, bad) { HttpParser.trusted_proxies = [bad] }
+      end
+      assert_raises(TypeError) { HttpParser.trusted_proxies = [nil] }
+    ensure
+      HttpParser.trusted_proxies = []
+      HttpParser.lazy_env = false
+    end
+
+    UUID7 = /\A\h{8}-\h{4}-7\h{3}-[89ab]\h{3}-\h{12}\z/
+
+    def test_uuid7
+      ids = Array.new(1000) { HttpParser.uuid7 }
+      assert_equal ids.size, ids.uniq.size
+      ids.each do |id|
+        assert_match UUID7, id
+        assert_predicate id, :frozen?
+      end
+      ms = Integer(ids[0].delete("-")[0, 12], 16)
+      assert_in_delta Process.clock_gettime(Process::CLOCK_REALTIME, :millisecond), ms, 10_000
+
+      rd, wr = IO.pipe
+      pid = fork { HttpParser.reseed_request_ids; wr.write(HttpParser.uuid7); exit!(0) }
+      wr.close
+      child = rd.read
+      Process.wait(pid)
+      refute_equal child[14..-1], HttpParser.uuid7[14..-1]
+    end
+
+    def test_request_context
+      trace = "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01"
+      req = "GET / HTTP/1.1\r\ntraceparent: #{trace}\r\nX-Request-Id: abc-123@x\r\n\r\n"
+      @parser.buf << req
+      refute @parser.parse.key?("pitchfork.request_id")
+
+      HttpParser.request_context = true
+      [false, true].each do |lazy|
+        HttpParser.lazy_env = lazy
+        @parser = HttpParser.new
+        @parser.buf << req
+        env = @parser.parse
+        assert_equal "abc-123@x", env["pitchfork.request_id"]
+        assert_equal "4bf92f3577b34da6a3ce929d0e0e4736", env["pitchfork.trace_id"]
+        assert_equal "00f067aa0ba902b7", env["pitchfork.parent_id"]
+        assert_equal "01", env["pitchfork.trace_flags"]
+        %w(request_id trace_id parent_id trace_flags).each do |key|
+          assert_predicate env["pitchfork.#{key}"], :frozen?
+        end
+      end
+
+      [
+        "#{trace}-future",
+        "ff-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01",
+        "00-00000000000000000000000000000000-00f067aa0ba902b7-01",
+        "00-4bf92f3577b34da6a3ce929d0e0e4736-0000000000000000-01",
+        "00-4BF92F3577B34DA6A3CE929D0E0E4736-00f067aa0ba902b7-01",
+        "00-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7",
+        "01-4bf92f3577b34da6a3ce929d0e0e4736-00f067aa0ba902b7-01x",
+      ].each do |bad|
+        @parser.clear
+        @parser.buf << "GET / HTTP/1.1\r\ntraceparent: #{bad}\r\nX-Request-Id: a b\r\n\r\n"
+        env = @parser.parse
+        refute env.key?("pitchfork.trace_id"), bad
+        assert_match UUID7, env["pitchfork.request_id"]
+      end
+
+      @parser.clear
+      @parser.buf << "GET / HTTP/1.1\r\ntraceparent: 01-#{trace[3..-1]}-what\r\n\r\n"
+      env = @parser.parse
+      assert_equal "4bf92f3577b34da6a3ce929d0e0e4736", env["pitchfork.trace_id"]
+
+      @parser.clear
+      @parser.buf << "GET / HTTP/1.1\r\nX-Request-Id: #{"a" * 256}\r\n\r\n"
+      assert_match UUID7, @parser.parse["pitchfork.request_id"]
+    ensure
+      HttpParser.request_context = false
+      HttpParser.lazy_env = false
+    end
+
+    def test_env_template
+      env = @parser.env
+      assert_equal HttpParser::DEFAULTS, env
+      refute_predicate env, :frozen?
+      env['SCRIPT_NAME'] = '/mounted'
+      env['rack.hijack?'] = false
+      assert_equal HttpParser::DEFAULTS, HttpParser.new.env
+
+      @parser.buf << "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n"
+      env = @parser.parse
+      assert_equal '/mounted', env['SCRIPT_NAME']
+      @parser.clear
+      assert_equal HttpParser::DEFAULTS, @parser.env
+    end
+
+    def test_env_template_defaults_changed
+      @parser.buf << "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n"
+      assert @parser.parse
+      logger = Object.new
+      HttpParser::DEFAULTS["rack.logger"] = logger
+      @parser.clear
+      assert_same logger, @parser.env["rack.logger"]
+      assert_same logger, HttpParser.new.env["rack.logger"]
+
+      HttpParser::DEFAULTS.delete("rack.logger")
+      @parser.clear
+      refute @parser.env.key?("rack.logger")
+
+      HttpParser::DEFAULTS.merge!("rack.logger" => logger)
+      assert_same logger, HttpParser.new.env["rack.logger"]
+    ensure
+      HttpParser::DEFAULTS.delete("rack.logger")
+    end
+
+    def test_static_routes
+      response = [ "200 OK\r\n", "OK" ].freeze
+      HttpParser.static_routes = { "/_health" => response, "/_ping" => :pong }
+      assert_equal({ "/_health" => 0, "/_ping" => 0 }, HttpParser.static_route_hits)
+
+      [
+        [ "GET /_health HTTP/1.1\r\n\r\n", response ],
+        [ "HEAD /_health?full HTTP/1.0\r\n\r\n", response ],
+        [ "GET /_ping HTTP/1.1\r\n\r\n", :pong ],
+        [ "GET /_health/ HTTP/1.1\r\n\r\n", nil ],
+        [ "POST /_health HTTP/1.1\r\n\r\n", nil ],
+        [ "GET /_health HTTP/1.1\r\nContent-Length: 1\r\n\r\nx", nil ],
+      ].each do |req, expect|
+        @parser.clear
+        @parser.buf << req
+        assert @parser.parse, req
+        if expect
+          assert_same expect, @parser.static_response, req
+        else
+          assert_nil @parser.static_response, req
+        end
+      end
+      assert_equal({ "/_health" => 2, "/_ping" => 1 }, HttpParser.static_route_hits)
+
+      @parser.clear
+      assert_nil @parser.static_response
+    ensure
+      HttpParser.static_routes = {}
+    end
+
+    def test_static_routes_compaction
+      GC.respond_to?(:verify_compaction_references) or return
+      HttpParser.static_routes = { "/_health" => [ "200 OK\r\n", "OK" ] }
+      GC.verify_compaction_references(expand_heap: true, toward: :empty)
+
+      @parser.buf << "GET /_health HTTP/1.1\r\n\r\n"
+      assert @parser.parse
+      assert_equal [ "200 OK\r\n", "OK" ], @parser.static_response
+      assert_equal({ "/_health" => 1 }, HttpParser.static_route_hits)
+    ensure
+      HttpParser.static_routes = {}
+    end
+
+    def test_trusted_upstream
+      refute_predicate @parser, :trusted_upstream?
+      trusted = HttpParser.new
+      trusted.trusted_upstream = true
+      trusted.clear
+      assert_predicate trusted, :trusted_upstream?
+
+      [
+        "GET / HTTP/1.1\r\n\r\n",
+        "GET /a;b?c=d#e HTTP/1.0\nHost: example.com:81\nX-Foo:   bar  \nEmpty:\n\n",
+        "OPTIONS * HTTP/1.1\r\nHost: example.com\r\n\r\n",
+        "POST / HTTP/1.1\r\nContent-Length: 3\r\nConnection: close\r\n\r\nabc",
+        "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n",
+        "GET / HTTP/1.1\r\nCookie: a=b\r\nCookie: c=d\r\nX-Forwarded-Proto: https\r\n\r\n",
+        # the strict parser deals with these
+        "GET http://example.com/ HTTP/1.1\r\n\r\n",
+        "GET /\r\n",
+        "GET / HTTP/1.1\r\nX-Foo: a\r\n b\r\n\r\n",
+      ].each do |req|
+        @parser.clear
+        @parser.buf.replace(req)
+        trusted.clear
+        trusted.buf.replace(req)
+        assert_equal @parser.parse, trusted.parse, req
+        assert_equal @parser.buf, trusted.buf, req
+        assert_equal @parser.keepalive?, trusted.keepalive?, req
+        assert_equal @parser.content_length, trusted.content_length, req
+      end
+
+      trusted.clear
+      trusted.buf.clear
+      assert_nil trusted.add_parse("GET / HTTP/1.1\r\nHost: a")
+      assert_nil trusted.add_parse("\r\n")
+      assert_equal "a", trusted.add_parse("\r\n")["HTTP_HOST"]
+
+      trusted.clear
+      trusted.buf.replace("G" * (1024 * 113))
+      assert_raises(Pitchfork::RequestEntityTooLargeError) { trusted.parse }
+    end
+
+    def test_scanners_agree
+      default = HttpParser.scanner
+      long = "a-Z_9" * 20
+      reqs = [
+        "#{long}: #{long}",
+        "#{long}!x: v",
+        "X-#{long}: \t lead\ttab \xff\x80 #{long} trail \t",
+        "X-Ctl: #{long}\x01#{long}",
+        "X-Del: #{long}\x7f",
+        "X-Lf: #{long}\n",
+        "X-Cont: #{long}\r\n \t#{long}",
+        "#{long}: ",
+        "#{long}:",
+      ].map { |h| "GET / HTTP/1.1\r\n#{h}\r\n\r\n".b }
+      reqs.concat(reqs.map { |r| r[0, r.size - 3] })
+
+      expect = reqs.map do |req|
+        HttpParser.scanner = :scalar
+        parser = HttpParser.new
+        parser.buf << req
+        (parser.parse || :partial) rescue $!.class
+      end
+      %w(sse42 avx2).each do |name|
+        begin
+          HttpParser.scanner = name.to_sym
+        rescue ArgumentError
+          next
+        end
+        reqs.each_with_index do |req, i|
+          parser = HttpParser.new
+          parser.buf << req
+          got = (parser.parse || :partial) rescue $!.class
+          assert_equal expect[i], got, "#{name} #{req.inspect}"
+        end
+      end
+    ensure
+      HttpParser.scanner = default
+    end
+
+    def test_request_line_strings
+      env = @parser.add_parse("GET /a/b;c?d=e&f HTTP/1.1\r\n\r\n")
+      assert_equal "/a/b;c?d=e&f", env["REQUEST_URI"]
+      assert_predicate env["REQUEST_URI"], :frozen?
+      assert_equal "/a/b;c", env["REQUEST_PATH"]
+      assert_same env["REQUEST_PATH"], env["PATH_INFO"]
+      assert_equal "d=e&f", env["QUERY_STRING"]
+      refute_predicate env["PATH_INFO"], :frozen?
+      refute_predicate env["QUERY_STRING"], :frozen?
+      method = env["REQUEST_METHOD"]
+      assert_predicate method, :frozen?
+
+      @parser.clear
+      env = @parser.add_parse("GET /?#frag HTTP/1.1\r\n\r\n")
+      assert_same method, env["REQUEST_METHOD"]
+      assert_equal "/?", env["REQUEST_URI"]
+      assert_equal "", env["QUERY_STRING"]
+      assert_equal "frag", env["FRAGMENT"]
+
+      @parser.clear
+      env = @parser.add_parse("PURGE http://example.com/x?y HTTP/1.1\r\n\r\n")
+      assert_equal "PURGE", env["REQUEST_METHOD"]
+      assert_equal "/x?y", env["REQUEST_URI"]
+      assert_equal "/x", env["PATH_INFO"]
+      assert_equal "y", env["QUERY_STRING"]
+    end
+
     def test_parser_max_len
       assert_raises(RangeError) do
         HttpParser.max_header_len = 0xffffffff + 1
@@ -67,7 +616,7 @@ def test_connection_TE
 
     def test_keepalive_requests_with_next?
       req = "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n".freeze
-      expect = {
+      expect = HttpParser::DEFAULTS.merge({
         "SERVER_NAME" => "example.com",
         "HTTP_HOST" => "example.com",
         "rack.url_scheme" => "http",
@@ -79,7 +628,7 @@ def test_keepalive_requests_with_next?
         "SERVER_PORT" => "80",
         "REQUEST_METHOD" => "GET",
         "QUERY_STRING" => ""
-      }.freeze
+      }).freeze
       100.times do |nr|
         @parser.buf << req
         assert_equal expect, @parser.parse
@@ -495,7 +1044,7 @@ def test_parse_simple_request
       parser.buf << "GET /read-rfc1945-if-you-dont-believe-me\r\n"
       assert_equal req, parser.parse
       assert_equal '', parser.buf
-      expect = {
+      expect = HttpParser::DEFAULTS.merge({
         "SERVER_NAME"=>"localhost",
         "rack.url_scheme"=>"http",
         "REQUEST_PATH"=>"/read-rfc1945-if-you-dont-believe-me",
@@ -505,7 +1054,7 @@ def test_parse_simple_request
         "SERVER_PROTOCOL"=>"HTTP/0.9",
         "REQUEST_METHOD"=>"GET",
         "QUERY_STRING"=>""
-      }
+      })
       assert_equal expect, req
       assert ! parser.headers?
     end
@@ -656,12 +1205,34 @@ def test_backtrace_is_empty
       assert false, "should never get here line:#{__LINE__}"
     end
 
+    def test_parser_errors_are_reused
+      errors = 2.times.map do
+        @parser.clear
+        @parser.buf << "GARBAGE\r\n\r\n"
+        assert_raises(HttpParserError) { @parser.parse }
+      end
+      assert_same errors[0], errors[1]
+      assert_equal [], errors[1].backtrace
+      assert_predicate errors[1].message, :frozen?
+
+      # no cause from (or to) an exception being handled
+      begin
+        raise "outer"
+      rescue
+        @parser.clear
+        @parser.buf << "GARBAGE\r\n\r\n"
+        e = assert_raises(HttpParserError) { @parser.parse }
+        refute_same errors[0], e
+      end
+      assert_nil errors[0].cause
+    end
+
     def test_ignore_version_header
       @parser.buf << "GET / HTTP/1.1\r\nVersion: hello\r\n\r\n"
       req = @parser.env
       assert_equal req, @parser.parse
       assert_equal '', @parser.buf
-      expect = {
+      expect = HttpParser::DEFAULTS.merge({
         "SERVER_NAME" => "localhost",
         "rack.url_scheme" => "http",
         "REQUEST_PATH" => "/",
@@ -672,13 +1243,13 @@ def test_ignore_version_header
         "SERVER_PORT" => "80",
         "REQUEST_METHOD" => "GET",
         "QUERY_STRING" => ""
-      }
+      })
       assert_equal expect, req
     end
 
     def test_pipelined_requests
       host = "example.com"
-      expect = {
+      expect = HttpParser::DEFAULTS.merge({
         "HTTP_HOST" => host,
         "SERVER_NAME" => host,
         "REQUEST_PATH" => "/",
@@ -690,7 +1261,7 @@ def test_pipelined_requests
         "SERVER_PORT" => "80",
         "REQUEST_METHOD" => "GET",
         "QUERY_STRING" => ""
-      }
+      })
       req1 = "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n"
       req2 = "GET / HTTP/1.1\r\nHost: www.example.com\r\n\r\n"
       @parser.buf << (req1 + req2)
@@ -34,4 +34,15 @@ def test_close_all_ios_except_marked_ones
       false, # w
     ], info)
   end
+
+  def test_rejected_requests
+    before = Pitchfork::Info.rejected_requests
+    assert_equal [400, 408, 413, 414], before.keys
+
+    Pitchfork::SharedMemory.rejected_request!(414)
+    Pitchfork::SharedMemory.rejected_request!(500)
+    after = Pitchfork::Info.rejected_requests
+    assert_equal before[400], after[400]
+    assert_equal before[414] + 1, after[414]
+  end
 end
@@ -0,0 +1,170 @@
+# -*- encoding: binary -*-
+
+require 'test_helper'
+
+class TestMultipart < Pitchfork::Test
+  BOUNDARY = "----WebKitFormBoundary7MA4YWxkTrZu0gW"
+
+  # collects parts like Pitchfork::Multipart, without tempfiles
+  class Collector
+    attr_reader :parts
+
+    def initialize
+      @parts = []
+    end
+
+    def part(head)
+      @parts << [head, String.new]
+      @parts.last[1]
+    end
+  end
+
+  def setup
+    @body = "preamble\r\n" \
+            "--#{BOUNDARY}\r\n" \
+            "Content-Disposition: form-data; name=\"user[name]\"\r\n" \
+            "\r\n" \
+            "Jane\r\n" \
+            "--#{BOUNDARY}  \r\n" \
+            "Content-Disposition: form-data; name=\"tags[]\"\r\n" \
+            "\r\n" \
+            "a\r\n\r\n--#{BOUNDARY[0, 10]}\r\n" \
+            "--#{BOUNDARY}\r\n" \
+            "Content-Disposition: form-data; name=\"tags[]\"\r\n" \
+            "\r\n" \
+            "\r\n" \
+            "--#{BOUNDARY}\r\n" \
+            "Content-Disposition: form-data; name=\"file\"; filename=\"C:\\\\dir\\\\a \\\"b\\\".txt\"\r\n" \
+            "Content-Type: text/plain\r\n" \
+            "\r\n" \
+            "#{"x\r" * 10_000}\r\n" \
+            "--#{BOUNDARY}\r\n" \
+            "Content-Disposition: form-data; name=\"none\"; filename=\"\"\r\n" \
+            "Content-Type: application/octet-stream\r\n" \
+            "\r\n" \
+            "\r\n" \
+            "--#{BOUNDARY}--\r\n" \
+            "epilogue"
+    @rd, @wr = UNIXSocket.pair
+  end
+
+  def teardown
+    @rd.close unless @rd.closed?
+    @wr.close unless @wr.closed?
+  end
+
+  def test_boundary
+    assert_equal "abc", Pitchfork::Multipart.boundary("multipart/form-data; boundary=abc")
+    assert_equal "a b", Pitchfork::Multipart.boundary('multipart/form-data; charset=utf-8; boundary="a b"')
+    assert_nil Pitchfork::Multipart.boundary("multipart/mixed; boundary=abc")
+    assert_nil Pitchfork::Multipart.boundary("multipart/form-data")
+    assert_nil Pitchfork::Multipart.boundary(nil)
+  end
+
+  def test_parser_any_split
+    expect = collect([@body])
+    assert_equal 5, expect.size
+    assert_equal "Jane", expect[0][1]
+    assert_equal "a\r\n\r\n--#{BOUNDARY[0, 10]}", expect[1][1]
+    assert_equal "", expect[2][1]
+    assert_equal "x\r" * 10_000, expect[3][1]
+    assert_equal "Content-Type: application/octet-stream\r\n", expect[4][0].lines.last
+
+    (1...@body.size).step(7) do |i|
+      assert_equal expect, collect([@body[0, i], @body[i..-1]]), i
+    end
+    assert_equal expect, collect(@body.chars)
+  end
+
+  def test_parser_no_preamble
+    body = "--b\r\n\r\nx\r\n--b--"
+    assert_equal [["", "x"]], collect([body], "b")
+  end
+
+  def test_parser_errors
+    h = Collector.new
+    parser = Pitchfork::MultipartParser.new("b", h)
+    assert_raises(Pitchfork::MultipartParser::Error) { parser.feed("--b junk\r\n") }
+    assert_operator Pitchfork::MultipartParser::Error, :<, Pitchfork::HttpParserError
+
+    parser = Pitchfork::MultipartParser.new("b", h)
+    assert_raises(Pitchfork::RequestEntityTooLargeError) do
+      parser.feed("--b\r\n" + "X-Pad: #{"x" * 16384}\r\n")
+    end
+
+    parser = Pitchfork::MultipartParser.new("b", h, 4)
+    parser.feed("--b\r\n\r\nxx\r\n--b\r\n\r\nxx")
+    assert_raises(Pitchfork::RequestEntityTooLargeError) { parser.feed("x\r\n--b--") }
+    assert_equal 16 * 1024 * 1024, Pitchfork::MultipartParser::BUFFERED_MAX
+
+    parser = Pitchfork::MultipartParser.new("b", h)
+    assert_equal false, parser.feed("--b\r\n\r\nx\r\n--b")
+    assert_equal false, parser.done?
+    assert_equal true, parser.feed("--")
+    assert_equal true, parser.done?
+  end
+
+  def test_read
+    env = read_request(@body)
+    params = env["pitchfork.multipart"]
+    assert_same params, env["rack.request.form_hash"]
+    assert_same Pitchfork::HttpParser::NULL_IO, env["rack.input"]
+    assert_equal({ "name" => "Jane" }, params["user"])
+    assert_equal ["a\r\n\r\n--#{BOUNDARY[0, 10]}", ""], params["tags"]
+    assert_equal Encoding::UTF_8, params["tags"][0].encoding
+    refute params.key?("none")
+
+    file = params["file"]
+    assert_equal 'a "b".txt', file[:filename]
+    assert_equal "text/plain", file[:type]
+    assert_equal "file", file[:name]
+    assert_kind_of Pitchfork::TmpIO, file[:tempfile]
+    assert_equal "x\r" * 10_000, file[:tempfile].read
+    assert_equal [file[:tempfile]], env["rack.tempfiles"]
+  ensure
+    env["rack.tempfiles"]&.each(&:close)
+  end
+
+  def test_read_truncated
+    assert_raises(Pitchfork::MultipartParser::Error) do
+      read_request(@body[0, @body.index("--#{BOUNDARY}--")])
+    end
+  end
+
+  def test_read_disabled
+    env = read_request(@body, false)
+    assert_nil env["pitchfork.multipart"]
+    assert_equal @body, env["rack.input"].read
+  end
+
+  def test_read_expect_continue
+    # the body only comes once the app sends 100 Continue
+    env = read_request(@body, true, "Expect: 100-continue\r\n")
+    assert_nil env["pitchfork.multipart"]
+    assert_equal @body, env["rack.input"].read
+  end
+
+  private
+
+  def collect(chunks, boundary = BOUNDARY)
+    h = Collector.new
+    parser = Pitchfork::MultipartParser.new(boundary, h)
+    done = chunks.map { |c| parser.feed(c.dup) }
+    assert_equal true, done.last
+    h.parts
+  end
+
+  def read_request(body, parse_multipart = true, head = "")
+    Pitchfork::HttpParser.parse_multipart = parse_multipart
+    @wr.write("POST /upload HTTP/1.1\r\n" \
+              "Host: example.com\r\n#{head}" \
+              "Content-Type: multipart/form-data; boundary=#{BOUNDARY}\r\n" \
+              "Content-Length: #{body.bytesize}\r\n" \
+              "\r\n")
+    th = Thread.new { @wr.write(body); @wr.close }
+    Pitchfork::HttpParser.new.read(@rd)
+  ensure
+    th&.join
+    Pitchfork::HttpParser.parse_multipart = false
+  end
+end
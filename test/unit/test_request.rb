@@ -23,6 +23,74 @@ def setup
       @lint = Rack::Lint.new(@app)
     end
 
+    def test_read_buffered
+      req = "GET /a HTTP/1.1\r\nHost: foo\r\n\r\n"
+      client = MockRequest.new("")
+      @request.buf << req << req[0, 10]
+      env = @request.read(client)
+      assert_equal '/a', env['PATH_INFO']
+      assert @request.keepalive?
+      assert_equal req[0, 10], @request.buf
+
+      client = MockRequest.new(req[10..-1])
+      request = HttpParser.new
+      request.buf << @request.buf
+      env = request.read(client)
+      assert_equal '/a', env['PATH_INFO']
+      assert_equal '', request.buf
+    end
+
+    def test_read_head_from_socket
+      a, b = UNIXSocket.pair
+      head = "GET /slow HTTP/1.1\r\nHost: foo\r\nX-A: b\r\n\r\n"
+      writer = Thread.new do
+        head.each_char.each_slice(7) do |chars|
+          b.write(chars.join)
+          sleep 0.001
+        end
+        b.write("GET /next")
+      end
+      env = @request.read(a)
+      assert_equal '/slow', env['PATH_INFO']
+      assert_equal 'b', env['HTTP_X_A']
+      assert_equal '127.0.0.1', env['REMOTE_ADDR']
+      writer.join
+
+      b.close
+      request = HttpParser.new
+      request.buf << @request.buf
+      assert_raises(EOFError) { request.read(a) }
+      assert_equal 'GET /next', request.buf
+    ensure
+      a.close if a && !a.closed?
+      b.close if b && !b.closed?
+    end
+
+    def test_header_read_timeout
+      HttpParser.header_read_timeout = 0.1
+      assert_equal 0.1, HttpParser.header_read_timeout
+      a, b = UNIXSocket.pair
+      b.write("GET / HTTP/1.1\r\nHost: foo\r\n")
+      t0 = Pitchfork.time_now
+      assert_raises(RequestTimeoutError) { @request.read(a) }
+      assert_operator Pitchfork.time_now - t0, :>=, 0.09
+    ensure
+      HttpParser.header_read_timeout = 0
+      a.close if a
+      b.close if b
+    end
+
+    def test_header_read_timeout_resolution
+      HttpParser.header_read_timeout = 0.0001
+      assert_equal 0.001, HttpParser.header_read_timeout
+      HttpParser.header_read_timeout = 0
+      assert_equal 0.0, HttpParser.header_read_timeout
+      assert_raises(ArgumentError) { HttpParser.header_read_timeout = Float::NAN }
+      assert_raises(ArgumentError) { HttpParser.header_read_timeout = -1 }
+    ensure
+      HttpParser.header_read_timeout = 0
+    end
+
     def test_options
       client = MockRequest.new("OPTIONS * HTTP/1.1\r\n" \
                                "Host: foo\r\n\r\n")
@@ -79,6 +79,281 @@ def test_status_header_added
       assert ! out.closed?
     end
 
+    def test_keepalive
+      out = StringIO.new
+      assert_equal true, http_response_write(out, 200, {"Content-Length" => "2"}, ["ok"],
+                                             HttpParser.new, true)
+      assert_match(/^Connection: keep-alive\r\n\r\nok\z/, out.string)
+
+      out = StringIO.new
+      assert_equal true, http_response_write(out, 304, {}, [], HttpParser.new, true)
+      assert_match(/^Connection: keep-alive\r\n/, out.string)
+    end
+
+    def test_keepalive_refused
+      [
+        {},
+        { "content-length" => "0", "connection" => "close" },
+        { "content-length" => "0", "rack.hijack" => lambda { |io| } },
+      ].each do |headers|
+        out = StringIO.new
+        assert_equal false, http_response_write(out, 200, headers, [], HttpParser.new, true)
+        assert_match(/^Connection: close\r\n/, out.string)
+        refute_match(/keep-alive/, out.string)
+      end
+
+      out = StringIO.new
+      assert_equal false, http_response_write(out, 200, { "content-length" => "0" }, [])
+      assert_match(/^Connection: close\r\n/, out.string)
+    end
+
+    def test_response_head_values
+      out = StringIO.new
+      headers = { "Set-Cookie" => %w(a=1 b=2), "X-Empty" => "\n", "X-Lead" => "\na",
+                  :sym => 1, "Date" => "ignored" }
+      http_response_write(out, 200, headers, [])
+      head = out.string.sub(/^Date: .*\r\n/, '')
+      assert_equal "HTTP/1.1 200 OK\r\nSet-Cookie: a=1\r\nSet-Cookie: b=2\r\n" \
+                   "X-Lead: \r\nX-Lead: a\r\nsym: 1\r\nConnection: close\r\n\r\n", head
+      assert_equal 1, out.string.scan(/^Date: /).size
+    end
+
+    def test_response_start_sent
+      req = HttpParser.new
+      req.response_start_sent = true
+      out = StringIO.new
+      http_response_write(out, 200, {}, [], req)
+      assert_match(/\A200 OK\r\nDate: /, out.string)
+    end
+
+    def test_response_hijack
+      out = StringIO.new
+      hijacked = nil
+      headers = { "rack.hijack" => lambda { |io| hijacked = io } }
+      assert_equal false, http_response_write(out, 200, headers, ["x"], HttpParser.new, true)
+      assert_same out, hijacked
+      assert_match(/Connection: close\r\n\r\n\z/, out.string)
+    end
+
+    def test_write_response_head_reuses_buffer
+      req = HttpParser.new
+      io = File.open(IO::NULL, "w")
+      headers = { "Content-Type" => "text/plain", "Content-Length" => "0" }
+      req.write_response(io, 200, headers, [], true)
+      before = GC.stat(:total_allocated_objects)
+      100.times { req.write_response(io, 200, headers, [], true) }
+      assert_operator GC.stat(:total_allocated_objects) - before, :<, 400
+    ensure
+      io&.close
+    end
+
+    def test_write_response_gathered
+      a, b = UNIXSocket.pair
+      chunks = Array.new(3000) { |i| "#{i}," }
+      body = chunks.join
+      headers = { "Content-Length" => body.bytesize.to_s }
+      reader = Thread.new { b.read }
+      assert_equal true, HttpParser.new.write_response(a, 200, headers, chunks, true)
+
+      # enumerable bodies may reuse their buffer
+      each = Enumerator.new { |y| buf = +""; chunks.each { |c| y << buf.replace(c) } }
+      assert_equal false, HttpParser.new.write_response(a, 200, headers, each, false)
+      a.close
+      responses = reader.value.split(/HTTP\/1\.1 200 OK\r\n.*?\r\n\r\n/m)
+      assert_equal ["", body, body], responses
+    ensure
+      b&.close
+    end
+
+    def test_write_response_streamed
+      a, b = UNIXSocket.pair
+      seen = []
+      body = Enumerator.new do |y|
+        # the head doesn't wait for the first chunk
+        seen << b.readpartial(4096)
+        y << "first"
+        seen << b.readpartial(4096)
+        y << "second"
+        seen << b.readpartial(4096)
+      end
+      assert_equal false, HttpParser.new.write_response(a, 200, {}, body, true)
+      assert_match(/\AHTTP\/1\.1 200 OK\r\n.*\r\n\r\n\z/m, seen[0])
+      assert_equal %w(first second), seen.drop(1)
+    ensure
+      a&.close
+      b&.close
+    end
+
+    def test_write_response_http09
+      r, w = IO.pipe
+      assert_equal false, HttpParser.new.write_response(w, 200, nil, %w(a b), true)
+      w.close
+      assert_equal "ab", r.read
+    ensure
+      r.close
+    end
+
+    def test_cork_responses
+      HttpParser.cork_responses = true
+      server = TCPServer.new("127.0.0.1", 0)
+      client = TCPSocket.new("127.0.0.1", server.addr[1])
+      sock = server.accept
+      reader = Thread.new { client.read }
+      chunks = Array.new(2000) { "x" * 100 }
+      headers = { "Content-Length" => "200000" }
+      assert_equal true, HttpParser.new.write_response(sock, 200, headers, chunks, true)
+      if Socket.const_defined?(:TCP_CORK)
+        assert_equal 0, sock.getsockopt(:IPPROTO_TCP, :TCP_CORK).int
+      end
+      sock.close
+      assert_equal "x" * 200000, reader.value.split("\r\n\r\n", 2)[1]
+    ensure
+      HttpParser.cork_responses = false
+      server&.close
+      client&.close
+    end
+
+    def test_zerocopy_threshold
+      assert_raises(ArgumentError) { HttpParser.zerocopy_threshold = -1 }
+      HttpParser.zerocopy_threshold = 1
+      server = TCPServer.new("127.0.0.1", 0)
+      client = TCPSocket.new("127.0.0.1", server.addr[1])
+      sock = server.accept
+      reader = Thread.new { client.read }
+      body = ["x" * 300_000, "y" * 300_000]
+      expect = body.join
+      headers = { "Content-Length" => expect.bytesize.to_s }
+      assert_equal true, HttpParser.new.write_response(sock, 200, headers, body, true)
+      body[0].replace("z") # the kernel is done with it
+      sock.close
+      assert_equal expect, reader.value.split("\r\n\r\n", 2)[1]
+
+      # UNIX sockets don't support it
+      a, b = UNIXSocket.pair
+      reader = Thread.new { b.read }
+      http_response_write(a, 200, {}, ["ok"])
+      a.close
+      assert_equal "ok", reader.value.split("\r\n\r\n", 2)[1]
+    ensure
+      HttpParser.zerocopy_threshold = 0
+      server&.close
+      client&.close
+      b&.close
+    end
+
+    PathBody = Struct.new(:to_path) do
+      def each
+        yield "read"
+      end
+    end
+
+    def test_write_response_sendfile
+      tmp = Tempfile.new("sendfile")
+      data = (0..255).map(&:chr).join * 1024
+      tmp.write(data)
+      tmp.flush
+      body = PathBody.new(tmp.path)
+      [
+        [200, { "Content-Length" => data.bytesize.to_s }, data],
+        [206, { "Content-Length" => "10", "Content-Range" => "bytes 300-309/#{data.bytesize}" },
+         data[300, 10]],
+        [200, {}, data],
+        [206, { "Content-Type" => "multipart/byteranges" }, "read"],
+      ].each do |status, headers, expect|
+        a, b = UNIXSocket.pair
+        reader = Thread.new { b.read }
+        http_response_write(a, status, headers, body, HttpParser.new, true)
+        a.close
+        assert_equal expect, reader.value.split("\r\n\r\n", 2)[1]
+        b.close
+      end
+
+      a, b = UNIXSocket.pair
+      headers = { "Content-Length" => (data.bytesize + 1).to_s }
+      reader = Thread.new { b.read }
+      assert_raises(EOFError) { http_response_write(a, 200, headers, body) }
+      a.close
+      reader.join
+    ensure
+      tmp&.close!
+      b&.close
+    end
+
+    def test_write_response_not_regular_file
+      a, b = UNIXSocket.pair
+      http_response_write(a, 200, {}, PathBody.new(IO::NULL))
+      a.close
+      assert_equal "read", b.read.split("\r\n\r\n", 2)[1]
+    ensure
+      b&.close
+    end
+
+    def test_write_response_pipe
+      a, b = UNIXSocket.pair
+      r, w = IO.pipe
+      w.write("hello\nworld\n")
+      w.close
+      http_response_write(a, 200, {}, r)
+      a.close
+      assert_equal "hello\nworld\n", b.read.split("\r\n\r\n", 2)[1]
+    ensure
+      r&.close
+      b&.close
+    end
+
+    def test_write_response_chunked
+      trailers = ["a", "", "bc"]
+      def trailers.trailers
+        { "expires" => "0" }
+      end
+      streamed = Enumerator.new { |y| buf = +""; %w(a bc).each { |c| y << buf.replace(c) } }
+      [
+        Chunked::Body.new(%w(hello world)),
+        Chunked::Body.new(streamed),
+        Chunked::TrailerBody.new(trailers),
+      ].each do |body|
+        expect = body.to_enum.to_a.join
+        [StringIO.new, UNIXSocket.pair].each do |out, peer|
+          http_response_write(out, 200, { "Transfer-Encoding" => "chunked" }, body)
+          if peer
+            out.close
+            out = StringIO.new(peer.read)
+            peer.close
+          end
+          assert_equal expect, out.string.split("\r\n\r\n", 2)[1]
+        end
+      end
+      assert_equal "5\r\nhello\r\n5\r\nworld\r\n0\r\n\r\n",
+                   Chunked::Body.new(%w(hello world)).to_enum.to_a.join
+      assert_equal "0\r\nexpires: 0\r\n\r\n", Chunked::TrailerBody.new(trailers).chunked_tail
+    end
+
+    def test_static_response
+      req = HttpParser.new
+      req.buf << "GET /_health HTTP/1.1\r\n\r\n"
+      HttpParser.static_routes = {
+        "/_health" => static_response(200, { "Content-Type" => "text/plain",
+                                             "Content-Length" => "9" }, "OK"),
+      }
+      assert_nil req.read(StringIO.new)
+
+      out = StringIO.new
+      assert_equal true, static_response_write(out, req, true)
+      assert_match(/^Date: /, out.string)
+      assert_equal "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n" \
+                   "Content-Length: 2\r\nConnection: keep-alive\r\n\r\nOK",
+                   out.string.sub(/^Date: .*\r\n/, '')
+    ensure
+      HttpParser.static_routes = {}
+    end
+
+    def test_err_response
+      assert_equal "HTTP/1.1 400 Bad Request\r\n\r\n", err_response(400, false)
+      assert_equal "414 #{STATUS_CODES[414]}\r\n\r\n", err_response(414, true)
+      assert_same err_response(413, false), err_response(413, false)
+      assert_predicate err_response(413, false), :frozen?
+    end
+
     def test_unknown_status_pass_through
       out = StringIO.new
       http_response_write(out,"666 I AM THE BEAST", {}, [] )
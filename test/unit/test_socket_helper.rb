@@ -197,4 +197,20 @@ def test_reuseport
   rescue Errno::ENOPROTOOPT
     # kernel does not support SO_REUSEPORT (older Linux)
   end
+
+  def test_tcp_nopush_flush
+    return unless NOPUSH
+    port = unused_port @test_addr
+    sock = bind_listen("#@test_addr:#{port}", :tcp_nopush => true)
+    client = TCPSocket.new(@test_addr, port)
+    accepted = sock.accept
+    accepted.setsockopt(:IPPROTO_TCP, NOPUSH, 1)
+    accepted.write("OK")
+    tcp_nopush_flush(accepted)
+    assert client.wait_readable(0.1), "flushed before the 200ms cork timer"
+    assert_equal "OK", client.read_nonblock(2)
+    assert_operator accepted.getsockopt(:IPPROTO_TCP, NOPUSH).int, :>, 0
+  ensure
+    [ client, accepted, sock ].each { |io| io.close if io }
+  end
 end
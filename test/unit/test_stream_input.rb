@@ -184,6 +184,32 @@ def test_gets_read_mix_big
     assert_nil si.gets
   end
 
+  def test_body_min_rate
+    Pitchfork::StreamInput.body_min_rate = 1000
+    r = init_request('', 1500)
+    si = Pitchfork::StreamInput.new(@rd, r)
+    @wr.write('a' * 1000)
+    assert_equal 'a' * 1000, si.read(1000)
+
+    t0 = Pitchfork.time_now
+    assert_raises(Pitchfork::RequestTimeoutError) { si.read(500) }
+    assert_operator Pitchfork.time_now - t0, :<, 5
+  ensure
+    Pitchfork::StreamInput.body_min_rate = 0
+  end
+
+  def test_body_min_rate_late_read
+    Pitchfork::StreamInput.body_min_rate = 1000
+    r = init_request('', 1500)
+    si = Pitchfork::StreamInput.new(@rd, r)
+    sleep 1.2 # the app takes its time before reading the body
+    th = Thread.new { sleep 0.2; @wr.write('a' * 1500) }
+    assert_equal 'a' * 1500, si.read(1500)
+  ensure
+    th&.join
+    Pitchfork::StreamInput.body_min_rate = 0
+  end
+
   def init_request(body, size = nil)
     @parser = Pitchfork::HttpParser.new
     body = body.to_s.freeze